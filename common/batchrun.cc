@@ -0,0 +1,275 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "core_main.h"
+#include "core_commands2.h"
+#include "core_globals.h"
+#include "core_helpers.h"
+#include "core_variables.h"
+#include "shell_spool.h"
+
+/* Headless program runner
+ * Loads a state file and/or program files, XEQs a global label with the
+ * given stack inputs, runs it to completion without ever yielding to a user
+ * interface, and writes the printer output, the final stack, and ALPHA to
+ * stdout.
+ */
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-s <state-file>] [-p <program-file>]... <label> [<input>...]\n"
+                    "Program files ending in .raw are imported; anything else is read as text.\n"
+                    "Inputs are pushed onto the stack in order, so the last one ends up in X;\n"
+                    "inputs that aren't numbers are pushed as strings.\n"
+                    "Build date: %s\n", argv0, __DATE__);
+}
+
+static void stdout_writer(const char *text, int length) {
+    fwrite(text, 1, length, stdout);
+}
+
+static void stdout_newliner() {
+    fputc('\n', stdout);
+}
+
+static void print_hp(FILE *out, const char *prefix, const char *text, int length) {
+    char *buf = (char *) malloc(5 * length + 1);
+    if (buf == NULL)
+        return;
+    int len = hp2ascii(buf, text, length);
+    fprintf(out, "%s%.*s\n", prefix, len, buf);
+    free(buf);
+}
+
+static bool load_programs(const char *name) {
+    int len = strlen(name);
+    if (len >= 4 && strcasecmp(name + (len - 4), ".raw") == 0) {
+        FILE *f = fopen(name, "rb");
+        if (f == NULL) {
+            fprintf(stderr, "Can't open program file \"%s\": %s\n", name, strerror(errno));
+            return false;
+        }
+        fclose(f);
+        core_import_programs(0, name);
+        return true;
+    }
+
+    std::ifstream in(name);
+    if (in.fail()) {
+        fprintf(stderr, "Can't open program file \"%s\": %s\n", name, strerror(errno));
+        return false;
+    }
+    std::stringstream txtbuf;
+    txtbuf << in.rdbuf();
+    flags.f.prgm_mode = 1;
+    goto_dot_dot(false);
+    core_paste(txtbuf.str().c_str());
+    flags.f.prgm_mode = 0;
+    return true;
+}
+
+static bool parse_number(const char *s, phloat *d) {
+    int len = strlen(s);
+    if (len == 0 || len > 50 || strspn(s, "0123456789.,eE+-") != len
+            || strpbrk(s, "0123456789") == NULL)
+        return false;
+    /* string2phloat() wants the exponent marker in HP-42S encoding */
+    char buf[50];
+    for (int i = 0; i < len; i++)
+        buf[i] = s[i] == 'e' || s[i] == 'E' ? 24 : s[i];
+    return string2phloat(buf, len, d) == 0;
+}
+
+static bool push_input(const char *s) {
+    vartype *v;
+    phloat d;
+    int len = strlen(s);
+    if (parse_number(s, &d)) {
+        v = new_real(d);
+    } else {
+        char *hp = (char *) malloc(len + 1);
+        if (hp == NULL)
+            return false;
+        int hplen = ascii2hp(hp, len, s, len);
+        v = new_string(hp, hplen);
+        free(hp);
+    }
+    return v != NULL && recall_result(v) == ERR_NONE;
+}
+
+int main(int argc, char *argv[]) {
+    const char *state_file = NULL;
+    int argi = 1;
+    while (argi < argc - 1 && strcmp(argv[argi], "-s") == 0) {
+        state_file = argv[argi + 1];
+        argi += 2;
+    }
+
+    int rows = 8, cols = 22;
+    core_init(&rows, &cols, state_file != NULL, state_file);
+
+    while (argi < argc - 1 && strcmp(argv[argi], "-p") == 0) {
+        if (!load_programs(argv[argi + 1]))
+            return 1;
+        argi += 2;
+    }
+    if (argi >= argc || argv[argi][0] == '-') {
+        usage(argv[0]);
+        return 1;
+    }
+
+    arg_struct arg;
+    arg.type = ARGTYPE_STR;
+    arg.length = ascii2hp(arg.val.text, 7, argv[argi++]);
+
+    for (; argi < argc; argi++) {
+        if (!push_input(argv[argi])) {
+            fprintf(stderr, "Can't push input \"%s\"\n", argv[argi]);
+            return 1;
+        }
+    }
+
+    /* PRON, and set flag 21, so that VIEW and AVIEW print as well */
+    flags.f.printer_exists = 1;
+    flags.f.printer_enable = 1;
+    int err = docmd_xeq(&arg);
+    if (err == ERR_RUN) {
+        set_running(true);
+        bool enqueued;
+        int repeat;
+        while (core_keydown(0, &enqueued, &repeat));
+        /* The core only stops with ERR_NONE when the program returns
+         * from its top level; anything else is an error, or a STOP,
+         * PROMPT, or INPUT that nobody is around to answer. */
+        err = mode_stop_reason;
+        if (err == -1) {
+            print_hp(stderr, "Error: ", lasterr_text, lasterr_length);
+            return 2;
+        }
+        if (err == ERR_STOP) {
+            fprintf(stderr, "Program stopped\n");
+            return 2;
+        }
+    }
+    if (err != ERR_NONE && err != ERR_YES && err != ERR_NO) {
+        print_hp(stderr, "Error: ", errors[err].text, errors[err].length);
+        return 2;
+    }
+
+    char buf[100];
+    for (int i = 0; i <= sp; i++) {
+        char prefix[16];
+        if (flags.f.big_stack)
+            snprintf(prefix, 16, "%d: ", sp - i + 1);
+        else
+            snprintf(prefix, 16, "%c: ", "TZYX"[i]);
+        int len = vartype2string(stack[i], buf, 100);
+        print_hp(stdout, prefix, buf, len);
+    }
+    print_hp(stdout, "ALPHA: ", reg_alpha, reg_alpha_length);
+    return 0;
+}
+
+const char *shell_platform() {
+    return NULL;
+}
+
+void shell_blitter(const char *bits, int bytesperline, int x, int y,
+                             int width, int height) {
+    //
+}
+
+void shell_beeper(int tone) {
+    //
+}
+
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    //
+}
+
+bool shell_wants_cpu() {
+    return false;
+}
+
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    free(buf);
+}
+
+void shell_delay(int duration) {
+    //
+}
+
+void shell_request_timeout3(int delay) {
+    //
+}
+
+void shell_request_display_size(int rows, int cols) {
+    //
+}
+
+uint8 shell_get_mem() {
+    return 0;
+}
+
+bool shell_low_battery() {
+    return false;
+}
+
+void shell_powerdown() {
+    //
+}
+
+int8 shell_random_seed() {
+    return 0;
+}
+
+uint4 shell_milliseconds() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint4) (tv.tv_sec * 1000L + tv.tv_usec / 1000);
+}
+
+const char *shell_number_format() {
+    return ".";
+}
+
+void shell_set_skin_mode(int mode) {
+    //
+}
+
+int shell_date_format() {
+    return 0;
+}
+
+bool shell_clk24() {
+    return false;
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    if (text != NULL)
+        shell_spool_txt(text, length, stdout_writer, stdout_newliner);
+    else
+        shell_spool_bitmap_to_txt(bits, bytesperline, x, y, width, height, stdout_writer, stdout_newliner);
+}
+
+void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
+    *time = 0;
+    *date = 15821015;
+    *weekday = 5;
+}
+
+void shell_message(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+void shell_log(const char *message) {
+    //
+}
@@ -0,0 +1,487 @@
+#include <new>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "core_main.h"
+#include "core_commands1.h"
+#include "core_commands2.h"
+#include "core_globals.h"
+#include "core_helpers.h"
+#include "core_variables.h"
+#include "shell_spool.h"
+
+/* Benchmark suite
+ * Runs a fixed set of calculator programs, and reports, for each one, the
+ * number of program lines executed, the wall-clock time, and the number of
+ * heap allocations, as one JSON object per line on stdout. The programs are
+ * deterministic (RAN is seeded, the clock and random seed stubs are fixed),
+ * so the instruction counts and results are the same from run to run, and
+ * only the times should vary.
+ * Heap allocations are counted by linking with --wrap for malloc(), calloc(),
+ * and realloc(); see the 'benchmark' target in the Makefile.
+ */
+
+#ifdef BCD_MATH
+#define BUILD_NAME "decimal"
+#else
+#define BUILD_NAME "binary"
+#endif
+
+static const char *corpus =
+    "00 { Benchmarks }\n"
+    // Tight RCL/STO/DSE loop on numbered registers
+    "LBL \"LOOP\"\n"
+    "0\n"
+    "STO 00\n"
+    "1000000\n"
+    "STO 01\n"
+    "LBL 01\n"
+    "RCL 01\n"
+    "STO+ 00\n"
+    "DSE 01\n"
+    "GTO 01\n"
+    "RCL 00\n"
+    "RTN\n"
+    // Nested ISG/DSE loops on named variables
+    "LBL \"ISG\"\n"
+    "0\n"
+    "STO \"S\"\n"
+    "2500\n"
+    "STO \"J\"\n"
+    "LBL 02\n"
+    "1.2\n"
+    "STO \"I\"\n"
+    "LBL 03\n"
+    "RCL \"I\"\n"
+    "IP\n"
+    "STO+ \"S\"\n"
+    "ISG \"I\"\n"
+    "GTO 03\n"
+    "DSE \"J\"\n"
+    "GTO 02\n"
+    "RCL \"S\"\n"
+    "RTN\n"
+    // Doubly recursive Fibonacci, with FUNC and local variables
+    "LBL \"FIB\"\n"
+    "FUNC 11\n"
+    "LSTO \"N\"\n"
+    "2\n"
+    "X>Y?\n"
+    "GTO 04\n"
+    "RCL \"N\"\n"
+    "1\n"
+    "-\n"
+    "XEQ \"FIB\"\n"
+    "RCL \"N\"\n"
+    "2\n"
+    "-\n"
+    "XEQ \"FIB\"\n"
+    "+\n"
+    "RTN\n"
+    "LBL 04\n"
+    "RCL \"N\"\n"
+    "RTN\n"
+    // Building a list one element at a time
+    "LBL \"LIST\"\n"
+    "20000\n"
+    "STO \"I\"\n"
+    "NEWLIST\n"
+    "LBL 05\n"
+    "RCL \"I\"\n"
+    "APPEND\n"
+    "DSE \"I\"\n"
+    "GTO 05\n"
+    "LENGTH\n"
+    "RTN\n"
+    // Building a string one piece at a time
+    "LBL \"STR\"\n"
+    "20000\n"
+    "STO \"I\"\n"
+    "XSTR \"\"\n"
+    "LBL 06\n"
+    "XSTR \"ab\"\n"
+    "APPEND\n"
+    "DSE \"I\"\n"
+    "GTO 06\n"
+    "LENGTH\n"
+    "RTN\n"
+    // INVRT and a linear system with a 200x200 random matrix
+    "LBL \"MAT\"\n"
+    "0.5\n"
+    "SEED\n"
+    "200\n"
+    "ENTER\n"
+    "NEWMAT\n"
+    "STO \"M\"\n"
+    "INDEX \"M\"\n"
+    "LBL 07\n"
+    "RAN\n"
+    "STOEL\n"
+    "J+\n"
+    "FC? 77\n"
+    "GTO 07\n"
+    "200\n"
+    "ENTER\n"
+    "4\n"
+    "NEWMAT\n"
+    "STO \"B\"\n"
+    "INDEX \"B\"\n"
+    "LBL 08\n"
+    "RAN\n"
+    "STOEL\n"
+    "J+\n"
+    "FC? 77\n"
+    "GTO 08\n"
+    "RCL \"M\"\n"
+    "INVRT\n"
+    "FNRM\n"
+    "RCL \"B\"\n"
+    "RCL \"M\"\n"
+    "/\n"
+    "FNRM\n"
+    "+\n"
+    "RTN\n"
+    // SOLVE on an equation, from 500 different starting points
+    "LBL \"SOLVE\"\n"
+    "RAD\n"
+    "'COS(X)-X'\n"
+    "EQNSLV ST X\n"
+    "500\n"
+    "STO \"I\"\n"
+    "LBL 09\n"
+    "RCL \"I\"\n"
+    "STO \"X\"\n"
+    "-1\n"
+    "SOLVE \"X\"\n"
+    "DSE \"I\"\n"
+    "GTO 09\n"
+    "RTN\n"
+    // INTEG on an equation, over 50 different intervals
+    "LBL \"INTEG\"\n"
+    "RAD\n"
+    "'SIN(X)/(X^2+1)'\n"
+    "EQNINT ST X\n"
+    "0\n"
+    "STO \"LLIM\"\n"
+    "1E-10\n"
+    "STO \"ACC\"\n"
+    "0\n"
+    "STO \"S\"\n"
+    "50\n"
+    "STO \"I\"\n"
+    "LBL 12\n"
+    "RCL \"I\"\n"
+    "STO \"ULIM\"\n"
+    "INTEG \"X\"\n"
+    "STO+ \"S\"\n"
+    "DSE \"I\"\n"
+    "GTO 12\n"
+    "RCL \"S\"\n"
+    "RTN\n"
+    // Repeated PLOT scans of an equation
+    "LBL \"PLOT\"\n"
+    "RAD\n"
+    "'SIN(X)*X'\n"
+    "EQNPLOT ST X\n"
+    "XAXIS \"X\"\n"
+    "-10\n"
+    "XMIN\n"
+    "10\n"
+    "XMAX\n"
+    "-10\n"
+    "YMIN\n"
+    "10\n"
+    "YMAX\n"
+    "200\n"
+    "STO \"I\"\n"
+    "LBL 10\n"
+    "PLOT\n"
+    "DSE \"I\"\n"
+    "GTO 10\n"
+    "RTN\n"
+    // Unit arithmetic and conversions
+    "LBL \"UNITS\"\n"
+    "20000\n"
+    "STO \"I\"\n"
+    "0\n"
+    "STO \"S\"\n"
+    "LBL 11\n"
+    "RCL \"I\"\n"
+    "1_km\n"
+    "*\n"
+    "1_mi\n"
+    "CONVERT\n"
+    "UVAL\n"
+    "STO+ \"S\"\n"
+    "DSE \"I\"\n"
+    "GTO 11\n"
+    "RCL \"S\"\n"
+    "END\n";
+
+struct benchmark_spec {
+    const char *name;
+    const char *label;
+    int input;
+};
+
+static const benchmark_spec benchmarks[] = {
+    { "rcl_sto_loop",  "LOOP",  0 },
+    { "isg_loop",      "ISG",   0 },
+    { "xeq_recursion", "FIB",   22 },
+    { "list_append",   "LIST",  0 },
+    { "string_append", "STR",   0 },
+    { "matrix_invrt",  "MAT",   0 },
+    { "solve",         "SOLVE", 0 },
+    { "integ",         "INTEG", 0 },
+    { "plot",          "PLOT",  0 },
+    { "units",         "UNITS", 0 },
+    { NULL,            NULL,    0 }
+};
+
+/* Allocation counting */
+
+static uint8 allocations = 0;
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+}
+}
+
+void *operator new(size_t size) {
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) {
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void json_string(const char *s, int len) {
+    putchar('"');
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 32)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static bool run_benchmark(const benchmark_spec *b) {
+    arg_struct arg;
+    arg.type = ARGTYPE_STR;
+    arg.length = strlen(b->label);
+    memcpy(arg.val.text, b->label, arg.length);
+
+    docmd_clst(NULL);
+    if (b->input != 0)
+        recall_result(new_real(b->input));
+
+    uint8 instr = instructions_executed;
+    uint8 allocs = allocations;
+    double t = now();
+
+    int err = docmd_xeq(&arg);
+    if (err == ERR_RUN) {
+        set_running(true);
+        bool enqueued;
+        int repeat;
+        while (core_keydown(0, &enqueued, &repeat));
+        // ERR_NONE only if the program returned from its top level,
+        // whether through RTN or END
+        err = mode_stop_reason;
+    }
+
+    t = now() - t;
+    instr = instructions_executed - instr;
+    allocs = allocations - allocs;
+
+    char buf[100];
+    int len = vartype2string(stack[sp], buf, 100);
+    char result[500];
+    len = hp2ascii(result, buf, len);
+
+    printf("{\"benchmark\":\"%s\",\"build\":\"%s\",\"instructions\":%llu,"
+           "\"seconds\":%.6f,\"instructions_per_second\":%.0f,"
+           "\"allocations\":%llu,\"ok\":%s,\"result\":",
+           b->name, BUILD_NAME, instr, t, t == 0 ? 0.0 : instr / t,
+           allocs, err == ERR_NONE ? "true" : "false");
+    json_string(result, len);
+    printf("}\n");
+    fflush(stdout);
+    return err == ERR_NONE;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s [<benchmark>...]\nBuild date: %s\n", argv[0], __DATE__);
+        for (const benchmark_spec *b = benchmarks; b->name != NULL; b++)
+            fprintf(stderr, "  %s\n", b->name);
+        return 1;
+    }
+
+    int rows = 8, cols = 22;
+    core_init(&rows, &cols, 0, NULL);
+    flags.f.prgm_mode = 1;
+    core_paste(corpus);
+    flags.f.prgm_mode = 0;
+    /* Plain, fixed number format for the results */
+    flags.f.thousands_separators = 0;
+
+    bool ok = true;
+    for (const benchmark_spec *b = benchmarks; b->name != NULL; b++) {
+        if (argc > 1) {
+            int i;
+            for (i = 1; i < argc; i++)
+                if (strcmp(argv[i], b->name) == 0)
+                    break;
+            if (i == argc)
+                continue;
+        }
+        if (!run_benchmark(b))
+            ok = false;
+    }
+    return ok ? 0 : 2;
+}
+
+const char *shell_platform() {
+    return NULL;
+}
+
+void shell_blitter(const char *bits, int bytesperline, int x, int y,
+                             int width, int height) {
+    //
+}
+
+void shell_beeper(int tone) {
+    //
+}
+
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    //
+}
+
+bool shell_wants_cpu() {
+    return false;
+}
+
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    free(buf);
+}
+
+void shell_delay(int duration) {
+    //
+}
+
+void shell_request_timeout3(int delay) {
+    //
+}
+
+void shell_request_display_size(int rows, int cols) {
+    //
+}
+
+uint8 shell_get_mem() {
+    return 0;
+}
+
+bool shell_low_battery() {
+    return false;
+}
+
+void shell_powerdown() {
+    //
+}
+
+int8 shell_random_seed() {
+    return 0;
+}
+
+uint4 shell_milliseconds() {
+    return 0;
+}
+
+const char *shell_number_format() {
+    return ".";
+}
+
+void shell_set_skin_mode(int mode) {
+    //
+}
+
+int shell_date_format() {
+    return 0;
+}
+
+bool shell_clk24() {
+    return false;
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    //
+}
+
+void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
+    *time = 0;
+    *date = 15821015;
+    *weekday = 5;
+}
+
+void shell_message(const char *message) {
+    //
+}
+
+void shell_log(const char *message) {
+    //
+}
@@ -694,6 +694,7 @@ int docmd_clsigma(arg_struct *arg) {
         return ERR_SIZE_ERROR;
     if (regs->type != TYPE_REALMATRIX)
         return ERR_INVALID_TYPE;
+    journal_touch(regs);
     r = (vartype_realmatrix *) regs;
     size = r->rows * r->columns;
     if (last > size)
@@ -359,6 +359,7 @@ int docmd_delr(arg_struct *arg) {
     err = matedit_get(&m);
     if (err != ERR_NONE)
         return err;
+    journal_touch(m);
 
     if (m->type == TYPE_REALMATRIX) {
         rm = (vartype_realmatrix *) m;
@@ -46,6 +46,7 @@ int docmd_insr(arg_struct *arg) {
     err = matedit_get(&m);
     if (err != ERR_NONE)
         return err;
+    journal_touch(m);
 
     interactive = matedit_mode == 2 || matedit_mode == 3;
     if (interactive && sp != -1) {
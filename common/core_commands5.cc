@@ -2105,6 +2105,8 @@ static int sigma_helper_1(int weight) {
         return ERR_SIZE_ERROR;
     if (regs->type != TYPE_REALMATRIX)
         return ERR_INVALID_TYPE;
+    // The summation registers are updated in place
+    journal_touch(regs);
     r = (vartype_realmatrix *) regs;
     size = r->rows * r->columns;
     if (last > size)
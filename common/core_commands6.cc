@@ -704,6 +704,31 @@ int docmd_inv(arg_struct *arg) {
     return err;
 }
 
+/* Returns the function implementing the given command for real arguments,
+ * or NULL if there isn't one. Note that a real argument can still produce a
+ * complex result, as with SQRT(-1); the functions returned here return
+ * ERR_INVALID_DATA in those cases, and the caller should then fall back on
+ * executing the actual command.
+ */
+mappable_r real_unary_function(int cmd) {
+    switch (cmd) {
+        case CMD_SIN: return mappable_sin_r;
+        case CMD_COS: return mappable_cos_r;
+        case CMD_TAN: return mappable_tan_r;
+        case CMD_ASIN: return mappable_asin_r;
+        case CMD_ACOS: return mappable_acos_r;
+        case CMD_ATAN: return mappable_atan_r;
+        case CMD_LOG: return mappable_log_r;
+        case CMD_10_POW_X: return mappable_10_pow_x_r;
+        case CMD_LN: return mappable_ln_r;
+        case CMD_E_POW_X: return mappable_e_pow_x_r;
+        case CMD_SQRT: return mappable_sqrt_r;
+        case CMD_SQUARE: return mappable_square_r;
+        case CMD_INV: return mappable_inv_r;
+        default: return NULL;
+    }
+}
+
 int docmd_y_pow_x(arg_struct *arg) {
     phloat yr, yphi;
     int inf;
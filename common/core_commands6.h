@@ -20,6 +20,7 @@
 
 #include "free42.h"
 #include "core_globals.h"
+#include "core_sto_rcl.h"
 
 int docmd_sin(arg_struct *arg);
 int docmd_cos(arg_struct *arg);
@@ -40,4 +41,6 @@ int docmd_x_swap_f(arg_struct *arg);
 int docmd_rclflag(arg_struct *arg);
 int docmd_stoflag(arg_struct *arg);
 
+mappable_r real_unary_function(int cmd);
+
 #endif
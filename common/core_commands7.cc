@@ -15,6 +15,9 @@
  * along with this program; if not, see http://www.gnu.org/licenses/.
  *****************************************************************************/
 
+#include <chrono>
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -2353,3 +2356,285 @@ int docmd_from_list(arg_struct *arg) {
     print_trace();
     return ERR_NONE;
 }
+
+////////////////////
+///// Profiler /////
+////////////////////
+
+/* While profiling is on, continue_running() calls profile_record() after
+ * every instruction, and it accumulates per-line and per-command counts and
+ * times here. The per-line table is an open-addressing hash, keyed on
+ * directory, program, and pc; an entry with count == 0 is empty.
+ */
+
+#define PROFILE_REPORT_ROWS 100
+#define PROFILE_PRINT_ROWS 10
+
+struct profile_line {
+    int dir;
+    int idx;
+    int4 pc;
+    uint4 count;
+    uint8 nanos;
+};
+
+bool profiling = false;
+static profile_line *profile_lines = NULL;
+static int profile_lines_capacity = 0;
+static int profile_lines_count = 0;
+static uint4 profile_cmd_count[CMD_SENTINEL];
+static uint8 profile_cmd_nanos[CMD_SENTINEL];
+
+uint8 profile_clock() {
+    return (uint8) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int profile_hash(int dir, int idx, int4 pc) {
+    uint4 h = (uint4) pc * 2654435761u;
+    h ^= (uint4) idx * 40503u + (uint4) dir;
+    return (int) (h & (profile_lines_capacity - 1));
+}
+
+static bool profile_grow() {
+    int newcap = profile_lines_capacity == 0 ? 256 : profile_lines_capacity * 2;
+    profile_line *newlines = (profile_line *) calloc(newcap, sizeof(profile_line));
+    if (newlines == NULL)
+        return false;
+    profile_line *oldlines = profile_lines;
+    int oldcap = profile_lines_capacity;
+    profile_lines = newlines;
+    profile_lines_capacity = newcap;
+    for (int i = 0; i < oldcap; i++) {
+        profile_line *p = oldlines + i;
+        if (p->count == 0)
+            continue;
+        int h = profile_hash(p->dir, p->idx, p->pc);
+        while (profile_lines[h].count != 0)
+            h = (h + 1) & (newcap - 1);
+        profile_lines[h] = *p;
+    }
+    free(oldlines);
+    return true;
+}
+
+void profile_record(pgm_index prgm, int4 pc, int cmd, uint8 start) {
+    uint8 nanos = profile_clock() - start;
+    profile_cmd_count[cmd]++;
+    profile_cmd_nanos[cmd] += nanos;
+
+    if (profile_lines_count * 2 >= profile_lines_capacity && !profile_grow())
+        /* Out of memory; the command totals are still accurate */
+        return;
+    int h = profile_hash(prgm.dir, prgm.idx, pc);
+    while (true) {
+        profile_line *p = profile_lines + h;
+        if (p->count == 0) {
+            p->dir = prgm.dir;
+            p->idx = prgm.idx;
+            p->pc = pc;
+            p->count = 1;
+            p->nanos = nanos;
+            profile_lines_count++;
+            return;
+        }
+        if (p->pc == pc && p->idx == prgm.idx && p->dir == prgm.dir) {
+            p->count++;
+            p->nanos += nanos;
+            return;
+        }
+        h = (h + 1) & (profile_lines_capacity - 1);
+    }
+}
+
+static void profile_clear() {
+    free(profile_lines);
+    profile_lines = NULL;
+    profile_lines_capacity = 0;
+    profile_lines_count = 0;
+    memset(profile_cmd_count, 0, sizeof(profile_cmd_count));
+    memset(profile_cmd_nanos, 0, sizeof(profile_cmd_nanos));
+}
+
+int docmd_pfon(arg_struct *arg) {
+    profile_clear();
+    profiling = true;
+    return ERR_NONE;
+}
+
+int docmd_pfoff(arg_struct *arg) {
+    profiling = false;
+    return ERR_NONE;
+}
+
+static int profile_line_compare(const void *a, const void *b) {
+    const profile_line *pa = *(const profile_line **) a;
+    const profile_line *pb = *(const profile_line **) b;
+    return pa->nanos < pb->nanos ? 1 : pa->nanos > pb->nanos ? -1 : 0;
+}
+
+static int profile_cmd_compare(const void *a, const void *b) {
+    uint8 na = profile_cmd_nanos[*(const int *) a];
+    uint8 nb = profile_cmd_nanos[*(const int *) b];
+    return na < nb ? 1 : na > nb ? -1 : 0;
+}
+
+/* Name of a profiled program: its first global label, or "EQN" for
+ * compiled equations. Returns false if the program no longer exists.
+ */
+static bool profile_prgm_name(const profile_line *p, const char **name, int *length) {
+    directory *dir = get_dir(p->dir);
+    if (dir == NULL || p->idx < 0 || p->idx >= dir->prgms_count
+            || p->pc >= dir->prgms[p->idx].size)
+        return false;
+    if (dir == eq_dir) {
+        *name = "EQN";
+        *length = 3;
+        return true;
+    }
+    for (int i = 0; i < dir->labels_count; i++) {
+        label_struct *lbl = dir->labels + i;
+        if (lbl->prgm == p->idx && lbl->length > 0) {
+            *name = lbl->name;
+            *length = lbl->length;
+            return true;
+        }
+    }
+    *name = "?";
+    *length = 1;
+    return true;
+}
+
+/* Number and string literals have no command name of their own */
+static void profile_cmd_name(int cmd, const char **name, int *length) {
+    if (cmd == CMD_NUMBER) {
+        *name = "NUMBER";
+        *length = 6;
+    } else if (cmd == CMD_STRING) {
+        *name = "STRING";
+        *length = 6;
+    } else {
+        *name = cmd_array[cmd].name;
+        *length = cmd_array[cmd].name_length;
+    }
+}
+
+static phloat nanos_to_ms(uint8 nanos) {
+    return phloat((int8) nanos) / 1000000;
+}
+
+static int nanos_to_text(uint8 nanos, char *buf, int buflen) {
+    uint8 us = nanos / 1000;
+    return snprintf(buf, buflen, "%llu.%03llums", us / 1000, us % 1000);
+}
+
+/* PFRPT: store the hottest program lines in PFLN, as rows of
+ * [ label, line, count, ms ], and the hottest commands in PFCMD, as rows of
+ * [ name, count, ms ], both sorted by time, and print the first few of each
+ * if the printer is on.
+ */
+int docmd_pfrpt(arg_struct *arg) {
+    if (profile_lines_count == 0)
+        return ERR_NONEXISTENT;
+
+    profile_line **lines = (profile_line **) malloc(profile_lines_count * sizeof(profile_line *));
+    int *cmds = (int *) malloc(CMD_SENTINEL * sizeof(int));
+    vartype *pfln = NULL, *pfcmd = NULL;
+    int err = ERR_INSUFFICIENT_MEMORY;
+    int nlines = 0, ncmds = 0, rows;
+    if (lines == NULL || cmds == NULL)
+        goto done;
+
+    for (int i = 0; i < profile_lines_capacity; i++)
+        if (profile_lines[i].count != 0)
+            lines[nlines++] = profile_lines + i;
+    qsort(lines, nlines, sizeof(profile_line *), profile_line_compare);
+    for (int i = 0; i < CMD_SENTINEL; i++)
+        if (profile_cmd_count[i] != 0)
+            cmds[ncmds++] = i;
+    qsort(cmds, ncmds, sizeof(int), profile_cmd_compare);
+
+    rows = nlines < PROFILE_REPORT_ROWS ? nlines : PROFILE_REPORT_ROWS;
+    pfln = new_realmatrix(rows, 4);
+    if (pfln == NULL)
+        goto done;
+    for (int i = 0; i < rows; i++) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) pfln;
+        const profile_line *p = lines[i];
+        const char *name;
+        int length;
+        pgm_index prgm;
+        prgm.dir = p->dir;
+        prgm.idx = p->idx;
+        if (profile_prgm_name(p, &name, &length)) {
+            if (!put_matrix_string(rm, i * 4, name, length))
+                goto done;
+            rm->array->data[i * 4 + 1] = global_pc2line(prgm, p->pc);
+        }
+        rm->array->data[i * 4 + 2] = (int8) p->count;
+        rm->array->data[i * 4 + 3] = nanos_to_ms(p->nanos);
+    }
+
+    rows = ncmds < PROFILE_REPORT_ROWS ? ncmds : PROFILE_REPORT_ROWS;
+    pfcmd = new_realmatrix(rows, 3);
+    if (pfcmd == NULL)
+        goto done;
+    for (int i = 0; i < rows; i++) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) pfcmd;
+        const char *name;
+        int length;
+        profile_cmd_name(cmds[i], &name, &length);
+        if (!put_matrix_string(rm, i * 3, name, length))
+            goto done;
+        rm->array->data[i * 3 + 1] = (int8) profile_cmd_count[cmds[i]];
+        rm->array->data[i * 3 + 2] = nanos_to_ms(profile_cmd_nanos[cmds[i]]);
+    }
+
+    err = store_var("PFLN", 4, pfln);
+    if (err != ERR_NONE)
+        goto done;
+    pfln = NULL;
+    err = store_var("PFCMD", 5, pfcmd);
+    if (err != ERR_NONE)
+        goto done;
+    pfcmd = NULL;
+
+    if (flags.f.printer_exists) {
+        char lbuf[24], rbuf[24];
+        int llen, rlen;
+        print_text(NULL, 0, true);
+        print_text("Profile: lines", 14, true);
+        for (int i = 0; i < nlines && i < PROFILE_PRINT_ROWS; i++) {
+            const profile_line *p = lines[i];
+            const char *name;
+            int length;
+            pgm_index prgm;
+            prgm.dir = p->dir;
+            prgm.idx = p->idx;
+            if (!profile_prgm_name(p, &name, &length))
+                continue;
+            llen = length > 7 ? 7 : length;
+            memcpy(lbuf, name, llen);
+            llen += snprintf(lbuf + llen, 24 - llen, " %d", global_pc2line(prgm, p->pc));
+            rlen = snprintf(rbuf, 24, "%u ", p->count);
+            rlen += nanos_to_text(p->nanos, rbuf + rlen, 24 - rlen);
+            print_wide(lbuf, llen, rbuf, rlen);
+        }
+        print_text("Profile: functions", 18, true);
+        for (int i = 0; i < ncmds && i < PROFILE_PRINT_ROWS; i++) {
+            const char *name;
+            int length;
+            profile_cmd_name(cmds[i], &name, &length);
+            rlen = snprintf(rbuf, 24, "%u ", profile_cmd_count[cmds[i]]);
+            rlen += nanos_to_text(profile_cmd_nanos[cmds[i]], rbuf + rlen, 24 - rlen);
+            print_wide(name, length, rbuf, rlen);
+        }
+    }
+
+    done:
+    free(lines);
+    free(cmds);
+    free_vartype(pfln);
+    free_vartype(pfcmd);
+    return err;
+}
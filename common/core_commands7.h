@@ -132,4 +132,12 @@ int docmd_newlist(arg_struct *arg);
 int docmd_to_list(arg_struct *arg);
 int docmd_from_list(arg_struct *arg);
 
+int docmd_pfon(arg_struct *arg);
+int docmd_pfoff(arg_struct *arg);
+int docmd_pfrpt(arg_struct *arg);
+
+extern bool profiling;
+uint8 profile_clock();
+void profile_record(pgm_index prgm, int4 pc, int cmd, uint8 start);
+
 #endif
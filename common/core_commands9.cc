@@ -209,6 +209,7 @@ int docmd_rename(arg_struct *arg) {
     if (pos2 != -1)
         return ERR_DIRECTORY_EXISTS;
     string_copy(cwd->children[pos].name, &cwd->children[pos].length, reg_alpha, reg_alpha_length);
+    journal_mark_structure();
     return ERR_NONE;
 }
 
@@ -457,6 +458,9 @@ static int ref_move_copy(bool copy) {
     // we've been asked to move exist, and all arrays have been sized
     // sufficiently large.
 
+    // Moving things between directories can't be journaled
+    journal_mark_structure();
+
     if (dirs > 0) {
 
         // First, move the directories. Since no directories are created or
@@ -525,6 +529,9 @@ static int ref_move_copy(bool copy) {
         cwd->children = new_children;
         cwd->children_count = new_children_count;
         cwd->children_capacity = new_children_capacity;
+        // Moved directories have new ancestors, so variable lookups from
+        // inside them may now resolve differently
+        invalidate_var_lookups();
 
         // Directories done!
 
@@ -546,6 +553,7 @@ static int ref_move_copy(bool copy) {
                 // directory, while we are moving or copying programs in:
                 // remove the empty program, similarly to how we treat
                 // such empty programs during import.
+                invalidate_decoded_prgms();
                 free(cwd->prgms[i].text);
                 goto skip3;
             }
@@ -638,6 +646,7 @@ static int ref_move_copy(bool copy) {
                     if (string_equals(new_vars[i].name, new_vars[i].length, dir->vars[j].name, dir->vars[j].length)) {
                         memmove(dir->vars + j, dir->vars + j + 1, (dir->vars_count - j - 1) * sizeof(var_struct));
                         dir->vars_count--;
+                        dir->vars_changed();
                         break;
                     }
             }
@@ -675,6 +684,7 @@ static int ref_move_copy(bool copy) {
         cwd->vars = real_new_vars;
         cwd->vars_count = new_vars_count;
         cwd->vars_capacity = new_vars_capacity;
+        cwd->vars_changed();
 
     }
 
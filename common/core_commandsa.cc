@@ -588,6 +588,8 @@ int docmd_ymax(arg_struct *arg) {
     return plot_view_helper(false, false);
 }
 
+static native_eqn plot_native;
+
 static int call_plot_function(PlotData *data, phloat x) {
     vartype *eq = NULL;
     int err;
@@ -656,6 +658,8 @@ static int call_plot_function(PlotData *data, phloat x) {
         equation_data *eqd = ((vartype_equation *) data->fun)->data;
         current_prgm.set(eq_dir->id, eqd->eqn_index);
         pc = 0;
+        if (data->axes[0].len > 0 && data->axes[0].unit->type == TYPE_REAL)
+            plot_native.call(eq, data->axes[0].name, data->axes[0].len, x);
     }
     pgm_index plot_index;
     plot_index.set(0, -5);
@@ -762,6 +766,7 @@ static int prepare_plot(PlotData *data) {
      */
     free_vartype(mode_plot_inv);
     mode_plot_inv = NULL;
+    plot_native.reset();
 
     /* Prep solver, if needed */
     if (data->axes[1].len > 0) {
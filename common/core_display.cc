@@ -610,8 +610,31 @@ static int disp_bpl;
 int disp_r, disp_c, disp_w, disp_h;
 int requested_disp_r, requested_disp_c;
 
-static bool is_dirty = false;
-static int dirty_top, dirty_left, dirty_bottom, dirty_right;
+/* Parts of the display that have changed since the last flush_display().
+ * Changes far apart, like an annunciator in one corner and a menu key in the
+ * other, are kept in separate rectangles, so that the shell only has to copy
+ * and repaint those; see mark_dirty().
+ */
+#define MAX_DIRTY_RECTS 8
+#define DIRTY_MERGE_SLACK 64
+
+struct dirty_rect {
+    int top, left, bottom, right;
+};
+
+static dirty_rect dirty_rects[MAX_DIRTY_RECTS];
+static int dirty_count = 0;
+
+/* What the shell was last given, so that flush_display() can skip rows that
+ * were redrawn with the same contents, as happens to most of the rows every
+ * time redisplay() runs. Only valid once the whole display has been sent,
+ * by repaint_display() or by the first flush_display() after display_alloc(),
+ * and until the shell reports that it dropped an update; see
+ * display_dropped().
+ */
+static char *flushed = NULL;
+static bool flushed_valid = false;
+static bool flush_dropped = false;
 
 static std::vector<std::string> messages;
 
@@ -665,6 +688,9 @@ bool display_alloc(int rows, int cols) {
     disp_bpl = (disp_w + 7) / 8;
     free(display);
     display = (char *) malloc(disp_h * disp_bpl);
+    free(flushed);
+    flushed = (char *) malloc(disp_h * disp_bpl);
+    flushed_valid = false;
     if (mode_message_lines == ALL_LINES)
         mode_message_lines = 0;
     return true;
@@ -689,7 +715,7 @@ bool persist_display() {
     for (int i = 0; i < 3; i++) {
         for (int j = 0; j < 6; j++) {
             if (!write_int(custommenu_length[i][j])) return false;
-            if (fwrite(custommenu_label[i][j], 1, 7, gfile) != 7) return false;
+            if (!write_bytes(custommenu_label[i][j], 7)) return false;
         }
     }
     for (int i = 0; i < 9; i++)
@@ -699,18 +725,18 @@ bool persist_display() {
         if (!write_bool(progmenu_is_gto[i])) return false;
     for (int i = 0; i < 6; i++) {
         if (!write_int(progmenu_length[i])) return false;
-        if (fwrite(progmenu_label[i], 1, 7, gfile) != 7) return false;
+        if (!write_bytes(progmenu_label[i], 7)) return false;
     }
     if (!write_int(disp_r)) return false;
     if (!write_int(disp_c)) return false;
     if (!write_int(requested_disp_r)) return false;
     if (!write_int(requested_disp_c)) return false;
     int sz = disp_h * disp_bpl;
-    if (fwrite(display, 1, sz, gfile) != sz)
+    if (!write_bytes(display, sz))
         return false;
     if (!write_int(skin_flags)) return false;
     if (!write_int(appmenu_exitcallback)) return false;
-    if (fwrite(special_key, 1, 6, gfile) != 6)
+    if (!write_bytes(special_key, 6))
         return false;
     int mcount = (int) messages.size();
     if (!write_int(mcount))
@@ -720,7 +746,7 @@ bool persist_display() {
         int ml = (int) m.length();
         if (!write_int2(ml))
             return false;
-        if (fwrite(m.c_str(), 1, ml, gfile) != ml)
+        if (!write_bytes(m.c_str(), ml))
             return false;
     }
     if (!write_int2(crosshair_x)) return false;
@@ -772,7 +798,7 @@ bool unpersist_display(int ver) {
     for (int i = 0; i < 3; i++) {
         for (int j = 0; j < 6; j++) {
             if (!read_int(&custommenu_length[i][j])) return false;
-            if (fread(custommenu_label[i][j], 1, 7, gfile) != 7) return false;
+            if (!read_bytes(custommenu_label[i][j], 7)) return false;
             if (ver < 44)
                 switch_30_and_94(custommenu_label[i][j], custommenu_length[i][j]);
         }
@@ -784,7 +810,7 @@ bool unpersist_display(int ver) {
         if (!read_bool(&progmenu_is_gto[i])) return false;
     for (int i = 0; i < 6; i++) {
         if (!read_int(&progmenu_length[i])) return false;
-        if (fread(progmenu_label[i], 1, 7, gfile) != 7) return false;
+        if (!read_bytes(progmenu_label[i], 7)) return false;
         if (ver < 44)
             switch_30_and_94(progmenu_label[i], progmenu_length[i]);
     }
@@ -805,7 +831,7 @@ bool unpersist_display(int ver) {
     }
     display_alloc(r, c);
     int sz = disp_h * disp_bpl;
-    if (fread(display, 1, sz, gfile) != sz)
+    if (!read_bytes(display, sz))
         return false;
     if (ver >= 15) {
         int sf;
@@ -816,7 +842,7 @@ bool unpersist_display(int ver) {
             force_redisplay = true;
     }
     if (!read_int(&appmenu_exitcallback)) return false;
-    if (fread(special_key, 1, 6, gfile) != 6)
+    if (!read_bytes(special_key, 6))
         return false;
     messages.clear();
     if (ver >= 13) {
@@ -829,7 +855,7 @@ bool unpersist_display(int ver) {
             if (!read_int2(&ml))
                 return false;
             char *buf = (char *) malloc(ml);
-            if (fread(buf, 1, ml, gfile) != ml) {
+            if (!read_bytes(buf, ml)) {
                 free(buf);
                 return false;
             }
@@ -860,17 +886,72 @@ void clear_display() {
 }
 
 void flush_display() {
-    if (!is_dirty)
+    if (!flushed_valid && flushed != NULL && (dirty_count > 0 || flush_dropped)) {
+        /* Nothing to compare against yet, as after display_alloc() or a
+         * dropped update; send the whole display once, which also takes
+         * a new snapshot. */
+        dirty_count = 0;
+        repaint_display();
         return;
-    shell_blitter(display, disp_bpl, dirty_left, dirty_top,
-                    dirty_right - dirty_left, dirty_bottom - dirty_top);
-    is_dirty = false;
+    }
+    for (int i = 0; i < dirty_count; i++) {
+        dirty_rect *d = dirty_rects + i;
+        if (!flushed_valid) {
+            shell_blitter(display, disp_bpl, d->left, d->top,
+                            d->right - d->left, d->bottom - d->top);
+            continue;
+        }
+        /* Blit only the runs of rows that actually changed. Rows are
+         * compared and copied whole bytes at a time, so the blits have to
+         * cover those same bytes, or pixels next to the rectangle could
+         * end up in 'flushed' without ever reaching the shell. */
+        int first = d->left >> 3;
+        int n = ((d->right - 1) >> 3) - first + 1;
+        int left = first * 8;
+        int right = (first + n) * 8;
+        if (right > disp_w)
+            right = disp_w;
+        int run = -1;
+        for (int v = d->top; v <= d->bottom; v++) {
+            bool changed = false;
+            if (v < d->bottom) {
+                int off = v * disp_bpl + first;
+                changed = memcmp(display + off, flushed + off, n) != 0;
+                if (changed)
+                    memcpy(flushed + off, display + off, n);
+            }
+            if (changed) {
+                if (run == -1)
+                    run = v;
+            } else if (run != -1) {
+                shell_blitter(display, disp_bpl, left, run,
+                                right - left, v - run);
+                run = -1;
+            }
+        }
+    }
+    dirty_count = 0;
 }
 
 void repaint_display() {
+    if (flushed != NULL) {
+        memcpy(flushed, display, disp_h * disp_bpl);
+        flushed_valid = true;
+    }
+    flush_dropped = false;
     shell_blitter(display, disp_bpl, 0, 0, disp_w, disp_h);
 }
 
+/* Called by the shell, from within shell_blitter(), when it discards an
+ * update. 'flushed' no longer matches what the shell has, so the next
+ * flush_display() repaints everything, even if nothing else has changed by
+ * then.
+ */
+void display_dropped() {
+    flushed_valid = false;
+    flush_dropped = true;
+}
+
 void draw_pixel(int x, int y) {
     if (x < 0 || x >= disp_w || y < 0 || y >= disp_h)
         return;
@@ -1141,64 +1222,158 @@ void tone(int n) {
 }
 
 
+static int rect_area(const dirty_rect *r) {
+    return (r->bottom - r->top) * (r->right - r->left);
+}
+
+static void rect_union(dirty_rect *dst, const dirty_rect *r) {
+    if (r->top < dst->top)
+        dst->top = r->top;
+    if (r->left < dst->left)
+        dst->left = r->left;
+    if (r->bottom > dst->bottom)
+        dst->bottom = r->bottom;
+    if (r->right > dst->right)
+        dst->right = r->right;
+}
+
+/* Adds a rectangle to the dirty region. It is merged with an existing
+ * rectangle when their bounding box is at most DIRTY_MERGE_SLACK pixels
+ * larger than the two of them separately, which takes care of overlapping
+ * rectangles, and of consecutive characters on the same row. When all
+ * MAX_DIRTY_RECTS are in use, it is merged with whichever rectangle that
+ * wastes the fewest pixels. Either way, the merged rectangle may now be
+ * close enough to others to be merged with them as well.
+ */
 static void mark_dirty(int top, int left, int bottom, int right) {
-    if (is_dirty) {
-        if (top < dirty_top)
-            dirty_top = top;
-        if (left < dirty_left)
-            dirty_left = left;
-        if (bottom > dirty_bottom)
-            dirty_bottom = bottom;
-        if (right > dirty_right)
-            dirty_right = right;
-    } else {
-        dirty_top = top;
-        dirty_left = left;
-        dirty_bottom = bottom;
-        dirty_right = right;
-        is_dirty = true;
+    dirty_rect n = { top, left, bottom, right };
+    while (true) {
+        int best = -1;
+        int best_waste = 0;
+        for (int i = 0; i < dirty_count; i++) {
+            dirty_rect u = dirty_rects[i];
+            rect_union(&u, &n);
+            int waste = rect_area(&u) - rect_area(dirty_rects + i) - rect_area(&n);
+            if (best == -1 || waste < best_waste) {
+                best = i;
+                best_waste = waste;
+            }
+        }
+        if (best == -1 || best_waste > DIRTY_MERGE_SLACK && dirty_count < MAX_DIRTY_RECTS)
+            break;
+        rect_union(&n, dirty_rects + best);
+        dirty_rects[best] = dirty_rects[--dirty_count];
     }
+    dirty_rects[dirty_count++] = n;
 }
 
-void draw_char(int x, int y, char c) {
-    int X, Y, h, v;
+/* Glyph blitting
+ *
+ * The fonts are stored one byte per column, but the display is stored one
+ * bit per pixel, eight pixels per byte, row by row. Drawing a glyph one
+ * pixel at a time means a read-modify-write for every pixel, so instead, the
+ * glyphs are transposed into one byte per scan line, once, and strings are
+ * drawn a scan line at a time: the glyph rows are shifted into place in an
+ * accumulator, and written to the display a whole byte at a time, with a
+ * mask, so that pixels between and around the glyphs are left alone.
+ */
+static unsigned char bigchar_rows[138][8];
+static unsigned char smallchar_rows[136][8];
+static bool glyph_rows_ready = false;
+
+static void init_glyph_rows() {
+    for (int c = 0; c < 138; c++)
+        for (int v = 0; v < 8; v++) {
+            unsigned char r = 0;
+            for (int h = 0; h < 5; h++)
+                if (bigchars[c][h] & (1 << v))
+                    r |= 1 << h;
+            bigchar_rows[c][v] = r;
+        }
+    for (int m = 0; m < 136; m++) {
+        int o = smallchars_offset[m];
+        int cw = smallchars_offset[m + 1] - o;
+        for (int v = 0; v < 8; v++) {
+            unsigned char r = 0;
+            for (int h = 0; h < cw; h++)
+                if (smallchars[o + h] & (1 << v))
+                    r |= 1 << h;
+            smallchar_rows[m][v] = r;
+        }
+    }
+    glyph_rows_ready = true;
+}
+
+struct scanline {
+    char *row;
+    int byte;
+    int shift;
+    uint4 bits;
+    uint4 mask;
+};
+
+static void scanline_start(scanline *sl, int x, int y) {
+    sl->row = display + y * disp_bpl;
+    sl->byte = x >> 3;
+    sl->shift = x & 7;
+    sl->bits = 0;
+    sl->mask = 0;
+}
+
+/* Writes the lowest byte of the accumulator, if it falls within the display;
+ * pixels to the left of the display, or to the right of it, are dropped.
+ */
+static void scanline_store(scanline *sl) {
+    if (sl->byte >= 0 && sl->byte < disp_bpl) {
+        unsigned char m = (unsigned char) sl->mask;
+        if (sl->byte == disp_bpl - 1)
+            m &= (1 << (disp_w - (disp_bpl - 1) * 8)) - 1;
+        char *d = sl->row + sl->byte;
+        *d = (*d & ~m) | (sl->bits & m);
+    }
+    sl->bits >>= 8;
+    sl->mask >>= 8;
+    sl->byte++;
+    sl->shift -= 8;
+}
+
+/* Appends 'advance' pixels to the scan line; the pixels in 'mask' are set
+ * to the corresponding bits in 'bits', and the rest are left unchanged.
+ */
+static inline void scanline_put(scanline *sl, uint4 bits, uint4 mask, int advance) {
+    sl->bits |= bits << sl->shift;
+    sl->mask |= mask << sl->shift;
+    sl->shift += advance;
+    while (sl->shift >= 8)
+        scanline_store(sl);
+}
+
+static void scanline_finish(scanline *sl) {
+    while (sl->mask != 0)
+        scanline_store(sl);
+}
+
+static inline const unsigned char *big_glyph(char c) {
     unsigned char uc = (unsigned char) c;
-    if (x < 0 || x >= disp_c || y < 0 || y >= disp_r)
-        return;
     if (undefined_char(uc) || uc == 138)
         uc -= 128;
-    X = x * 6;
-    Y = y * 8;
-    for (v = 0; v < 8; v++) {
-        int YY = Y + v;
-        for (h = 0; h < 5; h++) {
-            int XX = X + h;
-            char mask = 1 << (XX & 7);
-            if (bigchars[uc][h] & (1 << v))
-                display[YY * disp_bpl + (XX >> 3)] |= mask;
-            else
-                display[YY * disp_bpl + (XX >> 3)] &= ~mask;
-        }
-    }
-    mark_dirty(Y, X, Y + 8, X + 5);
+    return bigchar_rows[uc];
+}
+
+void draw_char(int x, int y, char c) {
+    draw_string(x, y, &c, 1);
 }
 
 void draw_block(int x, int y) {
-    int X, Y, h, v;
     if (x < 0 || x >= disp_c || y < 0 || y >= disp_r)
         return;
-    X = x * 6;
-    Y = y * 8;
-    for (v = 0; v < 8; v++) {
-        int YY = Y + v;
-        for (h = 0; h < 5; h++) {
-            int XX = X + h;
-            char mask = 1 << (XX & 7);
-            if (v < 7)
-                display[YY * disp_bpl + (XX >> 3)] |= mask;
-            else
-                display[YY * disp_bpl + (XX >> 3)] &= ~mask;
-        }
+    int X = x * 6;
+    int Y = y * 8;
+    for (int v = 0; v < 8; v++) {
+        scanline sl;
+        scanline_start(&sl, X, Y + v);
+        scanline_put(&sl, v < 7 ? 0x1f : 0, 0x1f, 5);
+        scanline_finish(&sl);
     }
     mark_dirty(Y, X, Y + 8, X + 5);
 }
@@ -1211,10 +1386,29 @@ const unsigned char *get_char(char c) {
 }
 
 void draw_string(int x, int y, const char *s, int length) {
-    while (length != 0 && x < disp_c) {
-        draw_char(x++, y, *s++);
-        length--;
+    if (y < 0 || y >= disp_r)
+        return;
+    if (x < 0) {
+        s -= x;
+        length += x;
+        x = 0;
     }
+    if (length > disp_c - x)
+        length = disp_c - x;
+    if (length <= 0)
+        return;
+    if (!glyph_rows_ready)
+        init_glyph_rows();
+    int X = x * 6;
+    int Y = y * 8;
+    for (int v = 0; v < 8; v++) {
+        scanline sl;
+        scanline_start(&sl, X, Y + v);
+        for (int i = 0; i < length; i++)
+            scanline_put(&sl, big_glyph(s[i])[v], 0x1f, 6);
+        scanline_finish(&sl);
+    }
+    mark_dirty(Y, X, Y + 8, X + length * 6 - 1);
 }
 
 int draw_small_string(int x, int y, const char *s, int length, int max_width, bool right_align, bool left_trunc, bool reverse) {
@@ -1262,31 +1456,29 @@ int draw_small_string(int x, int y, const char *s, int length, int max_width, bo
     if (right_align)
         x = x + max_width - w;
 
-    for (int i = 0; i < n + ellipsis; i++) {
-        int c;
-        if (left_trunc)
-            c = ellipsis ? i == 0 ? 26 : s[length - n - 1 + i] : s[length - n + i];
-        else
-            c = i == n ? 26 : s[i];
-        c &= 255;
-        int m = smallchars_map[c];
-        int o = smallchars_offset[m];
-        int cw = smallchars_offset[m + 1] - o;
-        for (int j = 0; j < cw; j++) {
-            if (x >= 0 && x < disp_w) {
-                int b = smallchars[o + j];
-                for (int k = 0; k < 8; k++) {
-                    int Y = k + y;
-                    if (Y >= 0 && Y < disp_h && (b >> k) & 1)
-                        if (reverse)
-                            display[Y * disp_bpl + (x >> 3)] &= ~(1 << (x & 7));
-                        else
-                            display[Y * disp_bpl + (x >> 3)] |= 1 << (x & 7);
-                }
-            }
-            x++;
+    if (!glyph_rows_ready)
+        init_glyph_rows();
+    for (int k = 0; k < 8; k++) {
+        int Y = k + y;
+        if (Y < 0 || Y >= disp_h)
+            continue;
+        scanline sl;
+        scanline_start(&sl, x, Y);
+        for (int i = 0; i < n + ellipsis; i++) {
+            int c;
+            if (left_trunc)
+                c = ellipsis ? i == 0 ? 26 : s[length - n - 1 + i] : s[length - n + i];
+            else
+                c = i == n ? 26 : s[i];
+            c &= 255;
+            if (undefined_char(c) || c == 138)
+                c &= 127;
+            int m = smallchars_map[c];
+            int cw = smallchars_offset[m + 1] - smallchars_offset[m];
+            uint4 b = smallchar_rows[m][k];
+            scanline_put(&sl, reverse ? 0 : b, b, cw + 1);
         }
-        x++;
+        scanline_finish(&sl);
     }
     return w;
 }
@@ -1348,13 +1540,18 @@ void fill_rect(int x, int y, int width, int height, int color) {
         width = disp_w - x;
     if (y + height > disp_h)
         height = disp_h - y;
-    int h, v;
-    for (v = y; v < y + height; v++)
-        for (h = x; h < x + width; h++)
-            if (color)
-                display[v * disp_bpl + (h >> 3)] |= 1 << (h & 7);
-            else
-                display[v * disp_bpl + (h >> 3)] &= ~(1 << (h & 7));
+    for (int v = y; v < y + height; v++) {
+        scanline sl;
+        scanline_start(&sl, x, v);
+        int w = width;
+        while (w > 0) {
+            int n = w > 24 ? 24 : w;
+            uint4 m = (1U << n) - 1;
+            scanline_put(&sl, color ? m : 0, m, n);
+            w -= n;
+        }
+        scanline_finish(&sl);
+    }
     mark_dirty(y, x, y + height, x + width);
 }
 
@@ -1984,6 +2181,87 @@ static int display_prgm_line(int offset, int headers = 0, int footers = 0) {
     }
 }
 
+/* Stack level formatting cache
+ *
+ * redisplay() redraws every visible stack level after almost every
+ * keystroke, even though usually only one or two of them have changed, and
+ * formatting numbers is the expensive part of that. So format_level()
+ * remembers the text of recently formatted real and complex numbers, keyed
+ * on their exact value and the width they were formatted for, and reuses it
+ * for as long as nothing that affects number formatting changes: the flags
+ * (display mode, digits, radix, separators, polar, base), the BASE menu
+ * state, the word size, and the display width.
+ */
+struct level_cache_entry {
+    int type;
+    int width;
+    char value[2 * sizeof(phloat)];
+    std::string text;
+};
+
+static std::vector<level_cache_entry> level_cache;
+static int level_cache_next = 0;
+static flags_struct level_cache_flags;
+static bool level_cache_dec_int;
+static int level_cache_appmenu;
+static int level_cache_wsize;
+static int level_cache_cols = -1;
+
+static void check_level_cache() {
+    if (level_cache_cols == disp_c
+            && level_cache_dec_int == mode_dec_int
+            && level_cache_appmenu == mode_appmenu
+            && level_cache_wsize == mode_wsize
+            && memcmp(level_cache_flags.farray, flags.farray, sizeof(flags.farray)) == 0)
+        return;
+    for (size_t i = 0; i < level_cache.size(); i++)
+        level_cache[i].width = 0;
+    level_cache_flags = flags;
+    level_cache_dec_int = mode_dec_int;
+    level_cache_appmenu = mode_appmenu;
+    level_cache_wsize = mode_wsize;
+    level_cache_cols = disp_c;
+}
+
+static int format_level(vartype *v, char *buf, int buflen) {
+    int vsize;
+    char value[2 * sizeof(phloat)];
+    if (v->type == TYPE_REAL) {
+        vsize = sizeof(phloat);
+        memcpy(value, &((vartype_real *) v)->x, vsize);
+    } else if (v->type == TYPE_COMPLEX) {
+        vsize = 2 * sizeof(phloat);
+        memcpy(value, &((vartype_complex *) v)->re, sizeof(phloat));
+        memcpy(value + sizeof(phloat), &((vartype_complex *) v)->im, sizeof(phloat));
+    } else
+        return vartype2string(v, buf, buflen);
+
+    check_level_cache();
+    for (size_t i = 0; i < level_cache.size(); i++) {
+        level_cache_entry *e = &level_cache[i];
+        if (e->width == buflen && e->type == v->type && memcmp(e->value, value, vsize) == 0) {
+            int len = (int) e->text.length();
+            memcpy(buf, e->text.c_str(), len);
+            return len;
+        }
+    }
+
+    int len = vartype2string(v, buf, buflen);
+    try {
+        if (level_cache.size() < 2 * disp_r)
+            level_cache.resize(2 * disp_r);
+        level_cache_entry *e = &level_cache[level_cache_next];
+        e->text.assign(buf, len);
+        e->type = v->type;
+        e->width = buflen;
+        memcpy(e->value, value, vsize);
+        level_cache_next = (level_cache_next + 1) % level_cache.size();
+    } catch (std::bad_alloc &) {
+        // Just don't cache this one
+    }
+    return len;
+}
+
 static void display_level(int level, int row) {
     clear_row(row);
     if (!flags.f.big_stack && level > 3)
@@ -2031,9 +2309,9 @@ static void display_level(int level, int row) {
         char2buf(buf, len, &bufptr, '\200');
     }
     if (level == -1)
-        bufptr += vartype2string(lastx, buf + bufptr, len - bufptr);
+        bufptr += format_level(lastx, buf + bufptr, len - bufptr);
     else if (level <= sp)
-        bufptr += vartype2string(stack[sp - level], buf + bufptr, len - bufptr);
+        bufptr += format_level(stack[sp - level], buf + bufptr, len - bufptr);
     if (bufptr > disp_c) {
         buf[disp_c - 1] = 26;
         bufptr = disp_c;
@@ -2235,7 +2513,7 @@ static int display_x(int row, int lines_available) {
             } else if (v->type == TYPE_COMPLEXMATRIX) {
                 full_complex_matrix_to_string(v, &line, lines_available);
             } else {
-                int len = vartype2string(v, buf, 100);
+                int len = format_level(v, buf, 100);
                 line += std::string(buf, len);
             }
             int maxlen = lines_available * disp_c;
@@ -2781,20 +3059,20 @@ static int ext_disp_cat[] = {
 static int ext_misc_cat[] = {
     CMD_A2LINE,  CMD_A2PLINE, CMD_C_LN_1_X, CMD_C_E_POW_X_1, CMD_CAPS,   CMD_DYNAMIC,
     CMD_FMA,     CMD_GETLI,   CMD_GETMI,    CMD_IDENT,       CMD_LINE,   CMD_LOCK,
-    CMD_MIXED,   CMD_PCOMPLX, CMD_PLOT_M,   CMD_PRREG,       CMD_PUTLI,  CMD_PUTMI,
-    CMD_RCOMPLX, CMD_SPFV,    CMD_SPPV,     CMD_STATIC,      CMD_STRACE, CMD_TVM,
-    CMD_UNLOCK,  CMD_USFV,    CMD_USPV,     CMD_X2LINE,      CMD_ACCEL,  CMD_LOCAT,
-    CMD_HEADING, CMD_FPTEST,  CMD_NULL,     CMD_NULL,        CMD_NULL,   CMD_NULL
+    CMD_MIXED,   CMD_PCOMPLX, CMD_PFOFF,    CMD_PFON,        CMD_PFRPT,  CMD_PLOT_M,
+    CMD_PRREG,   CMD_PUTLI,   CMD_PUTMI,    CMD_RCOMPLX,     CMD_SPFV,   CMD_SPPV,
+    CMD_STATIC,  CMD_STRACE,  CMD_TVM,      CMD_UNLOCK,      CMD_USFV,   CMD_USPV,
+    CMD_X2LINE,  CMD_ACCEL,   CMD_LOCAT,    CMD_HEADING,     CMD_FPTEST, CMD_NULL
 };
 #define MISC_CAT_ROWS 6
 #else
 static int ext_misc_cat[] = {
     CMD_A2LINE,  CMD_A2PLINE, CMD_C_LN_1_X, CMD_C_E_POW_X_1, CMD_CAPS,   CMD_DYNAMIC,
     CMD_FMA,     CMD_GETLI,   CMD_GETMI,    CMD_IDENT,       CMD_LINE,   CMD_LOCK,
-    CMD_MIXED,   CMD_PCOMPLX, CMD_PLOT_M,   CMD_PRREG,       CMD_PUTLI,  CMD_PUTMI,
-    CMD_RCOMPLX, CMD_SPFV,    CMD_SPPV,     CMD_STATIC,      CMD_STRACE, CMD_TVM,
-    CMD_UNLOCK,  CMD_USFV,    CMD_USPV,     CMD_X2LINE,      CMD_ACCEL,  CMD_LOCAT,
-    CMD_HEADING, CMD_NULL,    CMD_NULL,     CMD_NULL,        CMD_NULL,   CMD_NULL
+    CMD_MIXED,   CMD_PCOMPLX, CMD_PFOFF,    CMD_PFON,        CMD_PFRPT,  CMD_PLOT_M,
+    CMD_PRREG,   CMD_PUTLI,   CMD_PUTMI,    CMD_RCOMPLX,     CMD_SPFV,   CMD_SPPV,
+    CMD_STATIC,  CMD_STRACE,  CMD_TVM,      CMD_UNLOCK,      CMD_USFV,   CMD_USPV,
+    CMD_X2LINE,  CMD_ACCEL,   CMD_LOCAT,    CMD_HEADING,     CMD_NULL,   CMD_NULL
 };
 #define MISC_CAT_ROWS 6
 #endif
@@ -2803,20 +3081,22 @@ static int ext_misc_cat[] = {
 static int ext_misc_cat[] = {
     CMD_A2LINE,  CMD_A2PLINE, CMD_C_LN_1_X, CMD_C_E_POW_X_1, CMD_CAPS,   CMD_DYNAMIC,
     CMD_FMA,     CMD_GETLI,   CMD_GETMI,    CMD_IDENT,       CMD_LINE,   CMD_LOCK,
-    CMD_MIXED,   CMD_PCOMPLX, CMD_PLOT_M,   CMD_PRREG,       CMD_PUTLI,  CMD_PUTMI,
-    CMD_RCOMPLX, CMD_SPFV,    CMD_SPPV,     CMD_STATIC,      CMD_STRACE, CMD_TVM,
-    CMD_UNLOCK,  CMD_USFV,    CMD_USPV,     CMD_X2LINE,      CMD_FPTEST, CMD_NULL
+    CMD_MIXED,   CMD_PCOMPLX, CMD_PFOFF,    CMD_PFON,        CMD_PFRPT,  CMD_PLOT_M,
+    CMD_PRREG,   CMD_PUTLI,   CMD_PUTMI,    CMD_RCOMPLX,     CMD_SPFV,   CMD_SPPV,
+    CMD_STATIC,  CMD_STRACE,  CMD_TVM,      CMD_UNLOCK,      CMD_USFV,   CMD_USPV,
+    CMD_X2LINE,  CMD_FPTEST,  CMD_NULL,     CMD_NULL,        CMD_NULL,   CMD_NULL
 };
-#define MISC_CAT_ROWS 5
+#define MISC_CAT_ROWS 6
 #else
 static int ext_misc_cat[] = {
     CMD_A2LINE,  CMD_A2PLINE, CMD_C_LN_1_X, CMD_C_E_POW_X_1, CMD_CAPS,   CMD_DYNAMIC,
     CMD_FMA,     CMD_GETLI,   CMD_GETMI,    CMD_IDENT,       CMD_LINE,   CMD_LOCK,
-    CMD_MIXED,   CMD_PCOMPLX, CMD_PLOT_M,   CMD_PRREG,       CMD_PUTLI,  CMD_PUTMI,
-    CMD_RCOMPLX, CMD_SPFV,    CMD_SPPV,     CMD_STATIC,      CMD_STRACE, CMD_TVM,
-    CMD_UNLOCK,  CMD_USFV,    CMD_USPV,     CMD_X2LINE,      CMD_NULL,   CMD_NULL
+    CMD_MIXED,   CMD_PCOMPLX, CMD_PFOFF,    CMD_PFON,        CMD_PFRPT,  CMD_PLOT_M,
+    CMD_PRREG,   CMD_PUTLI,   CMD_PUTMI,    CMD_RCOMPLX,     CMD_SPFV,   CMD_SPPV,
+    CMD_STATIC,  CMD_STRACE,  CMD_TVM,      CMD_UNLOCK,      CMD_USFV,   CMD_USPV,
+    CMD_X2LINE,  CMD_NULL,    CMD_NULL,     CMD_NULL,        CMD_NULL,   CMD_NULL
 };
-#define MISC_CAT_ROWS 5
+#define MISC_CAT_ROWS 6
 #endif
 #endif
 
@@ -5420,7 +5700,7 @@ int docmd_life(arg_struct *arg) {
     memcpy(display, dest, disp_h * disp_bpl);
     free(dest);
     repaint_display();
-    is_dirty = false;
+    dirty_count = 0;
     mode_message_lines = ALL_LINES;
     return ERR_NONE;
 }
@@ -482,7 +482,7 @@ bool unpersist_eqn(int4 ver) {
         edit_capacity = edit_len = 0;
         return false;
     }
-    if (fread(edit_buf, 1, edit_len, gfile) != edit_len) goto fail;
+    if (!read_bytes(edit_buf, edit_len)) goto fail;
     if (ver >= 50) {
         if (!read_char(&edit_mode)) return false;
     } else {
@@ -551,7 +551,7 @@ bool persist_eqn() {
             return false;
     if (!write_bool(new_eq)) return false;
     if (!write_int(edit_len)) return false;
-    if (fwrite(edit_buf, 1, edit_len, gfile) != edit_len) return false;
+    if (!write_bytes(edit_buf, edit_len)) return false;
     if (!write_char(edit_mode)) return false;
     if (!write_bool(cursor_on)) return false;
     if (!write_int(current_error)) return false;
@@ -2965,7 +2965,7 @@ static int keydown_list(int key, bool shift, int *repeat) {
              */
             equation_data *eqd = ((vartype_equation *) v)->data;
             std::vector<std::string> params, locals;
-            eqd->ev->collectVariables(&params, &locals);
+            eqd->get_ev()->collectVariables(&params, &locals);
             for (int i = 0; i < params.size(); i++) {
                 std::string n = params[i];
                 vartype *p = recall_var(n.c_str(), (int) n.length());
@@ -20,6 +20,13 @@
 #include <limits.h>
 #include <stdint.h>
 #include <string>
+#include <set>
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define STATE_MMAP 1
+#endif
 
 #include "core_globals.h"
 #include "core_commands2.h"
@@ -843,13 +850,22 @@ directory::directory(int id) {
     labels_capacity = 0;
     labels_count = 0;
     labels = NULL;
+    label_hash_size = 0;
+    label_hash = NULL;
+    var_hash_size = 0;
+    var_hash = NULL;
     children_capacity = 0;
     children_count = 0;
     children = NULL;
     parent = NULL;
+    journal_mark_structure();
 }
 
 directory::~directory() {
+    journal_mark_structure();
+    invalidate_decoded_prgms();
+    labels_changed();
+    vars_changed();
     if (cwd == this)
         cwd = root;
     if (dir_used(id)) {
@@ -884,6 +900,158 @@ directory::~directory() {
     unmap_dir(id);
 }
 
+/* Incremented whenever the set of global labels in any directory changes, or
+ * when a directory goes away; used to validate cached PATH lookups.
+ */
+static int4 label_gen = 1;
+
+int name_hash_code(const char *name, int namelen) {
+    uint4 h = 2166136261u;
+    for (int i = 0; i < namelen; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return (int) (h & 0x7fffffff);
+}
+
+void directory::labels_changed() {
+    free(label_hash);
+    label_hash = NULL;
+    label_hash_size = 0;
+    label_gen++;
+}
+
+int directory::find_label(const char *name, int namelen) {
+    /* Returns the index of the last global label with the given name, or -1.
+     * The hash table maps names to label indexes; it is built on demand, and
+     * discarded by labels_changed() whenever the label table is modified.
+     */
+    if (namelen == 0) {
+        // Unnamed entries are the ENDs; they aren't hashed
+        for (int i = labels_count - 1; i >= 0; i--)
+            if (labels[i].length == 0)
+                return i;
+        return -1;
+    }
+    if (label_hash == NULL) {
+        int size = 16;
+        while (size < labels_count * 2)
+            size <<= 1;
+        label_hash = (int *) malloc(size * sizeof(int));
+        if (label_hash == NULL) {
+            for (int i = labels_count - 1; i >= 0; i--)
+                if (string_equals(labels[i].name, labels[i].length, name, namelen))
+                    return i;
+            return -1;
+        }
+        label_hash_size = size;
+        for (int i = 0; i < size; i++)
+            label_hash[i] = -1;
+        for (int i = 0; i < labels_count; i++) {
+            label_struct *lbl = labels + i;
+            if (lbl->length == 0)
+                continue;
+            int h = name_hash_code(lbl->name, lbl->length) & (size - 1);
+            while (true) {
+                int j = label_hash[h];
+                if (j == -1 || string_equals(labels[j].name, labels[j].length, lbl->name, lbl->length)) {
+                    // Later labels shadow earlier ones with the same name
+                    label_hash[h] = i;
+                    break;
+                }
+                h = (h + 1) & (size - 1);
+            }
+        }
+    }
+    int h = name_hash_code(name, namelen) & (label_hash_size - 1);
+    while (true) {
+        int j = label_hash[h];
+        if (j == -1)
+            return -1;
+        if (string_equals(labels[j].name, labels[j].length, name, namelen))
+            return j;
+        h = (h + 1) & (label_hash_size - 1);
+    }
+}
+
+void directory::vars_changed() {
+    free(var_hash);
+    var_hash = NULL;
+    var_hash_size = 0;
+    invalidate_var_lookups();
+}
+
+void directory::var_added(int idx) {
+    /* Called after a variable has been appended to the vars array. Appending
+     * doesn't move any of the existing variables, so the hash table can be
+     * updated in place, as long as it doesn't get too full.
+     */
+    invalidate_var_lookups();
+    if (var_hash == NULL)
+        return;
+    if (vars_count * 2 > var_hash_size) {
+        vars_changed();
+        return;
+    }
+    int h = name_hash_code(vars[idx].name, vars[idx].length) & (var_hash_size - 1);
+    while (true) {
+        int j = var_hash[h];
+        if (j == -1 || string_equals(vars[j].name, vars[j].length, vars[idx].name, vars[idx].length)) {
+            var_hash[h] = idx;
+            break;
+        }
+        h = (h + 1) & (var_hash_size - 1);
+    }
+}
+
+int directory::find_var(const char *name, int namelen) {
+    /* Returns the index of the variable with the given name, or -1. Like the
+     * label hash, this is built on demand, and discarded by vars_changed()
+     * whenever variables are removed or reordered.
+     */
+    if (var_hash == NULL) {
+        if (vars_count < 8) {
+            // Not worth hashing
+            for (int i = vars_count - 1; i >= 0; i--)
+                if (string_equals(vars[i].name, vars[i].length, name, namelen))
+                    return i;
+            return -1;
+        }
+        int size = 16;
+        while (size < vars_count * 4)
+            size <<= 1;
+        var_hash = (int *) malloc(size * sizeof(int));
+        if (var_hash == NULL) {
+            for (int i = vars_count - 1; i >= 0; i--)
+                if (string_equals(vars[i].name, vars[i].length, name, namelen))
+                    return i;
+            return -1;
+        }
+        var_hash_size = size;
+        for (int i = 0; i < size; i++)
+            var_hash[i] = -1;
+        for (int i = 0; i < vars_count; i++) {
+            var_struct *vs = vars + i;
+            int h = name_hash_code(vs->name, vs->length) & (size - 1);
+            while (true) {
+                int j = var_hash[h];
+                if (j == -1 || string_equals(vars[j].name, vars[j].length, vs->name, vs->length)) {
+                    var_hash[h] = i;
+                    break;
+                }
+                h = (h + 1) & (size - 1);
+            }
+        }
+    }
+    int h = name_hash_code(name, namelen) & (var_hash_size - 1);
+    while (true) {
+        int j = var_hash[h];
+        if (j == -1)
+            return -1;
+        if (string_equals(vars[j].name, vars[j].length, name, namelen))
+            return j;
+        h = (h + 1) & (var_hash_size - 1);
+    }
+}
+
 directory *directory::clone() {
     int id = get_dir_id();
     directory *res = new (std::nothrow) directory(id);
@@ -1022,6 +1190,7 @@ int mode_transientmenu;
 int mode_alphamenu;
 int mode_commandmenu;
 bool mode_running;
+int mode_stop_reason; /* transient */
 bool mode_getkey;
 bool mode_getkey1;
 bool mode_pause = false;
@@ -1068,6 +1237,12 @@ int pending_command;
 arg_struct pending_command_arg;
 int xeq_invisible;
 
+uint8 instructions_executed = 0;
+
+int4 slice_budget = 1024;
+int slice_duration = 10;
+uint8 slice_polls = 0;
+
 /* Multi-keystroke commands -- edit state */
 /* Relevant when mode_command_entry != 0 */
 int incomplete_command;
@@ -1201,8 +1376,11 @@ bool no_keystrokes_yet;
  * Version 52: 1.3    BASE enhancements (menu additions)
  * Version 53: 1.3    BASE enhancements (carry; display modes)
  * Version 54: 1.3.3  CAPS/Mixed and STATIC/DYNAMIC for menus
+ * Version 55: 1.3.4  Parser version stamp; lazy equation parsing
+ * Version 56: 1.3.4  Aligned data for large matrices
+ * Version 57: 1.3.4  State generation, for the journal
  */
-#define PLUS42_VERSION 54
+#define PLUS42_VERSION 57
 
 
 /*******************/
@@ -1332,6 +1510,25 @@ static int shared_data_search(void *data) {
     return -1;
 }
 
+/* Matrices with at least this many elements, and no strings, have their
+ * data aligned in the state file, so they can be used in place when the
+ * state file is memory-mapped; see map_bytes().
+ */
+#define STATE_MAP_MIN_ELEMENTS 4096
+
+static bool write_align();
+static bool read_align();
+static const char *map_peek(size_t n);
+static const char *map_bytes(size_t skip, size_t n);
+static bool map_track(vartype *v);
+
+static bool all_numbers(const char *is_string, int4 size) {
+    for (int4 i = 0; i < size; i++)
+        if (is_string[i] != 0)
+            return false;
+    return true;
+}
+
 bool persist_vartype(vartype *v) {
     if (v == NULL)
         return write_char(TYPE_NULL);
@@ -1349,7 +1546,7 @@ bool persist_vartype(vartype *v) {
         case TYPE_STRING: {
             vartype_string *s = (vartype_string *) v;
             return write_int4(s->length)
-                && fwrite(s->txt(), 1, s->length, gfile) == s->length;
+                && write_bytes(s->txt(), s->length);
         }
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
@@ -1376,19 +1573,28 @@ bool persist_vartype(vartype *v) {
             write_int4(columns);
             if (must_write) {
                 int size = rm->rows * rm->columns;
-                if (fwrite(rm->array->is_string, 1, size, gfile) != size)
+                if (!write_bytes(rm->array->is_string, size))
+                    return false;
+                if (size >= STATE_MAP_MIN_ELEMENTS
+                        && all_numbers(rm->array->is_string, size)
+                        && !write_align())
                     return false;
                 for (int i = 0; i < size; i++) {
                     if (rm->array->is_string[i] == 0) {
-                        if (!write_phloat(rm->array->data[i]))
+                        // Write runs of numbers in one go
+                        int j = i + 1;
+                        while (j < size && rm->array->is_string[j] == 0)
+                            j++;
+                        if (!write_phloats(rm->array->data + i, j - i))
                             return false;
+                        i = j - 1;
                     } else {
                         char *text;
                         int4 len;
                         get_matrix_string(rm, i, &text, &len);
                         if (!write_int4(len))
                             return false;
-                        if (fwrite(text, 1, len, gfile) != len)
+                        if (!write_bytes(text, len))
                             return false;
                     }
                 }
@@ -1420,9 +1626,10 @@ bool persist_vartype(vartype *v) {
             write_int4(columns);
             if (must_write) {
                 int size = 2 * cm->rows * cm->columns;
-                for (int i = 0; i < size; i++)
-                    if (!write_phloat(cm->array->data[i]))
-                        return false;
+                if (size >= 2 * STATE_MAP_MIN_ELEMENTS && !write_align())
+                    return false;
+                if (!write_phloats(cm->array->data, size))
+                    return false;
             }
             return true;
         }
@@ -1463,7 +1670,7 @@ bool persist_vartype(vartype *v) {
             if (!write_phloat(u->x))
                 return false;
             return write_int4(u->length)
-                && fwrite(u->text, 1, u->length, gfile) == u->length;
+                && write_bytes(u->text, u->length);
         }
         case TYPE_DIR_REF: {
             vartype_dir_ref *r = (vartype_dir_ref *) v;
@@ -1479,7 +1686,7 @@ bool persist_vartype(vartype *v) {
                 return false;
             if (!write_char(r->length))
                 return false;
-            return fwrite(r->name, 1, r->length, gfile) == r->length;
+            return write_bytes(r->name, r->length);
         }
         default:
             /* Should not happen */
@@ -1492,6 +1699,23 @@ bool persist_vartype(vartype *v) {
 
 int4 ver;
 
+// The PARSER_VERSION the equations in the state file were generated with;
+// 0 for state files that predate the stamp.
+static int4 eqn_parser_version;
+
+// Changes with every full save, so a journal can tell whether it belongs to
+// the state file next to it; see journal_changes().
+static uint4 state_generation;
+
+static uint4 new_state_generation() {
+    // Start at an arbitrary point, so a journal left behind by some other
+    // state that used to have the same file name won't match
+    uint4 date, time;
+    int weekday;
+    shell_get_time_date(&time, &date, &weekday);
+    return (date << 16) ^ time ^ shell_milliseconds();
+}
+
 static equation_data *unpersist_equation_data() {
     int4 eqn_index;
     directory *saved_cwd = cwd;
@@ -1550,7 +1774,7 @@ static equation_data *unpersist_equation_data() {
         eqd->text = (char *) malloc(eqd->length);
         if (eqd->text == NULL)
             goto eq_fail;
-        if (fread(eqd->text, 1, eqd->length, gfile) != eqd->length)
+        if (!read_bytes(eqd->text, eqd->length))
             goto eq_fail;
         if (ver < 44)
             switch_30_and_94(eqd->text, eqd->length);
@@ -1562,7 +1786,7 @@ static equation_data *unpersist_equation_data() {
         char *cmdata = (char *) malloc(cmsize);
         if (cmdata == NULL)
             goto eq_fail;
-        if (fread(cmdata, 1, cmsize, gfile) != cmsize) {
+        if (!read_bytes(cmdata, cmsize)) {
             cm_fail:
             free(cmdata);
             goto eq_fail;
@@ -1573,8 +1797,18 @@ static equation_data *unpersist_equation_data() {
     }
     if (!read_bool(&eqd->compatMode))
         goto eq_fail;
+    if (ver >= 55) {
+        if (!read_bool(&eqd->compatModeEmbedded))
+            goto eq_fail;
+    }
     eq_dir->prgms[eqn_index].eq_data = eqd;
-    if (eqd->length > 0) {
+    if (eqd->length > 0 && eqn_parser_version == PARSER_VERSION) {
+        /* The code and code map we just loaded are current, and the text
+         * was parsed successfully when it was saved, so we can leave the
+         * actual parsing until someone needs the parse tree.
+         */
+        eqd->ev_deferred = true;
+    } else if (eqd->length > 0) {
         int errpos;
         eqd->ev = Parser::parse(std::string(eqd->text, eqd->length), &eqd->compatMode, &eqd->compatModeEmbedded, &errpos);
     }
@@ -1619,7 +1853,7 @@ bool unpersist_vartype(vartype **v) {
             vartype_string *s = (vartype_string *) new_string(NULL, len);
             if (s == NULL)
                 return false;
-            if (fread(s->txt(), 1, len, gfile) != len) {
+            if (!read_bytes(s->txt(), len)) {
                 free_vartype((vartype *) s);
                 return false;
             }
@@ -1645,21 +1879,63 @@ bool unpersist_vartype(vartype **v) {
             bool shared = rows < 0;
             if (shared)
                 rows = -rows;
-            vartype_realmatrix *rm = (vartype_realmatrix *) new_realmatrix(rows, columns);
+            int4 size = rows * columns;
+            vartype_realmatrix *rm;
+            bool success;
+            int4 i;
+            bool aligned = ver >= 56 && size >= STATE_MAP_MIN_ELEMENTS;
+            if (aligned) {
+                // Try using the data in place in the state file mapping
+                const char *is_string = map_peek(size);
+                if (is_string != NULL && all_numbers(is_string, size)) {
+                    const char *data = map_bytes(size, size * sizeof(phloat));
+                    if (data != NULL) {
+                        rm = (vartype_realmatrix *) malloc(sizeof(vartype_realmatrix));
+                        if (rm == NULL)
+                            return false;
+                        rm->type = TYPE_REALMATRIX;
+                        rm->rows = rows;
+                        rm->columns = columns;
+                        rm->array = (realmatrix_data *) malloc(sizeof(realmatrix_data));
+                        if (rm->array == NULL) {
+                            free(rm);
+                            return false;
+                        }
+                        rm->array->data = (phloat *) data;
+                        rm->array->is_string = (char *) is_string;
+                        rm->array->refcount = 1;
+                        if (!map_track((vartype *) rm)) {
+                            free(rm->array);
+                            free(rm);
+                            return false;
+                        }
+                        goto rm_done;
+                    }
+                }
+            }
+            rm = (vartype_realmatrix *) new_realmatrix(rows, columns);
             if (rm == NULL)
                 return false;
-            int4 size = rows * columns;
-            if (fread(rm->array->is_string, 1, size, gfile) != size) {
+            if (!read_bytes(rm->array->is_string, size)) {
                 free_vartype((vartype *) rm);
                 return false;
             }
-            bool success = true;
-            int4 i;
+            if (aligned && all_numbers(rm->array->is_string, size)
+                    && !read_align()) {
+                free_vartype((vartype *) rm);
+                return false;
+            }
+            success = true;
             for (i = 0; i < size; i++) {
                 success = false;
                 if (rm->array->is_string[i] == 0) {
-                    if (!read_phloat(&rm->array->data[i]))
+                    // Read runs of numbers in one go
+                    int4 j = i + 1;
+                    while (j < size && rm->array->is_string[j] == 0)
+                        j++;
+                    if (!read_phloats(rm->array->data + i, j - i))
                         break;
+                    i = j - 1;
                 } else {
                     rm->array->is_string[i] = 1;
                     // 4-byte length followed by n bytes of text
@@ -1670,7 +1946,7 @@ bool unpersist_vartype(vartype **v) {
                         int4 *p = (int4 *) malloc(len + 4);
                         if (p == NULL)
                             break;
-                        if (fread(p + 1, 1, len, gfile) != len) {
+                        if (!read_bytes(p + 1, len)) {
                             free(p);
                             break;
                         }
@@ -1682,7 +1958,7 @@ bool unpersist_vartype(vartype **v) {
                     } else {
                         char *t = (char *) &rm->array->data[i];
                         *t = len;
-                        if (fread(t + 1, 1, len, gfile) != len)
+                        if (!read_bytes(t + 1, len))
                             break;
                         if (ver < 44)
                             switch_30_and_94(t + 1, len);
@@ -1695,6 +1971,7 @@ bool unpersist_vartype(vartype **v) {
                 free_vartype((vartype *) rm);
                 return false;
             }
+            rm_done:
             if (shared) {
                 if (!shared_data_grow()) {
                     free_vartype((vartype *) rm);
@@ -1722,12 +1999,36 @@ bool unpersist_vartype(vartype **v) {
             bool shared = rows < 0;
             if (shared)
                 rows = -rows;
-            vartype_complexmatrix *cm = (vartype_complexmatrix *) new_complexmatrix(rows, columns);
-            if (cm == NULL)
-                return false;
             int4 size = 2 * rows * columns;
-            for (int4 i = 0; i < size; i++) {
-                if (!read_phloat(&cm->array->data[i])) {
+            bool aligned = ver >= 56 && size >= 2 * STATE_MAP_MIN_ELEMENTS;
+            const char *data = aligned ? map_bytes(0, size * sizeof(phloat)) : NULL;
+            vartype_complexmatrix *cm;
+            if (data != NULL) {
+                // Use the data in place in the state file mapping
+                cm = (vartype_complexmatrix *) malloc(sizeof(vartype_complexmatrix));
+                if (cm == NULL)
+                    return false;
+                cm->type = TYPE_COMPLEXMATRIX;
+                cm->rows = rows;
+                cm->columns = columns;
+                cm->array = (complexmatrix_data *) malloc(sizeof(complexmatrix_data));
+                if (cm->array == NULL) {
+                    free(cm);
+                    return false;
+                }
+                cm->array->data = (phloat *) data;
+                cm->array->refcount = 1;
+                if (!map_track((vartype *) cm)) {
+                    free(cm->array);
+                    free(cm);
+                    return false;
+                }
+            } else {
+                cm = (vartype_complexmatrix *) new_complexmatrix(rows, columns);
+                if (cm == NULL)
+                    return false;
+                if (aligned && !read_align()
+                        || !read_phloats(cm->array->data, size)) {
                     free_vartype((vartype *) cm);
                     return false;
                 }
@@ -1785,7 +2086,7 @@ bool unpersist_vartype(vartype **v) {
                 equation_data *eqd;
                 if (id >= eq_dir->prgms_count || (eqd = eq_dir->prgms[id].eq_data) == NULL)
                     *v = new_string("<Missing Equation>", 18);
-                else if (eqd->length > 0 && eqd->ev == NULL)
+                else if (eqd->length > 0 && eqd->ev == NULL && !eqd->ev_deferred)
                     *v = new_string(eqd->text, eqd->length);
                 else
                     *v = new_equation(eqd);
@@ -1808,7 +2109,7 @@ bool unpersist_vartype(vartype **v) {
             equation_data *eqd = unpersist_equation_data();
             if (eqd == NULL)
                 return false;
-            if (eqd->length > 0 && eqd->ev == NULL) {
+            if (eqd->length > 0 && eqd->ev == NULL && !eqd->ev_deferred) {
                 // Parse error while everything else looked OK; this is
                 // probably an equation that was valid at some point but
                 // no longer is, because of a parser change. In a perfect
@@ -1848,7 +2149,7 @@ bool unpersist_vartype(vartype **v) {
             u->text = (char *) malloc(len);
             if (u->text == NULL && len != 0)
                 goto unit_fail;
-            if (fread(u->text, 1, len, gfile) != len) {
+            if (!read_bytes(u->text, len)) {
                 free(u->text);
                 goto unit_fail;
             }
@@ -1883,7 +2184,7 @@ bool unpersist_vartype(vartype **v) {
             if (!read_char(&length))
                 return false;
             char name[7];
-            if (fread(name, 1, length, gfile) != length)
+            if (!read_bytes(name, length))
                 return false;
             if (ver < 44)
                 switch_30_and_94(name, length);
@@ -1906,7 +2207,7 @@ static bool persist_directory(directory *dir) {
     for (int i = 0; i < dir->vars_count; i++) {
         if (!write_char(dir->vars[i].length))
             goto fail;
-        if (fwrite(dir->vars[i].name, 1, dir->vars[i].length, gfile) != dir->vars[i].length)
+        if (!write_bytes(dir->vars[i].name, dir->vars[i].length))
             goto fail;
         if (!persist_vartype(dir->vars[i].value))
             goto fail;
@@ -1923,7 +2224,7 @@ static bool persist_directory(directory *dir) {
     for (int i = 0; i < dir->children_count; i++) {
         if (!write_char(dir->children[i].length))
             goto fail;
-        if (fwrite(dir->children[i].name, 1, dir->children[i].length, gfile) != dir->children[i].length)
+        if (!write_bytes(dir->children[i].name, dir->children[i].length))
             goto fail;
         if (!persist_directory(dir->children[i].dir))
             goto fail;
@@ -1964,7 +2265,7 @@ static bool unpersist_directory(directory **d) {
         var_struct vs;
         if (!read_char((char *) &vs.length))
             goto fail;
-        if (fread(vs.name, 1, vs.length, gfile) != vs.length)
+        if (!read_bytes(vs.name, vs.length))
             goto fail;
         if (ver < 44)
             switch_30_and_94(vs.name, vs.length);
@@ -2013,7 +2314,7 @@ static bool unpersist_directory(directory **d) {
         for (int i = 0; i < nc; i++) {
             if (!read_char((char *) &dir->children[i].length))
                 goto fail;
-            if (fread(dir->children[i].name, 1, dir->children[i].length, gfile) != dir->children[i].length)
+            if (!read_bytes(dir->children[i].name, dir->children[i].length))
                 goto fail;
             if (ver < 44)
                 switch_30_and_94(dir->children[i].name, dir->children[i].length);
@@ -2038,7 +2339,7 @@ static bool persist_globals() {
 
     if (!write_int(reg_alpha_length))
         goto done;
-    if (fwrite(reg_alpha, 1, 44, gfile) != 44)
+    if (!write_bytes(reg_alpha, 44))
         goto done;
     if (!write_int4(mode_sigma_reg))
         goto done;
@@ -2070,7 +2371,7 @@ static bool persist_globals() {
         goto done;
     if (!write_int(mode_amort_seq))
         goto done;
-    if (fwrite(&flags, 1, sizeof(flags_struct), gfile) != sizeof(flags_struct))
+    if (!write_bytes(&flags, sizeof(flags_struct)))
         goto done;
     if (!write_int(mode_message_lines))
         goto done;
@@ -2080,6 +2381,8 @@ static bool persist_globals() {
         for (int i = 0; i < eq_dir->prgms_count; i++)
             if (eq_dir->prgms[i].eq_data != NULL)
                 n_eq++;
+        if (!write_int4(PARSER_VERSION))
+            goto done;
         if (!write_int(n_eq))
             goto done;
         for (int i = 0; i < eq_dir->prgms_count; i++) {
@@ -2094,16 +2397,18 @@ static bool persist_globals() {
                 return false;
             if (!write_int4(eqd->length))
                 return false;
-            if (fwrite(eqd->text, 1, eqd->length, gfile) != eqd->length)
+            if (!write_bytes(eqd->text, eqd->length))
                 return false;
             int cmsize = eqd->map == NULL ? 0 : eqd->map->getSize();
             if (!write_int(cmsize))
                 return false;
             if (cmsize > 0)
-                if (fwrite(eqd->map->getData(), 1, cmsize, gfile) != cmsize)
+                if (!write_bytes(eqd->map->getData(), cmsize))
                     return false;
             if (!write_bool(eqd->compatMode))
                 return false;
+            if (!write_bool(eqd->compatModeEmbedded))
+                return false;
         }
     }
 
@@ -2128,7 +2433,7 @@ static bool persist_globals() {
         goto done;
     for (i = 0; i < local_vars_count; i++) {
         if (!write_char(local_vars[i].length)
-            || fwrite(local_vars[i].name, 1, local_vars[i].length, gfile) != local_vars[i].length
+            || !write_bytes(local_vars[i].name, local_vars[i].length)
             || !write_int2(local_vars[i].level)
             || !write_int2(local_vars[i].flags)
             || !persist_vartype(local_vars[i].value))
@@ -2160,7 +2465,7 @@ static bool persist_globals() {
         goto done;
     if (!write_int(varmenu_length))
         goto done;
-    if (fwrite(varmenu, 1, 7, gfile) != 7)
+    if (!write_bytes(varmenu, 7))
         goto done;
     if (!write_int(varmenu_rows))
         goto done;
@@ -2168,7 +2473,7 @@ static bool persist_globals() {
         goto done;
     for (i = 0; i < 6; i++)
         if (!write_char(varmenu_labellength[i])
-                || fwrite(varmenu_labeltext[i], 1, varmenu_labellength[i], gfile) != varmenu_labellength[i])
+                || !write_bytes(varmenu_labeltext[i], varmenu_labellength[i]))
             goto done;
     if (!write_int(varmenu_role))
         goto done;
@@ -2221,7 +2526,7 @@ static bool unpersist_globals() {
         reg_alpha_length = 0;
         goto done;
     }
-    if (fread(reg_alpha, 1, 44, gfile) != 44) {
+    if (!read_bytes(reg_alpha, 44)) {
         reg_alpha_length = 0;
         goto done;
     }
@@ -2288,8 +2593,7 @@ static bool unpersist_globals() {
         if (!read_bool(&dummy))
             goto done;
     }
-    if (fread(&flags, 1, sizeof(flags_struct), gfile)
-            != sizeof(flags_struct))
+    if (!read_bytes(&flags, sizeof(flags_struct)))
         goto done;
 
     if (ver < 21)
@@ -2318,6 +2622,10 @@ static bool unpersist_globals() {
     eq_dir = new directory(1);
     map_dir(1, eq_dir);
 
+    if (ver >= 55) {
+        if (!read_int4(&eqn_parser_version))
+            goto done;
+    }
     if (ver >= 46) {
         int n_eq;
         if (!read_int(&n_eq))
@@ -2399,6 +2707,7 @@ static bool unpersist_globals() {
     }
     local_vars_count = 0;
     local_vars_capacity = 0;
+    local_vars_changed();
 
     if (ver >= 9) {
         int lc;
@@ -2411,7 +2720,7 @@ static bool unpersist_globals() {
         for (int i = 0; i < lc; i++) {
             if (!read_char((char *) &local_vars[i].length))
                 goto done;
-            if (fread(local_vars[i].name, 1, local_vars[i].length, gfile) != local_vars[i].length)
+            if (!read_bytes(local_vars[i].name, local_vars[i].length))
                 goto done;
             if (ver < 44)
                 switch_30_and_94(local_vars[i].name, local_vars[i].length);
@@ -2439,9 +2748,11 @@ static bool unpersist_globals() {
                 local_vars[li++] = root->vars[i];
         }
         root->vars_count = gi;
+        root->vars_changed();
         local_vars_count = li;
         cwd = root;
     }
+    local_vars_changed();
 
     if (ver >= 20) {
         if (!read_bool(&mode_plot_viewer)) {
@@ -2526,7 +2837,7 @@ static bool unpersist_globals() {
     }
     if (!read_int(&varmenu_length))
         goto varmenu_fail;
-    if (fread(varmenu, 1, 7, gfile) != 7)
+    if (!read_bytes(varmenu, 7))
         goto varmenu_fail;
     if (ver < 44)
         switch_30_and_94(varmenu, varmenu_length);
@@ -2542,7 +2853,7 @@ static bool unpersist_globals() {
     char c;
     for (i = 0; i < 6; i++) {
         if (!read_char(&c)
-                || fread(varmenu_labeltext[i], 1, c, gfile) != c)
+                || !read_bytes(varmenu_labeltext[i], c))
             goto done;
         varmenu_labellength[i] = c;
         if (ver < 44)
@@ -2614,7 +2925,7 @@ static bool unpersist_globals() {
                 char dummy2[7];
                 int4 dummy3, dummy4;
                 if (!read_char(&dummy1)
-                        || fread(dummy2, 1, dummy1, gfile) != dummy1
+                        || !read_bytes(dummy2, dummy1)
                         || !read_int4(&dummy3)
                         || !read_int4(&dummy4))
                     goto done;
@@ -2682,6 +2993,7 @@ static bool make_prgm_space(directory *dir, int n) {
 }
 
 int4 new_eqn_idx() {
+    journal_mark_structure();
     for (int4 i = 0; i < eq_dir->prgms_capacity; i++) {
         if (eq_dir->prgms[i].text == NULL) {
             if (i + 1 > eq_dir->prgms_count)
@@ -2721,13 +3033,9 @@ int clear_prgm(const arg_struct *arg) {
                 return ERR_RESTRICTED_OPERATION;
             prgm = current_prgm;
         } else {
-            int i;
-            for (i = cwd->labels_count - 1; i >= 0; i--)
-                if (string_equals(arg->val.text, arg->length,
-                                  cwd->labels[i].name, cwd->labels[i].length))
-                    goto found;
-            return ERR_LABEL_NOT_FOUND;
-            found:
+            int i = cwd->find_label(arg->val.text, arg->length);
+            if (i == -1)
+                return ERR_LABEL_NOT_FOUND;
             prgm.set(cwd->id, cwd->labels[i].prgm);
         }
     }
@@ -2739,6 +3047,7 @@ static int clear_prgm_by_index(pgm_index prgm) {
     if (prgm.dir == eq_dir->id || prgm.idx < 0)
         return ERR_LABEL_NOT_FOUND;
     clear_all_rtns();
+    journal_mark_programs(prgm.dir);
     directory *dir = dir_list[prgm.dir];
     count_embed_references(dir, prgm.idx, false);
     if (prgm == current_prgm)
@@ -2746,6 +3055,7 @@ static int clear_prgm_by_index(pgm_index prgm) {
     else if (current_prgm.dir == prgm.dir && current_prgm.idx > prgm.idx)
         current_prgm.set(current_prgm.dir, current_prgm.idx - 1);
 
+    invalidate_decoded_prgms();
     free(dir->prgms[prgm.idx].text);
     for (i = prgm.idx; i < dir->prgms_count - 1; i++)
         dir->prgms[i] = dir->prgms[i + 1];
@@ -2763,6 +3073,7 @@ static int clear_prgm_by_index(pgm_index prgm) {
             i++;
     }
     dir->labels_count = i;
+    dir->labels_changed();
     if (dir->prgms_count == 0 || prgm.idx == dir->prgms_count) {
         pgm_index saved_prgm = current_prgm;
         int saved_pc = pc;
@@ -2782,6 +3093,8 @@ int clear_prgm_by_int_index(int prgm) {
 
 void clear_prgm_lines(int4 count) {
     int4 frompc, deleted, i, j;
+    journal_mark_programs(current_prgm.dir);
+    invalidate_decoded_prgms();
     if (pc == -1)
         pc = 0;
     frompc = pc;
@@ -2821,6 +3134,7 @@ void clear_prgm_lines(int4 count) {
             i++;
     }
     cwd->labels_count = i;
+    cwd->labels_changed();
 
     invalidate_lclbls(current_prgm, false);
     clear_all_rtns();
@@ -3136,59 +3450,349 @@ void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target,
     }
 }
 
-void rebuild_label_table() {
-    /* TODO -- this is *not* efficient; inserting and deleting ENDs and
-     * global LBLs should not cause every single program to get rescanned!
-     * But, I don't feel like dealing with that at the moment, so just
-     * this ugly brute force approach for now.
+/* Decoded instruction cache
+ * Running programs fetch their instructions using fetch_next_command(), which
+ * remembers what get_next_command() returned for each pc, so that executing
+ * the same line again is a simple lookup instead of parsing the program text
+ * all over again. The cache is keyed by the program's text pointer, and it is
+ * discarded as a whole whenever any program text is modified or freed.
+ */
+
+struct decoded_command {
+    int4 next_pc;
+    int command;
+    arg_struct arg;
+};
+
+struct decoded_prgm {
+    const unsigned char *text;
+    int4 size;
+    int4 *index;
+    decoded_command *cmds;
+    int4 count;
+    int4 capacity;
+};
+
+#define DECODED_PRGMS 8
+static decoded_prgm decoded_prgms[DECODED_PRGMS];
+static decoded_prgm *decoded_last = NULL;
+static int decoded_count = 0;
+static int decoded_next = 0;
+
+static void clear_decoded_commands() {
+    if (decoded_count == 0)
+        return;
+    for (int i = 0; i < DECODED_PRGMS; i++) {
+        decoded_prgm *dp = decoded_prgms + i;
+        free(dp->index);
+        delete[] dp->cmds;
+        dp->text = NULL;
+        dp->index = NULL;
+        dp->cmds = NULL;
+    }
+    decoded_last = NULL;
+    decoded_count = 0;
+    decoded_next = 0;
+}
+
+static decoded_prgm *find_decoded_prgm(prgm_struct *prgm) {
+    for (int i = 0; i < decoded_count; i++) {
+        decoded_prgm *dp = decoded_prgms + i;
+        if (dp->text == prgm->text && dp->size == prgm->size)
+            return dp;
+    }
+    int4 *index = (int4 *) malloc(prgm->size * sizeof(int4));
+    if (index == NULL)
+        return NULL;
+    memset(index, 255, prgm->size * sizeof(int4));
+    decoded_prgm *dp = decoded_prgms + decoded_next;
+    free(dp->index);
+    delete[] dp->cmds;
+    dp->text = prgm->text;
+    dp->size = prgm->size;
+    dp->index = index;
+    dp->cmds = NULL;
+    dp->count = 0;
+    dp->capacity = 0;
+    if (decoded_count < DECODED_PRGMS)
+        decoded_count++;
+    decoded_next = (decoded_next + 1) % DECODED_PRGMS;
+    return dp;
+}
+
+void fetch_next_command(int4 *pc, int *command, arg_struct *arg) {
+    prgm_struct *prgm = dir_list[current_prgm.dir]->prgms + current_prgm.idx;
+    decoded_prgm *dp = decoded_last;
+    if (dp == NULL || dp->text != prgm->text || dp->size != prgm->size) {
+        dp = find_decoded_prgm(prgm);
+        decoded_last = dp;
+        if (dp == NULL) {
+            get_next_command(pc, command, arg, 1, NULL);
+            return;
+        }
+    }
+    int4 i = dp->index[*pc];
+    if (i != -1) {
+        decoded_command *dc = dp->cmds + i;
+        *command = dc->command;
+        *arg = dc->arg;
+        *pc = dc->next_pc;
+        return;
+    }
+
+    /* Not seen yet: decode it the slow way, and remember the result. The
+     * targets of GTO and XEQ are resolved at this point, so the cached
+     * arg_struct is exactly what the slow path would produce from now on.
      */
-    int prgm_index;
-    int4 pc;
-    cwd->labels_count = 0;
-    for (prgm_index = 0; prgm_index < cwd->prgms_count; prgm_index++) {
-        prgm_struct *prgm = cwd->prgms + prgm_index;
-        pc = 0;
-        while (pc < prgm->size) {
-            int command = prgm->text[pc];
-            int argtype = prgm->text[pc + 1];
-            command |= (argtype & 112) << 4;
-            argtype &= 15;
+    int4 orig_pc = *pc;
+    get_next_command(pc, command, arg, 1, NULL);
+    if (dp->count == dp->capacity) {
+        int4 newcap = dp->capacity == 0 ? 64 : dp->capacity * 2;
+        // arg_struct holds a phloat, which isn't trivially copyable in
+        // the decimal build, so no realloc() here
+        decoded_command *newcmds = new (std::nothrow) decoded_command[newcap];
+        if (newcmds == NULL)
+            return;
+        for (int4 j = 0; j < dp->count; j++)
+            newcmds[j] = dp->cmds[j];
+        delete[] dp->cmds;
+        dp->cmds = newcmds;
+        dp->capacity = newcap;
+    }
+    decoded_command *dc = dp->cmds + dp->count;
+    dc->next_pc = *pc;
+    dc->command = *command;
+    dc->arg = *arg;
+    dp->index[orig_pc] = dp->count++;
+}
 
-            if (command == CMD_END
-                        || (command == CMD_LBL && argtype == ARGTYPE_STR)) {
-                label_struct *newlabel;
-                if (cwd->labels_count == cwd->labels_capacity) {
-                    label_struct *newlabels;
-                    int i;
-                    cwd->labels_capacity += 50;
-                    newlabels = (label_struct *)
-                                malloc(cwd->labels_capacity * sizeof(label_struct));
-                    // TODO - handle memory allocation failure
-                    for (i = 0; i < cwd->labels_count; i++)
-                        newlabels[i] = cwd->labels[i];
-                    if (cwd->labels != NULL)
-                        free(cwd->labels);
-                    cwd->labels = newlabels;
-                }
-                newlabel = cwd->labels + cwd->labels_count++;
+/* Line number index
+ * pc2line() and line2pc() would otherwise have to count lines from the start
+ * of the program every time, which gets slow in long programs. This index
+ * remembers the pc of every LINE_INDEX_STEP-th line, so that a conversion
+ * only has to walk from the nearest checkpoint before it. Like the decoded
+ * instruction cache, it is keyed by the program's text pointer and size;
+ * store_command() and delete_command() patch it as lines are inserted and
+ * deleted, and invalidate_decoded_prgms() discards it.
+ */
+
+#define LINE_INDEX_STEP 64
+#define LINE_INDEXES 8
+
+struct line_index {
+    const unsigned char *text;
+    int4 size;
+    int4 lines;
+    int4 *pc;
+    int4 *line;
+    int4 count;
+};
+
+static line_index line_indexes[LINE_INDEXES];
+static int line_indexes_next = 0;
+
+static void discard_line_index(line_index *li) {
+    free(li->pc);
+    free(li->line);
+    li->text = NULL;
+    li->pc = NULL;
+    li->line = NULL;
+}
+
+static void clear_line_indexes() {
+    for (int i = 0; i < LINE_INDEXES; i++)
+        if (line_indexes[i].text != NULL)
+            discard_line_index(line_indexes + i);
+}
+
+void invalidate_decoded_prgms() {
+    clear_decoded_commands();
+    clear_line_indexes();
+}
+
+static line_index *lookup_line_index(const unsigned char *text, int4 size) {
+    if (text == NULL)
+        return NULL;
+    for (int i = 0; i < LINE_INDEXES; i++) {
+        line_index *li = line_indexes + i;
+        if (li->text == text && li->size == size)
+            return li;
+    }
+    return NULL;
+}
+
+static line_index *find_line_index(prgm_struct *prgm) {
+    if (prgm->text == NULL)
+        return NULL;
+    line_index *li = lookup_line_index(prgm->text, prgm->size);
+    if (li != NULL)
+        return li;
+
+    int4 pc = 0;
+    int4 line = 1;
+    while (!prgm->is_end(pc)) {
+        pc += get_command_length(current_prgm, pc);
+        line++;
+    }
+    int4 count = (line - 1) / LINE_INDEX_STEP + 1;
+    int4 *pcs = (int4 *) malloc(count * sizeof(int4));
+    int4 *lines = (int4 *) malloc(count * sizeof(int4));
+    if (pcs == NULL || lines == NULL) {
+        free(pcs);
+        free(lines);
+        return NULL;
+    }
+
+    li = line_indexes + line_indexes_next;
+    line_indexes_next = (line_indexes_next + 1) % LINE_INDEXES;
+    if (li->text != NULL)
+        discard_line_index(li);
+    li->text = prgm->text;
+    li->size = prgm->size;
+    li->lines = line;
+    li->pc = pcs;
+    li->line = lines;
+    li->count = count;
+
+    pc = 0;
+    for (int4 i = 0; i < count; i++) {
+        pcs[i] = pc;
+        lines[i] = i * LINE_INDEX_STEP + 1;
+        if (i == count - 1)
+            break;
+        for (int j = 0; j < LINE_INDEX_STEP; j++)
+            pc += get_command_length(current_prgm, pc);
+    }
+    return li;
+}
+
+/* Called after 'length' bytes were inserted (lines > 0) or deleted
+ * (lines < 0) at 'at', which is the start of a line. Checkpoints past that
+ * point move along with their lines; if the stretch between two checkpoints
+ * becomes too long, the index is dropped, to be rebuilt on the next lookup.
+ */
+static void update_line_index(const unsigned char *oldtext, int4 oldsize,
+                              prgm_struct *prgm, int4 at, int4 length,
+                              int lines) {
+    line_index *li = lookup_line_index(oldtext, oldsize);
+    if (li == NULL)
+        return;
+    li->text = prgm->text;
+    li->size = prgm->size;
+    li->lines += lines;
+    int4 i, j = 0;
+    for (i = 0; i < li->count; i++) {
+        if (li->pc[i] > at) {
+            li->pc[i] += length;
+            li->line[i] += lines;
+        }
+        // After a deletion, a checkpoint can land on the one before it
+        if (j > 0 && li->pc[i] == li->pc[j - 1])
+            continue;
+        li->pc[j] = li->pc[i];
+        li->line[j] = li->line[i];
+        j++;
+    }
+    li->count = j;
+    for (i = 0; i < li->count; i++) {
+        int4 next = i == li->count - 1 ? li->lines : li->line[i + 1];
+        if (next - li->line[i] > 2 * LINE_INDEX_STEP) {
+            discard_line_index(li);
+            return;
+        }
+    }
+}
+
+static int scan_prgm_labels(directory *dir, int prgm_index, label_struct *labels) {
+    /* Finds the ENDs and global LBLs in the given program, and stores
+     * them in 'labels', if that is not NULL. Returns the number found.
+     */
+    prgm_struct *prgm = dir->prgms + prgm_index;
+    pgm_index idx;
+    idx.set(dir->id, prgm_index);
+    int n = 0;
+    int4 pc = 0;
+    while (pc < prgm->size) {
+        int command = prgm->text[pc];
+        int argtype = prgm->text[pc + 1];
+        command |= (argtype & 112) << 4;
+        argtype &= 15;
+
+        if (command == CMD_END
+                    || (command == CMD_LBL && argtype == ARGTYPE_STR)) {
+            if (labels != NULL) {
+                label_struct *newlabel = labels + n;
                 if (command == CMD_END)
                     newlabel->length = 0;
                 else {
-                    int i;
                     newlabel->length = prgm->text[pc + 2];
-                    for (i = 0; i < newlabel->length; i++)
+                    for (int i = 0; i < newlabel->length; i++)
                         newlabel->name[i] = prgm->text[pc + 3 + i];
                 }
                 newlabel->prgm = prgm_index;
                 newlabel->pc = pc;
             }
-            pgm_index idx;
-            idx.set(cwd->id, prgm_index);
-            pc += get_command_length(idx, pc);
+            n++;
         }
+        pc += get_command_length(idx, pc);
+    }
+    return n;
+}
+
+static bool ensure_label_capacity(directory *dir, int n) {
+    if (n <= dir->labels_capacity)
+        return true;
+    int newcap = n + 50;
+    label_struct *newlabels = (label_struct *) realloc(dir->labels, newcap * sizeof(label_struct));
+    if (newlabels == NULL)
+        return false;
+    dir->labels = newlabels;
+    dir->labels_capacity = newcap;
+    return true;
+}
+
+void rebuild_label_table() {
+    cwd->labels_count = 0;
+    cwd->labels_changed();
+    for (int prgm_index = 0; prgm_index < cwd->prgms_count; prgm_index++) {
+        int n = scan_prgm_labels(cwd, prgm_index, NULL);
+        if (!ensure_label_capacity(cwd, cwd->labels_count + n))
+            // TODO - handle memory allocation failure
+            return;
+        scan_prgm_labels(cwd, prgm_index, cwd->labels + cwd->labels_count);
+        cwd->labels_count += n;
     }
 }
 
+static void update_prgm_labels(directory *dir, int first, int old_count, int new_count) {
+    /* Incremental version of rebuild_label_table(): the programs
+     * first..first+old_count-1 have been replaced by the programs
+     * first..first+new_count-1, so only those have to be rescanned;
+     * the labels for all subsequent programs are just renumbered.
+     */
+    int lo = 0;
+    while (lo < dir->labels_count && dir->labels[lo].prgm < first)
+        lo++;
+    int hi = lo;
+    while (hi < dir->labels_count && dir->labels[hi].prgm < first + old_count)
+        hi++;
+    int n = 0;
+    for (int i = first; i < first + new_count; i++)
+        n += scan_prgm_labels(dir, i, NULL);
+    int newcount = dir->labels_count - (hi - lo) + n;
+    if (!ensure_label_capacity(dir, newcount))
+        // TODO - handle memory allocation failure
+        return;
+    memmove(dir->labels + lo + n, dir->labels + hi, (dir->labels_count - hi) * sizeof(label_struct));
+    int delta = new_count - old_count;
+    for (int i = lo + n; i < newcount; i++)
+        dir->labels[i].prgm += delta;
+    for (int i = first; i < first + new_count; i++)
+        lo += scan_prgm_labels(dir, i, dir->labels + lo);
+    dir->labels_count = newcount;
+    dir->labels_changed();
+}
+
 static void update_label_table(pgm_index prgm, int4 pc, int inserted) {
     directory *dir = dir_list[prgm.dir];
     for (int i = 0; i < dir->labels_count; i++) {
@@ -3202,6 +3806,7 @@ static void update_label_table(pgm_index prgm, int4 pc, int inserted) {
 static void invalidate_lclbls(pgm_index idx, bool force) {
     prgm_struct *prgm = dir_list[idx.dir]->prgms + idx.idx;
     if (force || !prgm->lclbl_invalid) {
+        clear_decoded_commands();
         int4 pc2 = 0;
         while (pc2 < prgm->size) {
             int command = prgm->text[pc2];
@@ -3267,8 +3872,12 @@ void delete_command(int4 pc) {
     int command = prgm->text[pc];
     int argtype = prgm->text[pc + 1];
     int length = get_command_length(current_prgm, pc);
+    const unsigned char *oldtext = prgm->text;
+    int4 oldsize = prgm->size;
     int4 pos;
 
+    journal_mark_programs(current_prgm.dir);
+    clear_decoded_commands();
     command |= (argtype & 112) << 4;
     argtype &= 15;
 
@@ -3278,6 +3887,7 @@ void delete_command(int4 pc) {
         if (current_prgm.idx == dir->prgms_count - 1)
             /* Don't allow deletion of last program's END. */
             return;
+        clear_line_indexes();
         nextprgm = prgm + 1;
         prgm->size -= 2;
         newsize = prgm->size + nextprgm->size;
@@ -3300,7 +3910,7 @@ void delete_command(int4 pc) {
         dir->prgms[dir->prgms_count - 1].text = NULL;
         dir->prgms[dir->prgms_count - 1].eq_data = NULL;
         dir->prgms_count--;
-        rebuild_label_table();
+        update_prgm_labels(dir, current_prgm.idx, 2, 1);
         invalidate_lclbls(current_prgm, true);
         draw_varmenu();
         return;
@@ -3316,8 +3926,9 @@ void delete_command(int4 pc) {
     for (pos = pc; pos < prgm->size - length; pos++)
         prgm->text[pos] = prgm->text[pos + length];
     prgm->size -= length;
+    update_line_index(oldtext, oldsize, prgm, pc, -length, -1);
     if (command == CMD_LBL && argtype == ARGTYPE_STR)
-        rebuild_label_table();
+        update_prgm_labels(dir, current_prgm.idx, 1, 1);
     else
         update_label_table(current_prgm, pc, -length);
     invalidate_lclbls(current_prgm, false);
@@ -3337,6 +3948,8 @@ int eqn_flip(int4 pc) {
     if (cmd == CMD_EMBED) {
         directory *dir = dir_list[current_prgm.dir];
         prgm_struct *prgm = dir->prgms + current_prgm.idx;
+        invalidate_decoded_prgms();
+        journal_mark_programs(current_prgm.dir);
         prgm->text[pc + 1] ^= 4;
         return ERR_YES;
     } else
@@ -3367,6 +3980,9 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
     if (pc == -1)
         pc = 0;
 
+    journal_mark_programs(current_prgm.dir);
+    clear_decoded_commands();
+
     if (arg->type == ARGTYPE_NUM && arg->val.num < 0) {
         arg->type = ARGTYPE_NEG_NUM;
         arg->val.num = -arg->val.num;
@@ -3475,6 +4091,7 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
      */
     if (command == CMD_END && prgm->size > 0) {
         prgm_struct *new_prgm;
+        clear_line_indexes();
         if (dir->prgms_count == dir->prgms_capacity) {
             prgm_struct *new_prgms;
             int4 i;
@@ -3522,7 +4139,7 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         if (flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
             print_program_line(before, pc);
 
-        rebuild_label_table();
+        update_prgm_labels(dir, before.idx, 1, 2);
         invalidate_lclbls(current_prgm, true);
         invalidate_lclbls(before, true);
         clear_all_rtns();
@@ -3602,6 +4219,8 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
         buf[bufptr++] = 0;
     }
 
+    const unsigned char *oldtext = prgm->text;
+    int4 oldsize = prgm->size;
     if (bufptr + prgm->size > prgm->capacity) {
         unsigned char *newtext;
         prgm->capacity += bufptr + 512;
@@ -3628,6 +4247,7 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
     if (command == CMD_EMBED && !loading_state)
         eq_dir->prgms[arg->val.num].eq_data->refcount++;
     prgm->size += bufptr;
+    update_line_index(oldtext, oldsize, prgm, pc, bufptr, 1);
     if (command != CMD_END && flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
         print_program_line(current_prgm, pc);
 
@@ -3638,9 +4258,11 @@ bool store_command(int4 pc, int command, arg_struct *arg, const char *num_str) {
          * the other prgm_struct members... rebuild_label_table()
          * does not react well to those.
          */
-        if (command == CMD_END ||
-                (command == CMD_LBL && arg->type == ARGTYPE_STR))
-            rebuild_label_table();
+        if (command == CMD_END)
+            // First END in a newly created program
+            update_prgm_labels(dir, current_prgm.idx, 0, 1);
+        else if (command == CMD_LBL && arg->type == ARGTYPE_STR)
+            update_prgm_labels(dir, current_prgm.idx, 1, 1);
         else
             update_label_table(current_prgm, pc, bufptr);
     }
@@ -3673,6 +4295,8 @@ static bool ensure_prgm_space(int n) {
     unsigned char *newtext = (unsigned char *) realloc(prgm->text, newcapacity);
     if (newtext == NULL)
         return false;
+    if (newtext != prgm->text)
+        invalidate_decoded_prgms();
     prgm->text = newtext;
     prgm->capacity = newcapacity;
     return true;
@@ -3807,6 +4431,7 @@ int prgm_lock(bool lock) {
     if (!flags.f.prgm_mode || current_prgm.dir != cwd->id)
         return ERR_RESTRICTED_OPERATION;
     dir_list[current_prgm.dir]->prgms[current_prgm.idx].locked = lock;
+    journal_mark_programs(current_prgm.dir);
     return ERR_NONE;
 }
 
@@ -3815,6 +4440,22 @@ static int pc_line_convert(int4 loc, int loc_is_pc) {
     int4 line = 1;
     prgm_struct *prgm = dir_list[current_prgm.dir]->prgms + current_prgm.idx;
 
+    /* Start walking from the last checkpoint before 'loc' */
+    line_index *li = find_line_index(prgm);
+    if (li != NULL) {
+        int4 *key = loc_is_pc ? li->pc : li->line;
+        int4 lo = 0, hi = li->count - 1;
+        while (lo < hi) {
+            int4 mid = (lo + hi + 1) / 2;
+            if (key[mid] <= loc)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        pc = li->pc[lo];
+        line = li->line[lo];
+    }
+
     while (1) {
         if (loc_is_pc) {
             if (pc >= loc)
@@ -3930,6 +4571,93 @@ int4 find_local_label(const arg_struct *arg) {
     return -2;
 }
 
+/* Cached PATH lookups
+ * Resolving a name through PATH means probing every directory in PATH in
+ * turn, so the results, including misses, are remembered here. The cache is
+ * keyed by name, and validated by label_gen, which changes whenever any
+ * directory's label table changes, and when the contents of PATH change.
+ */
+
+struct path_label_cache_entry {
+    int4 gen;
+    unsigned char length;
+    char name[7];
+    int4 dir;
+    int idx;
+};
+
+#define PATH_LABEL_CACHE_SIZE 64
+static path_label_cache_entry path_label_cache[PATH_LABEL_CACHE_SIZE];
+static int4 *path_snapshot = NULL;
+static int path_snapshot_count = 0;
+static int path_snapshot_capacity = 0;
+
+static void check_path_snapshot(vartype_list *path) {
+    int n = 0;
+    bool same = true;
+    if (path != NULL)
+        for (int i = 0; i < path->size; i++) {
+            vartype *v = path->array->data[i];
+            if (v->type != TYPE_DIR_REF)
+                continue;
+            int4 id = ((vartype_dir_ref *) v)->dir;
+            if (same && (n >= path_snapshot_count || path_snapshot[n] != id))
+                same = false;
+            n++;
+        }
+    if (same && n == path_snapshot_count)
+        return;
+    label_gen++;
+    path_snapshot_count = 0;
+    if (n > path_snapshot_capacity) {
+        int4 *newsnap = (int4 *) realloc(path_snapshot, n * sizeof(int4));
+        if (newsnap == NULL)
+            // The snapshot stays empty, and will not match next time either
+            return;
+        path_snapshot = newsnap;
+        path_snapshot_capacity = n;
+    }
+    if (path != NULL)
+        for (int i = 0; i < path->size; i++) {
+            vartype *v = path->array->data[i];
+            if (v->type == TYPE_DIR_REF)
+                path_snapshot[path_snapshot_count++] = ((vartype_dir_ref *) v)->dir;
+        }
+}
+
+static directory *find_path_label(const char *name, int namelen, int *idx) {
+    check_path_snapshot(get_path());
+    path_label_cache_entry *e = NULL;
+    if (namelen <= 7) {
+        e = path_label_cache + (name_hash_code(name, namelen) & (PATH_LABEL_CACHE_SIZE - 1));
+        if (e->gen == label_gen && string_equals(e->name, e->length, name, namelen)) {
+            if (e->dir == -1)
+                return NULL;
+            *idx = e->idx;
+            return get_dir(e->dir);
+        }
+    }
+    directory *res = NULL;
+    for (int i = 0; i < path_snapshot_count; i++) {
+        directory *dir = get_dir(path_snapshot[i]);
+        if (dir == NULL)
+            continue;
+        int j = dir->find_label(name, namelen);
+        if (j != -1) {
+            *idx = j;
+            res = dir;
+            break;
+        }
+    }
+    if (e != NULL) {
+        e->gen = label_gen;
+        string_copy(e->name, &e->length, name, namelen);
+        e->dir = res == NULL ? -1 : res->id;
+        e->idx = res == NULL ? -1 : *idx;
+    }
+    return res;
+}
+
 bool find_global_label(const arg_struct *arg, pgm_index *prgm, int4 *pc, int *idx) {
     const char *name = arg->val.text;
     int namelen = arg->length;
@@ -3940,38 +4668,17 @@ bool find_global_label(const arg_struct *arg, pgm_index *prgm, int4 *pc, int *id
      * doing interactive GTO from the same directory.
      */
     directory *dir = cwd;
+    int i;
     do {
-        for (int i = dir->labels_count - 1; i >= 0; i--) {
-            if (string_equals(dir->labels[i].name, dir->labels[i].length, name, namelen)) {
-                prgm->set(dir->id, dir->labels[i].prgm);
-                *pc = dir->labels[i].pc;
-                if (idx != NULL)
-                    *idx = i;
-                return true;
-            }
-        }
+        i = dir->find_label(name, namelen);
+        if (i != -1)
+            goto found;
         dir = dir->parent;
     } while (dir != NULL);
 
-    vartype_list *path = get_path();
-    if (path != NULL)
-        for (int i = 0; i < path->size; i++) {
-            vartype *v = path->array->data[i];
-            if (v->type != TYPE_DIR_REF)
-                continue;
-            dir = get_dir(((vartype_dir_ref *) v)->dir);
-            if (dir == NULL)
-                continue;
-            for (int j = dir->labels_count - 1; j >= 0; j--) {
-                if (string_equals(dir->labels[j].name, dir->labels[j].length, name, namelen)) {
-                    prgm->set(dir->id, dir->labels[j].prgm);
-                    *pc = dir->labels[j].pc;
-                    if (idx != NULL)
-                        *idx = j;
-                    return true;
-                }
-            }
-        }
+    dir = find_path_label(name, namelen, &i);
+    if (dir != NULL)
+        goto found;
 
     /* If still not found, but we're a running program, search the directory
      * containing the program. If the current stack frame belongs to an
@@ -3997,20 +4704,21 @@ bool find_global_label(const arg_struct *arg, pgm_index *prgm, int4 *pc, int *id
         } else
             dir = get_dir(current_prgm.dir);
         while (dir != NULL) {
-            for (int j = dir->labels_count - 1; j >= 0; j--) {
-                if (string_equals(dir->labels[j].name, dir->labels[j].length, name, namelen)) {
-                    prgm->set(dir->id, dir->labels[j].prgm);
-                    *pc = dir->labels[j].pc;
-                    if (idx != NULL)
-                        *idx = j;
-                    return true;
-                }
-            }
+            i = dir->find_label(name, namelen);
+            if (i != -1)
+                goto found;
             dir = dir->parent;
         }
     }
 
     return false;
+
+    found:
+    prgm->set(dir->id, dir->labels[i].prgm);
+    *pc = dir->labels[i].pc;
+    if (idx != NULL)
+        *idx = i;
+    return true;
 }
 
 int push_rtn_addr(pgm_index prgm, int4 pc) {
@@ -4629,8 +5337,10 @@ static void remove_locals() {
         free_vartype(local_vars[i].value);
         local_vars_count--;
     }
-    if (local_vars_count != old_count)
+    if (local_vars_count != old_count) {
+        local_vars_popped(old_count);
         update_catalog();
+    }
 }
 
 int rtn(int err) {
@@ -4649,6 +5359,7 @@ int rtn(int err) {
                     pc = -1;
                 if (err != ERR_NONE)
                     display_error(err);
+                mode_stop_reason = ERR_NONE;
                 return ERR_STOP;
             case -2: return return_to_solve(false, stop);
             case -3: return return_to_integ(stop);
@@ -4883,22 +5594,285 @@ bool dir_used(int id) {
     return false;
 }
 
-bool read_bool(bool *b) {
-    return read_char((char *) b);
-}
+/* State file buffer.
+ * Saving and loading state involves huge numbers of tiny reads and writes,
+ * so instead of going through stdio for each of them, save_state() collects
+ * everything in memory and writes it to gfile in one go at the end, and
+ * load_state() reads the whole file up front. When no buffer is active,
+ * the read_*() and write_*() functions go straight to gfile; program
+ * import and export rely on that.
+ */
+static char *sbuf = NULL;
+static size_t sbuf_pos, sbuf_size, sbuf_capacity;
+static bool sbuf_active = false;
+static bool sbuf_mapped = false;
+static bool sbuf_error;
+
+/* When loading, the state file is memory-mapped where possible, and large
+ * matrices are used in place, without copying; see map_bytes(). The mapping
+ * holds an extra reference to each of those matrices' arrays, so that any
+ * attempt to modify them, or to free them, finds them shared, and copies
+ * them first, just like with any other shared matrix. The mapping is
+ * released by release_state_mapping(), once those extra references are the
+ * only ones left.
+ */
+static char *state_map = NULL;
+static size_t state_map_size;
+static vartype **map_users = NULL;
+static int map_users_count = 0, map_users_capacity = 0;
+
+static bool sbuf_begin_write() {
+    sbuf_capacity = 65536;
+    sbuf = (char *) malloc(sbuf_capacity);
+    if (sbuf == NULL)
+        return false;
+    sbuf_pos = sbuf_size = 0;
+    sbuf_error = false;
+    sbuf_active = true;
+    return true;
+}
+
+static bool sbuf_begin_read() {
+    #ifdef STATE_MMAP
+        struct stat st;
+        if (fstat(fileno(gfile), &st) == 0 && st.st_size > 0) {
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(gfile), 0);
+            if (m != MAP_FAILED) {
+                sbuf = (char *) m;
+                sbuf_size = sbuf_capacity = st.st_size;
+                sbuf_pos = 0;
+                sbuf_error = false;
+                sbuf_mapped = true;
+                sbuf_active = true;
+                return true;
+            }
+        }
+    #endif
+    sbuf_capacity = 65536;
+    sbuf = (char *) malloc(sbuf_capacity);
+    if (sbuf == NULL)
+        return false;
+    sbuf_size = 0;
+    while (true) {
+        size_t n = fread(sbuf + sbuf_size, 1, sbuf_capacity - sbuf_size, gfile);
+        sbuf_size += n;
+        if (sbuf_size < sbuf_capacity)
+            break;
+        size_t newcap = sbuf_capacity * 2;
+        char *newbuf = (char *) realloc(sbuf, newcap);
+        if (newbuf == NULL) {
+            free(sbuf);
+            sbuf = NULL;
+            return false;
+        }
+        sbuf = newbuf;
+        sbuf_capacity = newcap;
+    }
+    sbuf_pos = 0;
+    sbuf_error = false;
+    sbuf_mapped = false;
+    sbuf_active = true;
+    return true;
+}
+
+/* Ends buffering; when saving, this is where the buffer is written to
+ * gfile, in a single fwrite().
+ */
+static bool sbuf_end(bool write) {
+    bool success = !sbuf_error;
+    if (success && write)
+        success = fwrite(sbuf, 1, sbuf_size, gfile) == sbuf_size
+                && fflush(gfile) == 0;
+    if (!sbuf_mapped)
+        free(sbuf);
+    #ifdef STATE_MMAP
+    else if (map_users_count == 0)
+        munmap(sbuf, sbuf_size);
+    else {
+        state_map = sbuf;
+        state_map_size = sbuf_size;
+    }
+    #endif
+    sbuf = NULL;
+    sbuf_active = false;
+    sbuf_mapped = false;
+    return success;
+}
+
+static size_t file_pos() {
+    return sbuf_active ? sbuf_pos : (size_t) ftell(gfile);
+}
+
+/* Large matrices are aligned to 16 bytes, relative to the start of the
+ * file, which is enough for any phloat.
+ */
+static bool write_align() {
+    static const char zeros[16] = { 0 };
+    int4 n = (int4) (-file_pos() & 15);
+    return n == 0 || write_bytes(zeros, n);
+}
+
+static bool read_align() {
+    char dummy[16];
+    int4 n = (int4) (-file_pos() & 15);
+    return n == 0 || read_bytes(dummy, n);
+}
+
+static bool map_direct() {
+    #ifdef F42_BIG_ENDIAN
+        return false;
+    #else
+        return sbuf_mapped && !bin_dec_mode_switch();
+    #endif
+}
+
+/* Returns a pointer to the next n bytes of the mapped state file, without
+ * consuming them, or NULL if the state file isn't mapped in a way that
+ * allows using its data in place.
+ */
+static const char *map_peek(size_t n) {
+    if (!map_direct() || n > sbuf_size - sbuf_pos)
+        return NULL;
+    return sbuf + sbuf_pos;
+}
+
+/* Skips 'skip' bytes and the alignment padding, and then returns a pointer
+ * to the next n bytes of the mapped state file, consuming them. Returns
+ * NULL, without consuming anything, if that isn't possible.
+ */
+static const char *map_bytes(size_t skip, size_t n) {
+    if (!map_direct())
+        return NULL;
+    size_t pos = sbuf_pos + skip;
+    pos += -pos & 15;
+    if (pos > sbuf_size || n > sbuf_size - pos)
+        return NULL;
+    sbuf_pos = pos + n;
+    return sbuf + pos;
+}
+
+static bool map_track(vartype *v) {
+    if (map_users_count == map_users_capacity) {
+        int newcap = map_users_capacity + 16;
+        vartype **newusers = (vartype **) realloc(map_users, newcap * sizeof(vartype *));
+        if (newusers == NULL)
+            return false;
+        map_users = newusers;
+        map_users_capacity = newcap;
+    }
+    // The mapping's own reference; see above
+    vartype *ref = dup_vartype(v);
+    if (ref == NULL)
+        return false;
+    map_users[map_users_count++] = ref;
+    return true;
+}
+
+void release_state_mapping() {
+    if (map_users_count == 0)
+        return;
+    bool in_use = false;
+    for (int i = 0; i < map_users_count; i++) {
+        vartype *v = map_users[i];
+        int refcount = v->type == TYPE_REALMATRIX
+                ? ((vartype_realmatrix *) v)->array->refcount
+                : ((vartype_complexmatrix *) v)->array->refcount;
+        if (refcount > 1)
+            in_use = true;
+    }
+    if (!in_use) {
+        for (int i = 0; i < map_users_count; i++) {
+            vartype *v = map_users[i];
+            if (v->type == TYPE_REALMATRIX) {
+                vartype_realmatrix *rm = (vartype_realmatrix *) v;
+                free(rm->array);
+                free(rm);
+            } else {
+                vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
+                free(cm->array);
+                free(cm);
+            }
+        }
+        #ifdef STATE_MMAP
+            munmap(state_map, state_map_size);
+        #endif
+    }
+    // If any of the mapped data is still in use, we leave the mapping in
+    // place, but forget about it; leaking it is better than crashing.
+    free(map_users);
+    map_users = NULL;
+    map_users_count = map_users_capacity = 0;
+    state_map = NULL;
+}
+
+static bool sbuf_reserve(size_t n) {
+    if (sbuf_pos + n <= sbuf_capacity)
+        return true;
+    size_t newcap = sbuf_capacity * 2;
+    while (newcap < sbuf_pos + n)
+        newcap *= 2;
+    char *newbuf = (char *) realloc(sbuf, newcap);
+    if (newbuf == NULL) {
+        sbuf_error = true;
+        return false;
+    }
+    sbuf = newbuf;
+    sbuf_capacity = newcap;
+    return true;
+}
+
+bool read_bytes(void *buf, int4 n) {
+    if (!sbuf_active)
+        return fread(buf, 1, n, gfile) == n;
+    if (n > sbuf_size - sbuf_pos)
+        return false;
+    memcpy(buf, sbuf + sbuf_pos, n);
+    sbuf_pos += n;
+    return true;
+}
+
+bool write_bytes(const void *buf, int4 n) {
+    if (!sbuf_active)
+        return fwrite(buf, 1, n, gfile) == n;
+    if (!sbuf_reserve(n))
+        return false;
+    memcpy(sbuf + sbuf_pos, buf, n);
+    sbuf_pos += n;
+    sbuf_size = sbuf_pos;
+    return true;
+}
+
+int read_byte() {
+    if (!sbuf_active)
+        return fgetc(gfile);
+    if (sbuf_pos == sbuf_size)
+        return EOF;
+    return (unsigned char) sbuf[sbuf_pos++];
+}
+
+void unread_byte(int c) {
+    if (!sbuf_active)
+        ungetc(c, gfile);
+    else if (c != EOF)
+        sbuf_pos--;
+}
+
+bool read_bool(bool *b) {
+    return read_char((char *) b);
+}
 
 bool write_bool(bool b) {
-    return fputc((char) b, gfile) != EOF;
+    return write_char((char) b);
 }
 
 bool read_char(char *c) {
-    int i = fgetc(gfile);
+    int i = read_byte();
     *c = (char) i;
     return i != EOF;
 }
 
 bool write_char(char c) {
-    return fputc(c, gfile) != EOF;
+    return write_bytes(&c, 1);
 }
 
 bool read_int(int *n) {
@@ -4913,166 +5887,132 @@ bool write_int(int n) {
     return write_int4(n);
 }
 
-bool read_int2(int2 *n) {
+#ifdef F42_BIG_ENDIAN
+/* Copies n items of the given size, reversing the byte order of each one,
+ * since state files are always little-endian.
+ */
+static void copy_le(char *dst, const char *src, int size, int4 n) {
+    for (int4 j = 0; j < n; j++) {
+        for (int i = 0; i < size; i++)
+            dst[i] = src[size - 1 - i];
+        dst += size;
+        src += size;
+    }
+}
+#endif
+
+static bool read_le(void *dst, int size, int4 n) {
     #ifdef F42_BIG_ENDIAN
-        char buf[2];
-        if (fread(buf, 1, 2, gfile) != 2)
+        if (!sbuf_active) {
+            char *d = (char *) dst;
+            char buf[16];
+            for (int4 j = 0; j < n; j++) {
+                if (!read_bytes(buf, size))
+                    return false;
+                copy_le(d, buf, size, 1);
+                d += size;
+            }
+            return true;
+        }
+        size_t bytes = (size_t) size * n;
+        if (bytes > sbuf_size - sbuf_pos)
             return false;
-        char *dst = (char *) n;
-        for (int i = 0; i < 2; i++)
-            dst[i] = buf[1 - i];
+        copy_le((char *) dst, sbuf + sbuf_pos, size, n);
+        sbuf_pos += bytes;
         return true;
     #else
-        return fread(n, 1, 2, gfile) == 2;
+        return read_bytes(dst, size * n);
     #endif
 }
 
-bool write_int2(int2 n) {
+static bool write_le(const void *src, int size, int4 n) {
     #ifdef F42_BIG_ENDIAN
-        char buf[2];
-        char *src = (char *) &n;
-        for (int i = 0; i < 2; i++)
-            buf[i] = src[1 - i];
-        return fwrite(buf, 1, 2, gfile) == 2;
+        if (!sbuf_active) {
+            const char *s = (const char *) src;
+            char buf[16];
+            for (int4 j = 0; j < n; j++) {
+                copy_le(buf, s, size, 1);
+                if (!write_bytes(buf, size))
+                    return false;
+                s += size;
+            }
+            return true;
+        }
+        size_t bytes = (size_t) size * n;
+        if (!sbuf_reserve(bytes))
+            return false;
+        copy_le(sbuf + sbuf_pos, (const char *) src, size, n);
+        sbuf_pos += bytes;
+        sbuf_size = sbuf_pos;
+        return true;
     #else
-        return fwrite(&n, 1, 2, gfile) == 2;
+        return write_bytes(src, size * n);
     #endif
 }
 
+bool read_int2(int2 *n) {
+    return read_le(n, 2, 1);
+}
+
+bool write_int2(int2 n) {
+    return write_le(&n, 2, 1);
+}
+
 bool read_int4(int4 *n) {
-    #ifdef F42_BIG_ENDIAN
-        char buf[4];
-        if (fread(buf, 1, 4, gfile) != 4)
-            return false;
-        char *dst = (char *) n;
-        for (int i = 0; i < 4; i++)
-            dst[i] = buf[3 - i];
-        return true;
-    #else
-        return fread(n, 1, 4, gfile) == 4;
-    #endif
+    return read_le(n, 4, 1);
 }
 
 bool write_int4(int4 n) {
-    #ifdef F42_BIG_ENDIAN
-        char buf[4];
-        char *src = (char *) &n;
-        for (int i = 0; i < 4; i++)
-            buf[i] = src[3 - i];
-        return fwrite(buf, 1, 4, gfile) == 4;
-    #else
-        return fwrite(&n, 1, 4, gfile) == 4;
-    #endif
+    return write_le(&n, 4, 1);
 }
 
 bool read_int8(int8 *n) {
-    #ifdef F42_BIG_ENDIAN
-        char buf[8];
-        if (fread(buf, 1, 8, gfile) != 8)
-            return false;
-        char *dst = (char *) n;
-        for (int i = 0; i < 8; i++)
-            dst[i] = buf[7 - i];
-        return true;
-    #else
-        return fread(n, 1, 8, gfile) == 8;
-    #endif
+    return read_le(n, 8, 1);
 }
 
 bool write_int8(int8 n) {
-    #ifdef F42_BIG_ENDIAN
-        char buf[8];
-        char *src = (char *) &n;
-        for (int i = 0; i < 8; i++)
-            buf[i] = src[7 - i];
-        return fwrite(buf, 1, 8, gfile) == 8;
-    #else
-        return fwrite(&n, 1, 8, gfile) == 8;
-    #endif
+    return write_le(&n, 8, 1);
 }
 
 bool read_phloat(phloat *d) {
     if (bin_dec_mode_switch()) {
-        #ifdef F42_BIG_ENDIAN
-            #ifdef BCD_MATH
-                char buf[8];
-                if (fread(buf, 1, 8, gfile) != 8)
-                    return false;
-                double dbl;
-                char *dst = (char *) &dbl;
-                for (int i = 0; i < 8; i++)
-                    dst[i] = buf[7 - i];
-                d->assign17digits(dbl);
-                return true;
-            #else
-                char buf[16], data[16];
-                if (fread(buf, 1, 16, gfile) != 16)
-                    return false;
-                for (int i = 0; i < 16; i++)
-                    data[i] = buf[15 - i];
-                *d = decimal2double(data);
-                return true;
-            #endif
-        #else
-            #ifdef BCD_MATH
-                double dbl;
-                if (fread(&dbl, 1, 8, gfile) != 8)
-                    return false;
-                d->assign17digits(dbl);
-                return true;
-            #else
-                char data[16];
-                if (fread(data, 1, 16, gfile) != 16)
-                    return false;
-                *d = decimal2double(data);
-                return true;
-            #endif
-        #endif
-    } else {
-        #ifdef F42_BIG_ENDIAN
-            #ifdef BCD_MATH
-                char buf[16];
-                if (fread(buf, 1, 16, gfile) != 16)
-                    return false;
-                    char *dst = (char *) d;
-                for (int i = 0; i < 16; i++)
-                    dst[i] = buf[15 - i];
-                return true;
-            #else
-                char buf[8];
-                if (fread(buf, 1, 8, gfile) != 8)
-                    return false;
-                char *dst = (char *) d;
-                for (int i = 0; i < 8; i++)
-                    dst[i] = buf[7 - i];
-                return true;
-            #endif
+        #ifdef BCD_MATH
+            double dbl;
+            if (!read_le(&dbl, 8, 1))
+                return false;
+            d->assign17digits(dbl);
+            return true;
         #else
-            if (fread(d, 1, sizeof(phloat), gfile) != sizeof(phloat))
+            char data[16];
+            if (!read_le(data, 16, 1))
                 return false;
+            *d = decimal2double(data);
+            return true;
         #endif
-        return true;
-    }
+    } else
+        return read_le(d, sizeof(phloat), 1);
 }
 
 bool write_phloat(phloat d) {
-    #ifdef F42_BIG_ENDIAN
-        #ifdef BCD_MATH
-            char buf[16];
-            char *src = (char *) &d;
-            for (int i = 0; i < 16; i++)
-                buf[i] = src[15 - i];
-            return fwrite(buf, 1, 16, gfile) == 16;
-        #else
-            char buf[8];
-            char *src = (char *) &d;
-            for (int i = 0; i < 8; i++)
-                buf[i] = src[7 - i];
-            return fwrite(buf, 1, 8, gfile) == 8;
-        #endif
-    #else
-        return fwrite(&d, 1, sizeof(phloat), gfile) == sizeof(phloat);
-    #endif
+    return write_le(&d, sizeof(phloat), 1);
+}
+
+/* Bulk versions of read_phloat() and write_phloat(), for matrices: when the
+ * state file was written by the same type of build, the elements are copied
+ * (and byte-swapped, if necessary) in a single pass.
+ */
+bool read_phloats(phloat *d, int4 n) {
+    if (bin_dec_mode_switch()) {
+        for (int4 i = 0; i < n; i++)
+            if (!read_phloat(d + i))
+                return false;
+        return true;
+    } else
+        return read_le(d, sizeof(phloat), n);
+}
+
+bool write_phloats(const phloat *d, int4 n) {
+    return write_le(d, sizeof(phloat), n);
 }
 
 struct fake_bcd {
@@ -5136,7 +6076,7 @@ bool read_arg(arg_struct *arg, bool old) {
             if (!read_char(&c))
                 return false;
             arg->length = c & 255;
-            return fread(arg->val.text, 1, arg->length, gfile) == arg->length;
+            return read_bytes(arg->val.text, arg->length);
         case ARGTYPE_LCLBL:
             return read_char(&arg->val.lclbl);
         case ARGTYPE_DOUBLE:
@@ -5172,7 +6112,7 @@ bool write_arg(const arg_struct *arg) {
         case ARGTYPE_STR:
         case ARGTYPE_IND_STR:
             return write_char((char) arg->length)
-                && fwrite(arg->val.text, 1, arg->length, gfile) == arg->length;
+                && write_bytes(arg->val.text, arg->length);
         case ARGTYPE_LCLBL:
             return write_char(arg->val.lclbl);
         case ARGTYPE_DOUBLE:
@@ -5223,10 +6163,19 @@ static bool load_state2(bool *clear, bool *too_new) {
 
     if (ver < 7)
         return false;
+    eqn_parser_version = 0;
     if (ver > PLUS42_VERSION) {
         *too_new = true;
         return false;
     }
+    if (ver < 57) {
+        state_generation = new_state_generation();
+    } else {
+        int4 gen;
+        if (!read_int4(&gen))
+            return false;
+        state_generation = (uint4) gen;
+    }
 
     // Embedded version information. No need to read this; it's just
     // there for troubleshooting purposes. All we need to do here is
@@ -5308,7 +6257,7 @@ static bool load_state2(bool *clear, bool *too_new) {
 
     if (!read_phloat(&entered_number)) return false;
     if (!read_int(&entered_string_length)) return false;
-    if (fread(entered_string, 1, 15, gfile) != 15) return false;
+    if (!read_bytes(entered_string, 15)) return false;
 
     if (!read_int(&pending_command)) return false;
     if (!read_arg(&pending_command_arg, false)) return false;
@@ -5322,11 +6271,11 @@ static bool load_state2(bool *clear, bool *too_new) {
     if (!read_int(&incomplete_argtype)) return false;
     if (!read_int(&incomplete_num)) return false;
     int isl = ver < 23 ? 22 : incomplete_length;
-    if (fread(incomplete_str, 1, isl, gfile) != isl) return false;
+    if (!read_bytes(incomplete_str, isl)) return false;
     if (!read_int4(&incomplete_saved_pc)) return false;
     if (!read_int4(&incomplete_saved_highlight_row)) return false;
 
-    if (fread(cmdline, 1, 100, gfile) != 100) return false;
+    if (!read_bytes(cmdline, 100)) return false;
     if (!read_int(&cmdline_length)) return false;
     if (!read_int(&cmdline_unit)) return false;
     if (ver < 13) {
@@ -5341,7 +6290,7 @@ static bool load_state2(bool *clear, bool *too_new) {
         matedit_mode = 0;
     else
         if (!read_int4(&matedit_dir)) return false;
-    if (fread(matedit_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(matedit_name, 7)) return false;
     if (!read_int(&matedit_length)) return false;
     if (!unpersist_vartype(&matedit_x)) return false;
     if (!read_int4(&matedit_i)) return false;
@@ -5393,13 +6342,13 @@ static bool load_state2(bool *clear, bool *too_new) {
         }
     }
 
-    if (fread(input_name, 1, 11, gfile) != 11) return false;
+    if (!read_bytes(input_name, 11)) return false;
     if (!read_int(&input_length)) return false;
     if (!read_arg(&input_arg, false)) return false;
 
     if (!read_int(&lasterr)) return false;
     if (!read_int(&lasterr_length)) return false;
-    if (fread(lasterr_text, 1, 22, gfile) != 22) return false;
+    if (!read_bytes(lasterr_text, 22)) return false;
 
     if (!read_int(&baseapp)) return false;
 
@@ -5439,8 +6388,8 @@ static bool load_state2(bool *clear, bool *too_new) {
 
     // When parser or code generator bugs are fixed, or when the semantics of
     // generated code are changed, re-parse all equations so all equation code
-    // is re-generated.
-    if (ver < 41) {
+    // is re-generated. Since version 55, this is signaled by PARSER_VERSION.
+    if (ver < 41 || eqn_parser_version != PARSER_VERSION) {
         set_running(false);
         clear_all_rtns();
         pc = -1;
@@ -5466,14 +6415,38 @@ static bool load_state2(bool *clear, bool *too_new) {
     return true;
 }
 
+// Size of the state file, as of the last full save or load; see journal_changes()
+static size_t checkpoint_size;
+static void journal_rebase(bool fresh);
+
 bool load_state(bool *clear, bool *too_new) {
+    release_state_mapping();
     shared_data_count = 0;
     shared_data_capacity = 0;
     shared_data = NULL;
 
+    #ifdef STATE_TIMING
+        uint4 t0 = shell_milliseconds();
+    #endif
+    // If there isn't enough memory for the buffer, just read unbuffered
+    bool buffered = sbuf_begin_read();
+    #ifdef STATE_TIMING
+        uint4 t1 = shell_milliseconds();
+        size_t size = sbuf_size;
+    #endif
     loading_state = true;
     bool ret = load_state2(clear, too_new);
     loading_state = false;
+    checkpoint_size = file_pos();
+    if (buffered)
+        sbuf_end(false);
+    #ifdef STATE_TIMING
+        uint4 t2 = shell_milliseconds();
+        char msg[100];
+        snprintf(msg, 100, "load_state: %lu bytes, read %u ms, decode %u ms",
+                (unsigned long) size, t1 - t0, t2 - t1);
+        shell_log(msg);
+    #endif
 
     free(shared_data);
     return ret;
@@ -5483,6 +6456,9 @@ static void save_state2(bool *success) {
     *success = false;
     if (!write_int4(PLUS42_MAGIC) || !write_int4(PLUS42_VERSION))
         return;
+    // Every full save starts a new generation; see journal_changes()
+    if (!write_int4(++state_generation))
+        return;
 
     // Write app version and platform, for troubleshooting purposes
     const char *platform = shell_platform();
@@ -5521,7 +6497,7 @@ static void save_state2(bool *success) {
 
     if (!write_phloat(entered_number)) return;
     if (!write_int(entered_string_length)) return;
-    if (fwrite(entered_string, 1, 15, gfile) != 15) return;
+    if (!write_bytes(entered_string, 15)) return;
 
     if (!write_int(pending_command)) return;
     if (!write_arg(&pending_command_arg)) return;
@@ -5534,17 +6510,17 @@ static void save_state2(bool *success) {
     if (!write_int(incomplete_maxdigits)) return;
     if (!write_int(incomplete_argtype)) return;
     if (!write_int(incomplete_num)) return;
-    if (fwrite(incomplete_str, 1, incomplete_length, gfile) != incomplete_length) return;
+    if (!write_bytes(incomplete_str, incomplete_length)) return;
     if (!write_int4(pc2line(incomplete_saved_pc))) return;
     if (!write_int4(incomplete_saved_highlight_row)) return;
 
-    if (fwrite(cmdline, 1, 100, gfile) != 100) return;
+    if (!write_bytes(cmdline, 100)) return;
     if (!write_int(cmdline_length)) return;
     if (!write_int(cmdline_unit)) return;
 
     if (!write_int(matedit_mode)) return;
     if (!write_int4(matedit_dir)) return;
-    if (fwrite(matedit_name, 1, 7, gfile) != 7) return;
+    if (!write_bytes(matedit_name, 7)) return;
     if (!write_int(matedit_length)) return;
     if (!persist_vartype(matedit_x)) return;
     if (!write_int4(matedit_i)) return;
@@ -5557,13 +6533,13 @@ static void save_state2(bool *success) {
     if (!write_int4(matedit_view_i)) return;
     if (!write_int4(matedit_view_j)) return;
 
-    if (fwrite(input_name, 1, 11, gfile) != 11) return;
+    if (!write_bytes(input_name, 11)) return;
     if (!write_int(input_length)) return;
     if (!write_arg(&input_arg)) return;
 
     if (!write_int(lasterr)) return;
     if (!write_int(lasterr_length)) return;
-    if (fwrite(lasterr_text, 1, 22, gfile) != 22) return;
+    if (!write_bytes(lasterr_text, 22)) return;
 
     if (!write_int(baseapp)) return;
 
@@ -5597,15 +6573,691 @@ bool save_state() {
     shared_data_capacity = 0;
     shared_data = NULL;
 
+    #ifdef STATE_TIMING
+        uint4 t0 = shell_milliseconds();
+    #endif
+    bool success;
+    bool buffered = sbuf_begin_write();
+    saving_state = true;
+    save_state2(&success);
+    saving_state = false;
+    size_t written = file_pos();
+    #ifdef STATE_TIMING
+        uint4 t1 = shell_milliseconds();
+        size_t size = sbuf_size;
+    #endif
+    if (buffered && !sbuf_end(true))
+        success = false;
+    #ifdef STATE_TIMING
+        uint4 t2 = shell_milliseconds();
+        char msg[100];
+        snprintf(msg, 100, "save_state: %lu bytes, encode %u ms, write %u ms",
+                (unsigned long) size, t1 - t0, t2 - t1);
+        shell_log(msg);
+    #endif
+
+    free(shared_data);
+    if (success) {
+        checkpoint_size = written;
+        journal_rebase(true);
+    }
+    return success;
+}
+
+/* Like save_state(), but instead of writing the state to gfile, it hands
+ * the buffer over to the caller, who must free() it.
+ */
+bool save_state_snapshot(char **buf, size_t *size) {
+    if (!sbuf_begin_write())
+        return false;
+    shared_data_count = 0;
+    shared_data_capacity = 0;
+    shared_data = NULL;
+
     bool success;
     saving_state = true;
     save_state2(&success);
     saving_state = false;
+    free(shared_data);
+
+    if (success && !sbuf_error) {
+        *buf = sbuf;
+        *size = sbuf_size;
+        sbuf = NULL;
+        sbuf_active = false;
+        checkpoint_size = *size;
+        journal_rebase(true);
+        return true;
+    } else {
+        sbuf_end(false);
+        return false;
+    }
+}
+
+/* State journal
+ *
+ * A full save writes the entire state, which takes a while when it contains
+ * large matrices or lots of programs. In between full saves, the shell can
+ * call core_journal_state(), which appends just the changes to a journal file
+ * next to the state file, and core_init() replays that journal after loading
+ * the state.
+ *
+ * For this purpose, the state is divided into units: each global variable,
+ * the programs in each directory, the stack and LASTX, and the flags, ALPHA,
+ * and the current directory and program. Units are marked dirty where they
+ * change: store_var(), purge_var(), and vloc::set_value() mark variables;
+ * the program editing functions mark the programs in their directory;
+ * disentangle() and the other functions that modify a value in place report
+ * it to journal_touch(), which makes any variable holding it dirty; and the
+ * core entry points that handle user input mark the stack and globals.
+ * journal_changes() writes just the dirty units, plus records for variables
+ * that have been deleted, into one batch, with a checksum; replay stops at
+ * the first batch that is incomplete or damaged, so a crash while appending
+ * loses only that batch. Everything else, like the return stack, local
+ * variables, and the menus, is restored as of the last full save.
+ *
+ * Changes to the directory tree or to the set of equations can't be journaled,
+ * and neither can the journal grow beyond the size of the state file itself;
+ * in those cases, journal_changes() returns false, and a full save is needed.
+ *
+ * The journal header contains the generation of the state file it belongs to,
+ * which changes with every full save, so a journal that is left over from
+ * before the last full save is ignored.
+ */
+
+#define JOURNAL_MAGIC 0x4a6c3432
+#define JOURNAL_MIN_LIMIT 262144
+// Beyond this many dirty units or touched values, just do a full save
+#define JOURNAL_MAX_DIRTY 4096
+
+#define JRN_END 0
+#define JRN_VAR 1
+#define JRN_PURGE 2
+#define JRN_PROGRAMS 3
+#define JRN_STACK 4
+#define JRN_GLOBALS 5
+
+static std::set<std::string> journal_dirty;
+static std::set<const vartype *> journal_touched;
+static bool journal_globals_dirty;
+static bool journal_structure_dirty;
+static bool journal_overflow;
+static bool journal_valid = false;
+static bool journal_fresh;
+static size_t journal_size, journal_pending_size;
+
+static uint8 fnv_hash(const char *p, size_t n) {
+    uint8 h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char) p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static std::string unit_key(char kind, int4 dir, const char *name, int length) {
+    std::string key(1, kind);
+    key.append((const char *) &dir, sizeof(int4));
+    key.append(name, length);
+    return key;
+}
+
+static void journal_mark(const std::string &key) {
+    if (journal_overflow)
+        return;
+    if (journal_dirty.size() >= JOURNAL_MAX_DIRTY)
+        journal_overflow = true;
+    else
+        journal_dirty.insert(key);
+}
+
+void journal_mark_var(int4 dir, const char *name, int length) {
+    journal_mark(unit_key('v', dir, name, length));
+}
+
+void journal_mark_programs(int4 dir) {
+    // Equation code is generated; it is never journaled
+    if (eq_dir != NULL && dir == eq_dir->id)
+        return;
+    journal_mark(unit_key('p', dir, NULL, 0));
+}
+
+void journal_touch(const vartype *v) {
+    if (journal_overflow || v == NULL)
+        return;
+    if (journal_touched.size() >= JOURNAL_MAX_DIRTY)
+        journal_overflow = true;
+    else
+        journal_touched.insert(v);
+}
+
+void journal_mark_globals() {
+    journal_globals_dirty = true;
+}
+
+void journal_mark_structure() {
+    journal_structure_dirty = true;
+}
+
+/* Every unit starts at a multiple of 16 bytes, so that large matrices are
+ * aligned the same way they are in the state file.
+ */
+static bool unit_begin() {
+    // No sharing between units; each must be readable on its own
+    shared_data_count = 0;
+    return write_align();
+}
+
+static bool journal_write_var(directory *dir, const var_struct *vs) {
+    return unit_begin()
+            && write_char(JRN_VAR) && write_int4(dir->id)
+            && write_char(vs->length)
+            && write_bytes(vs->name, vs->length)
+            && persist_vartype(vs->value);
+}
+
+static bool journal_write_programs(directory *dir) {
+    if (!unit_begin())
+        return false;
+    directory *saved_cwd = cwd;
+    cwd = dir;
+    bool success = write_char(JRN_PROGRAMS) && write_int4(dir->id)
+                && write_int(dir->prgms_count);
+    if (success) {
+        for (int i = 0; i < dir->prgms_count; i++)
+            core_export_programs(1, &i, NULL);
+        for (int i = 0; success && i < dir->prgms_count; i++)
+            success = write_bool(dir->prgms[i].locked);
+    }
+    cwd = saved_cwd;
+    return success;
+}
+
+/* Writes the units marked in journal_dirty, counting them in *changes */
+static bool journal_write_dirty(int *changes) {
+    for (std::set<std::string>::const_iterator it = journal_dirty.begin(); it != journal_dirty.end(); it++) {
+        const std::string &key = *it;
+        int4 id;
+        memcpy(&id, key.data() + 1, sizeof(int4));
+        directory *dir = get_dir(id);
+        if (dir == NULL)
+            // Deleted along with its directory; the tree has changed, so
+            // we shouldn't even get here.
+            return false;
+        if (key[0] == 'p') {
+            if (!journal_write_programs(dir))
+                return false;
+        } else {
+            const char *name = key.data() + 1 + sizeof(int4);
+            int length = key.length() - 1 - sizeof(int4);
+            int idx = dir->find_var(name, length);
+            if (idx != -1) {
+                if (!journal_write_var(dir, dir->vars + idx))
+                    return false;
+            } else if (!unit_begin()
+                    || !write_char(JRN_PURGE) || !write_int4(id)
+                    || !write_char(length)
+                    || !write_bytes(name, length))
+                return false;
+        }
+        (*changes)++;
+    }
+    return true;
+}
+
+/* Writes the variables whose values have been modified in place, and that
+ * haven't already been written because they were also stored.
+ */
+static bool journal_write_touched(directory *dir, int *changes) {
+    for (int i = 0; i < dir->vars_count; i++) {
+        var_struct *vs = dir->vars + i;
+        if (journal_touched.find(vs->value) == journal_touched.end())
+            continue;
+        if (journal_dirty.find(unit_key('v', dir->id, vs->name, vs->length)) != journal_dirty.end())
+            continue;
+        if (!journal_write_var(dir, vs))
+            return false;
+        (*changes)++;
+    }
+    for (int i = 0; i < dir->children_count; i++)
+        if (!journal_write_touched(dir->children[i].dir, changes))
+            return false;
+    return true;
+}
+
+static bool journal_write_globals() {
+    if (!unit_begin() || !write_char(JRN_STACK) || !write_int(sp))
+        return false;
+    for (int i = 0; i <= sp; i++)
+        if (!persist_vartype(stack[i]))
+            return false;
+    if (!persist_vartype(lastx))
+        return false;
+
+    return unit_begin()
+            && write_char(JRN_GLOBALS)
+            && write_int(reg_alpha_length)
+            && write_bytes(reg_alpha, 44)
+            && write_int4(mode_sigma_reg)
+            && write_bytes(&flags, sizeof(flags_struct))
+            && write_int4(cwd->id)
+            && write_int4(current_prgm.dir)
+            && write_int4(current_prgm.idx)
+            && write_int4(pc2line(pc))
+            && write_int(prgm_highlight_row);
+}
+
+/* Makes the current state, which has just been saved or loaded, the
+ * baseline for journal_changes(), by forgetting all the dirty marks.
+ */
+static void journal_rebase(bool fresh) {
+    journal_dirty.clear();
+    journal_touched.clear();
+    journal_globals_dirty = false;
+    journal_structure_dirty = false;
+    journal_overflow = false;
+    journal_valid = true;
+    journal_fresh = fresh;
+    if (fresh)
+        journal_size = 0;
+}
+
+/* Collects the changes since the last save, load, or journal_changes() call.
+ * 'state_header' is the first 12 bytes of the state file, or NULL if it
+ * couldn't be read. Returns false if the changes can't be journaled, and a
+ * full save is needed instead. Otherwise, *buf is NULL if nothing has changed,
+ * or else a malloc()ed buffer holding *size bytes, which the caller must
+ * write to the journal at *offset, truncating it first if *offset is 0, and
+ * then report the outcome to journal_written().
+ */
+bool journal_changes(const char *state_header, char **buf, size_t *size, size_t *offset) {
+    *buf = NULL;
+    if (!journal_valid || journal_structure_dirty || journal_overflow)
+        return false;
+    if (journal_fresh) {
+        // Only start a new journal if the state file it would belong to has
+        // actually been written; with core_write_state(), that may not have
+        // happened yet, or it may have failed.
+        if (state_header == NULL)
+            return false;
+        const unsigned char *h = (const unsigned char *) state_header;
+        uint4 magic = h[0] | (h[1] << 8) | (h[2] << 16) | (h[3] << 24);
+        uint4 version = h[4] | (h[5] << 8) | (h[6] << 16) | (h[7] << 24);
+        uint4 gen = h[8] | (h[9] << 8) | (h[10] << 16) | (h[11] << 24);
+        if (magic != PLUS42_MAGIC || version < 57 || gen != state_generation)
+            return false;
+    }
+    if (journal_dirty.empty() && journal_touched.empty() && !journal_globals_dirty)
+        return true;
+
+    if (!sbuf_begin_write())
+        return false;
+    shared_data_count = 0;
+    shared_data_capacity = 0;
+    shared_data = NULL;
+
+    bool success = true;
+    if (journal_fresh) {
+        #ifdef BCD_MATH
+            int4 decimal = 1;
+        #else
+            int4 decimal = 0;
+        #endif
+        success = write_int4(JOURNAL_MAGIC)
+                && write_int4(PLUS42_VERSION)
+                && write_int4(state_generation)
+                && write_int4(decimal);
+    }
+    // Batch header; filled in below
+    size_t batch = sbuf_pos;
+    if (success)
+        success = write_int4(JOURNAL_MAGIC) && write_int4(0) && write_int8(0);
 
+    int changes = 0;
+    saving_state = true;
+    if (success)
+        success = journal_write_dirty(&changes);
+    if (success && !journal_touched.empty())
+        success = journal_write_touched(root, &changes);
+    if (success && journal_globals_dirty) {
+        success = journal_write_globals();
+        changes++;
+    }
+    saving_state = false;
     free(shared_data);
+
+    if (!success || sbuf_error) {
+        sbuf_end(false);
+        return false;
+    }
+    if (changes == 0) {
+        sbuf_end(false);
+        journal_written(true);
+        return true;
+    }
+
+    write_align();
+    write_char(JRN_END);
+    write_align();
+    size_t end = sbuf_pos;
+    size_t length = end - batch - 16;
+    size_t limit = checkpoint_size > JOURNAL_MIN_LIMIT ? checkpoint_size : JOURNAL_MIN_LIMIT;
+    size_t base = journal_fresh ? 0 : journal_size;
+    if (sbuf_error || base + end > limit) {
+        // Time for a full save
+        sbuf_end(false);
+        return false;
+    }
+    sbuf_pos = batch;
+    write_int4(JOURNAL_MAGIC);
+    write_int4((int4) length);
+    write_int8((int8) fnv_hash(sbuf + batch + 16, length));
+    sbuf_pos = sbuf_size = end;
+
+    *buf = sbuf;
+    *size = end;
+    *offset = base;
+    sbuf = NULL;
+    sbuf_active = false;
+    journal_pending_size = base + end;
+    return true;
+}
+
+/* The caller writes the batch right after journal_changes() returns it, so
+ * nothing can have been marked in between; on success, the dirty marks have
+ * all been dealt with. On failure, they are kept, and the next batch will
+ * contain the same units again.
+ */
+void journal_written(bool success) {
+    if (!success) {
+        journal_pending_size = 0;
+        return;
+    }
+    journal_dirty.clear();
+    journal_touched.clear();
+    journal_globals_dirty = false;
+    if (journal_pending_size != 0) {
+        journal_size = journal_pending_size;
+        journal_fresh = false;
+        journal_pending_size = 0;
+    }
+}
+
+static bool replay_var(directory *dir, const char *name, int length, vartype *v) {
+    int idx = dir->find_var(name, length);
+    if (idx != -1) {
+        free_vartype(dir->vars[idx].value);
+        if (v != NULL) {
+            dir->vars[idx].value = v;
+        } else {
+            for (int i = idx; i < dir->vars_count - 1; i++)
+                dir->vars[i] = dir->vars[i + 1];
+            dir->vars_count--;
+            dir->vars_changed();
+        }
+        return true;
+    }
+    if (v == NULL)
+        return true;
+    if (dir->vars_count == dir->vars_capacity) {
+        int nc = dir->vars_capacity + 25;
+        var_struct *nv = (var_struct *) realloc(dir->vars, nc * sizeof(var_struct));
+        if (nv == NULL) {
+            free_vartype(v);
+            return false;
+        }
+        dir->vars_capacity = nc;
+        dir->vars = nv;
+    }
+    idx = dir->vars_count++;
+    var_struct *vs = dir->vars + idx;
+    string_copy(vs->name, &vs->length, name, length);
+    vs->flags = 0;
+    vs->value = v;
+    dir->var_added(idx);
+    return true;
+}
+
+static bool replay_programs(directory *dir) {
+    int nprogs;
+    if (!read_int(&nprogs))
+        return false;
+    // Import the new programs into an empty directory, and only then
+    // release the old ones, so equations that are embedded in both
+    // don't get deleted along the way.
+    // pc is a byte offset into the old program text, which doesn't survive
+    // the replacement; remember the line number instead.
+    bool prgm_in_dir = current_prgm.dir == dir->id && current_prgm.idx >= 0;
+    int4 saved_line = prgm_in_dir ? pc2line(pc) : 0;
+    prgm_struct *old_prgms = dir->prgms;
+    int old_count = dir->prgms_count;
+    int old_capacity = dir->prgms_capacity;
+    dir->prgms = NULL;
+    dir->prgms_count = 0;
+    dir->prgms_capacity = 0;
+    directory *saved_cwd = cwd;
+    pgm_index saved_prgm = current_prgm;
+    int4 saved_pc = pc;
+    cwd = dir;
+    core_import_programs(nprogs, NULL);
+    rebuild_label_table();
+    cwd = saved_cwd;
+    current_prgm = saved_prgm;
+    pc = saved_pc;
+    bool success = true;
+    for (int i = 0; success && i < dir->prgms_count; i++)
+        success = read_bool(&dir->prgms[i].locked);
+    for (int i = 0; i < dir->prgms_count; i++)
+        count_embed_references(dir, i, true);
+
+    prgm_struct *new_prgms = dir->prgms;
+    int new_count = dir->prgms_count;
+    int new_capacity = dir->prgms_capacity;
+    dir->prgms = old_prgms;
+    dir->prgms_count = old_count;
+    dir->prgms_capacity = old_capacity;
+    invalidate_decoded_prgms();
+    for (int i = 0; i < old_count; i++)
+        count_embed_references(dir, i, false);
+    for (int i = 0; i < old_count; i++) {
+        delete old_prgms[i].eq_data;
+        free(old_prgms[i].text);
+    }
+    free(old_prgms);
+    dir->prgms = new_prgms;
+    dir->prgms_count = new_count;
+    dir->prgms_capacity = new_capacity;
+    invalidate_decoded_prgms();
+    if (prgm_in_dir && new_count > 0) {
+        if (current_prgm.idx >= new_count) {
+            current_prgm.idx = new_count - 1;
+            pc = -1;
+        } else
+            // line2pc() stops at the END, so this also clamps
+            // a line past the end of a now shorter program.
+            pc = line2pc(saved_line);
+    }
     return success;
 }
 
+static bool replay_stack() {
+    int n;
+    if (!read_int(&n) || n < -1)
+        return false;
+    int capacity = n + 1 < 4 ? 4 : n + 1;
+    vartype **s = (vartype **) malloc(capacity * sizeof(vartype *));
+    if (s == NULL)
+        return false;
+    vartype *lx = NULL;
+    int i;
+    for (i = 0; i <= n; i++)
+        if (!unpersist_vartype(&s[i]) || s[i] == NULL)
+            break;
+    if (i <= n || !unpersist_vartype(&lx)) {
+        for (int j = 0; j < i; j++)
+            free_vartype(s[j]);
+        free(s);
+        return false;
+    }
+    for (i = 0; i <= sp; i++)
+        free_vartype(stack[i]);
+    free(stack);
+    free_vartype(lastx);
+    stack = s;
+    sp = n;
+    stack_capacity = capacity;
+    lastx = lx;
+    return true;
+}
+
+static bool replay_globals() {
+    int alen;
+    char alpha[44];
+    int4 sigma, cwd_id, dir, idx, line;
+    flags_struct f;
+    int row;
+    if (!read_int(&alen) || !read_bytes(alpha, 44)
+            || !read_int4(&sigma)
+            || !read_bytes(&f, sizeof(flags_struct))
+            || !read_int4(&cwd_id)
+            || !read_int4(&dir) || !read_int4(&idx)
+            || !read_int4(&line) || !read_int(&row))
+        return false;
+    reg_alpha_length = alen;
+    memcpy(reg_alpha, alpha, 44);
+    mode_sigma_reg = sigma;
+    flags = f;
+    directory *d = get_dir(cwd_id);
+    if (d != NULL)
+        cwd = d;
+    d = get_dir(dir);
+    if (d != NULL && idx >= 0 && idx < d->prgms_count) {
+        current_prgm.set(dir, idx);
+        pc = line2pc(line);
+        prgm_highlight_row = row;
+    }
+    return true;
+}
+
+static bool replay_batch() {
+    while (true) {
+        char kind;
+        if (!read_align() || !read_char(&kind))
+            return false;
+        shared_data_count = 0;
+        switch (kind) {
+            case JRN_END:
+                return true;
+            case JRN_VAR:
+            case JRN_PURGE: {
+                int4 id;
+                char length;
+                char name[7];
+                if (!read_int4(&id) || !read_char(&length)
+                        || length < 0 || length > 7
+                        || !read_bytes(name, length))
+                    return false;
+                directory *dir = get_dir(id);
+                if (dir == NULL || dir == eq_dir)
+                    return false;
+                vartype *v = NULL;
+                if (kind == JRN_VAR && (!unpersist_vartype(&v) || v == NULL))
+                    return false;
+                if (!replay_var(dir, name, length, v))
+                    return false;
+                break;
+            }
+            case JRN_PROGRAMS: {
+                int4 id;
+                if (!read_int4(&id))
+                    return false;
+                directory *dir = get_dir(id);
+                if (dir == NULL || dir == eq_dir)
+                    return false;
+                // The return stack may refer to the old programs
+                clear_all_rtns();
+                if (!replay_programs(dir))
+                    return false;
+                break;
+            }
+            case JRN_STACK:
+                if (!replay_stack())
+                    return false;
+                break;
+            case JRN_GLOBALS:
+                if (!replay_globals())
+                    return false;
+                break;
+            default:
+                return false;
+        }
+    }
+}
+
+/* Called after the state has been loaded, with the contents of the journal,
+ * or with buf == NULL if there is none. Replays the journal, if it belongs to
+ * the state that was just loaded, and establishes the baseline for the next
+ * journal_changes() call.
+ */
+void replay_journal(const char *buf, size_t size) {
+    bool fresh = true;
+    bool same_format = true;
+    size_t good = 0;
+    if (buf != NULL) {
+        sbuf = (char *) buf;
+        sbuf_size = sbuf_capacity = size;
+        sbuf_pos = 0;
+        sbuf_error = false;
+        sbuf_mapped = false;
+        sbuf_active = true;
+        shared_data_count = 0;
+        shared_data_capacity = 0;
+        shared_data = NULL;
+        int4 magic, version, gen, decimal;
+        if (read_int4(&magic) && magic == JOURNAL_MAGIC
+                && read_int4(&version) && version == PLUS42_VERSION
+                && read_int4(&gen) && (uint4) gen == state_generation
+                && read_int4(&decimal)) {
+            int saved_format = state_file_number_format;
+            state_file_number_format = decimal ? NUMBER_FORMAT_BID128 : NUMBER_FORMAT_BINARY;
+            #ifdef BCD_MATH
+                same_format = decimal != 0;
+            #else
+                same_format = decimal == 0;
+            #endif
+            ver = version;
+            loading_state = true;
+            good = sbuf_pos;
+            while (true) {
+                int4 length;
+                int8 checksum;
+                if (!read_int4(&magic) || magic != JOURNAL_MAGIC
+                        || !read_int4(&length) || !read_int8(&checksum)
+                        || length < 0 || (size_t) length > sbuf_size - sbuf_pos
+                        || fnv_hash(sbuf + sbuf_pos, length) != (uint8) checksum)
+                    break;
+                size_t end = sbuf_pos + length;
+                if (!replay_batch())
+                    break;
+                sbuf_pos = good = end;
+            }
+            loading_state = false;
+            state_file_number_format = saved_format;
+            fresh = false;
+        }
+        free(shared_data);
+        // The buffer belongs to the caller
+        sbuf = NULL;
+        sbuf_active = false;
+    }
+    journal_rebase(fresh);
+    if (!fresh)
+        journal_size = good;
+    if (!same_format)
+        // Don't mix number formats in one journal; force a full save
+        journal_valid = false;
+}
+
 // Reason:
 // 0 = Memory Clear
 // 1 = State File Corrupt
@@ -5613,6 +7265,9 @@ bool save_state() {
 void hard_reset(int reason) {
     vartype *regs;
 
+    state_generation = new_state_generation();
+    journal_valid = false;
+
     /* Clear stack */
     for (int i = 0; i <= sp; i++)
         free_vartype(stack[i]);
@@ -432,6 +432,10 @@ struct directory {
     int labels_capacity;
     int labels_count;
     label_struct *labels;
+    int label_hash_size;
+    int *label_hash;
+    int var_hash_size;
+    int *var_hash;
     int children_capacity;
     int children_count;
     subdir_struct *children;
@@ -439,8 +443,15 @@ struct directory {
     directory(int id);
     ~directory();
     directory *clone();
+    int find_label(const char *name, int namelen);
+    void labels_changed();
+    int find_var(const char *name, int namelen);
+    void var_added(int idx);
+    void vars_changed();
 };
 
+int name_hash_code(const char *name, int namelen);
+
 extern directory *root;
 extern directory *cwd;
 extern directory *eq_dir;
@@ -486,6 +497,7 @@ extern int mode_transientmenu;
 extern int mode_alphamenu;
 extern int mode_commandmenu;
 extern bool mode_running;
+extern int mode_stop_reason;
 extern bool mode_getkey;
 extern bool mode_getkey1;
 extern bool mode_pause;
@@ -531,6 +543,22 @@ extern int pending_command;
 extern arg_struct pending_command_arg;
 extern int xeq_invisible;
 
+/* Number of program lines executed since core_init(). Not persistent; it
+ * is only used by the benchmark driver, to report instructions per second.
+ */
+extern uint8 instructions_executed;
+
+/* Scheduling of running programs. continue_running() only reads the clock
+ * and polls shell_wants_cpu() once every slice_budget instructions, and
+ * adjusts slice_budget after each poll so that a slice takes about
+ * slice_duration milliseconds. slice_polls counts the polls, for
+ * instrumentation.
+ * Not persistent.
+ */
+extern int4 slice_budget;
+extern int slice_duration;
+extern uint8 slice_polls;
+
 /* Multi-keystroke commands -- edit state */
 /* Relevant when mode_command_entry != 0 */
 extern int incomplete_command;
@@ -702,6 +730,8 @@ bool mvar_prgms_exist();
 bool label_has_mvar(int4 dir_id, int lblindex);
 int get_command_length(pgm_index prgm, int4 pc);
 void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target, const char **num_str);
+void fetch_next_command(int4 *pc, int *command, arg_struct *arg);
+void invalidate_decoded_prgms();
 void rebuild_label_table();
 void count_embed_references(directory *dir, int prgm, bool up);
 void delete_command(int4 pc);
@@ -743,6 +773,10 @@ bool integ_active();
 bool solve_or_plot_active();
 bool unwind_stack_until_solve_or_plot(int *which);
 
+bool read_bytes(void *buf, int4 n);
+bool write_bytes(const void *buf, int4 n);
+int read_byte();
+void unread_byte(int c);
 bool read_bool(bool *b);
 bool write_bool(bool b);
 bool read_char(char *c);
@@ -757,6 +791,8 @@ bool read_int8(int8 *n);
 bool write_int8(int8 n);
 bool read_phloat(phloat *d);
 bool write_phloat(phloat d);
+bool read_phloats(phloat *d, int4 n);
+bool write_phloats(const phloat *d, int4 n);
 bool read_arg(arg_struct *arg, bool old);
 bool write_arg(const arg_struct *arg);
 
@@ -766,6 +802,16 @@ bool write_arg(const arg_struct *arg);
 
 bool load_state(bool *clear, bool *too_new);
 bool save_state();
+bool save_state_snapshot(char **buf, size_t *size);
+void release_state_mapping();
+bool journal_changes(const char *state_header, char **buf, size_t *size, size_t *offset);
+void journal_written(bool success);
+void journal_mark_var(int4 dir, const char *name, int length);
+void journal_mark_programs(int4 dir);
+void journal_touch(const vartype *v);
+void journal_mark_globals();
+void journal_mark_structure();
+void replay_journal(const char *buf, size_t size);
 // Reason:
 // 0 = Memory Clear
 // 1 = State File Corrupt
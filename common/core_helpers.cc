@@ -1621,6 +1621,7 @@ phloat cos_grad(phloat x) {
 
 int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
     int4 size = rows * columns;
+    journal_touch(matrix);
     if (matrix->type == TYPE_REALMATRIX) {
         vartype_realmatrix *oldmatrix = (vartype_realmatrix *) matrix;
         if (oldmatrix->rows == rows && oldmatrix->columns == columns)
@@ -24,6 +24,7 @@
 #include "core_math2.h"
 #include "core_sto_rcl.h"
 #include "core_variables.h"
+#include "shell.h"
 
 
 /**********************************/
@@ -330,6 +331,424 @@ static int small_div(const vartype *left, const vartype *right, int (*completion
 /***** Matrix-matrix multiplication *****/
 /****************************************/
 
+/* Blocked matrix multiplication
+ * For large matrices, the plain i,j,k algorithm spends most of its time
+ * waiting for memory, since it walks down the columns of the right-hand
+ * matrix, one cache line per element. The blocked algorithm breaks up the
+ * multiplication into multiplications of submatrices of the multiplicands,
+ * small enough that a pair of them fits in the CPU's L1 cache. Each pair is
+ * copied into a contiguous buffer first, with the right-hand one transposed,
+ * so the inner loop reads both sequentially.
+ * The optimum block size depends on the cache size, so it is a setting,
+ * core_settings.matrix_block_size, with 0 meaning no blocking; shells can use
+ * core_calibrate_matrix_block_size() to find the best value for the host.
+ * The products for each element of the result are still added up in order of
+ * increasing k, so the results are identical to those of the unblocked
+ * algorithm; the overflow check is only done after the last block in the k
+ * direction, for the same reason.
+ * This handles all four combinations of real and complex multiplicands; lc
+ * and rc indicate which ones are complex.
+ */
+
+struct mul_blocked_data_struct {
+    const phloat *l;
+    const phloat *r;
+    phloat *p;
+    bool lc, rc;
+    int4 m, n, q, bs;
+    int4 i, j, k, ii;
+    int threads;
+    phloat *cache;
+    int4 cache_size;
+    vartype *result;
+    int (*completion)(int error, vartype *result);
+};
+
+static mul_blocked_data_struct *mul_blocked_data;
+
+static bool mul_blocked_init(mul_blocked_data_struct *dat,
+                             const phloat *l, bool lc, const phloat *r, bool rc,
+                             int4 m, int4 n, int4 q, int4 bs, int threads) {
+    /* Each thread gets its own pair of block buffers */
+    dat->cache_size = bs * bs * ((lc ? 2 : 1) + (rc ? 2 : 1));
+    dat->cache = (phloat *) malloc(threads * dat->cache_size * sizeof(phloat));
+    if (dat->cache == NULL)
+        return false;
+    dat->l = l;
+    dat->r = r;
+    dat->lc = lc;
+    dat->rc = rc;
+    dat->m = m;
+    dat->n = n;
+    dat->q = q;
+    dat->bs = bs;
+    dat->i = 0;
+    dat->j = 0;
+    dat->k = 0;
+    dat->ii = 0;
+    dat->threads = threads;
+    return true;
+}
+
+static bool mul_check_overflow(phloat *sum) {
+    int inf = p_isinf(*sum);
+    if (inf == 0)
+        return true;
+    if (core_settings.matrix_outofrange && !flags.f.range_error_ignore)
+        return false;
+    *sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    return true;
+}
+
+static void mul_blocked_pack(const mul_blocked_data_struct *dat, phloat *cache,
+                             int4 i, int4 j, int4 k,
+                             int4 iimax, int4 jjmax, int4 kkmax) {
+    int4 bs = dat->bs;
+    phloat *lcache = cache;
+    phloat *rcache = cache + bs * bs * (dat->lc ? 2 : 1);
+    int4 ii, jj, kk;
+    if (dat->lc) {
+        for (ii = 0; ii < iimax; ii++) {
+            const phloat *src = dat->l + 2 * ((i + ii) * dat->q + k);
+            phloat *dst = lcache + 2 * ii * bs;
+            for (kk = 0; kk < 2 * kkmax; kk++)
+                dst[kk] = src[kk];
+        }
+    } else {
+        for (ii = 0; ii < iimax; ii++) {
+            const phloat *src = dat->l + (i + ii) * dat->q + k;
+            phloat *dst = lcache + ii * bs;
+            for (kk = 0; kk < kkmax; kk++)
+                dst[kk] = src[kk];
+        }
+    }
+    if (dat->rc) {
+        for (kk = 0; kk < kkmax; kk++) {
+            const phloat *src = dat->r + 2 * ((k + kk) * dat->n + j);
+            for (jj = 0; jj < jjmax; jj++) {
+                rcache[2 * (jj * bs + kk)] = src[2 * jj];
+                rcache[2 * (jj * bs + kk) + 1] = src[2 * jj + 1];
+            }
+        }
+    } else {
+        for (kk = 0; kk < kkmax; kk++) {
+            const phloat *src = dat->r + (k + kk) * dat->n + j;
+            for (jj = 0; jj < jjmax; jj++)
+                rcache[jj * bs + kk] = src[jj];
+        }
+    }
+}
+
+static bool mul_blocked_row(const mul_blocked_data_struct *dat, const phloat *cache,
+                            int4 i, int4 j, int4 ii, int4 jjmax, int4 kkmax,
+                            bool last) {
+    /* Multiplies row ii of the packed left-hand block by the packed
+     * right-hand block, adding the products to row i + ii of the result,
+     * starting at column j. Returns false if the result overflowed.
+     */
+    int4 bs = dat->bs;
+    const phloat *lcache = cache;
+    const phloat *rcache = cache + bs * bs * (dat->lc ? 2 : 1);
+    int4 row = (i + ii) * dat->n + j;
+    int4 jj, kk;
+
+    if (!dat->lc && !dat->rc) {
+        const phloat *l = lcache + ii * bs;
+        phloat *p = dat->p + row;
+        for (jj = 0; jj < jjmax; jj++) {
+            const phloat *r = rcache + jj * bs;
+            phloat sum = p[jj];
+            for (kk = 0; kk < kkmax; kk++)
+                sum += l[kk] * r[kk];
+            if (last && !mul_check_overflow(&sum))
+                return false;
+            p[jj] = sum;
+        }
+    } else if (!dat->lc) {
+        const phloat *l = lcache + ii * bs;
+        phloat *p = dat->p + 2 * row;
+        for (jj = 0; jj < jjmax; jj++) {
+            const phloat *r = rcache + 2 * jj * bs;
+            phloat sum_re = p[2 * jj];
+            phloat sum_im = p[2 * jj + 1];
+            for (kk = 0; kk < kkmax; kk++) {
+                phloat tmp = l[kk];
+                sum_re += tmp * r[2 * kk];
+                sum_im += tmp * r[2 * kk + 1];
+            }
+            if (last && (!mul_check_overflow(&sum_re)
+                        || !mul_check_overflow(&sum_im)))
+                return false;
+            p[2 * jj] = sum_re;
+            p[2 * jj + 1] = sum_im;
+        }
+    } else if (!dat->rc) {
+        const phloat *l = lcache + 2 * ii * bs;
+        phloat *p = dat->p + 2 * row;
+        for (jj = 0; jj < jjmax; jj++) {
+            const phloat *r = rcache + jj * bs;
+            phloat sum_re = p[2 * jj];
+            phloat sum_im = p[2 * jj + 1];
+            for (kk = 0; kk < kkmax; kk++) {
+                phloat tmp = r[kk];
+                sum_re += tmp * l[2 * kk];
+                sum_im += tmp * l[2 * kk + 1];
+            }
+            if (last && (!mul_check_overflow(&sum_re)
+                        || !mul_check_overflow(&sum_im)))
+                return false;
+            p[2 * jj] = sum_re;
+            p[2 * jj + 1] = sum_im;
+        }
+    } else {
+        const phloat *l = lcache + 2 * ii * bs;
+        phloat *p = dat->p + 2 * row;
+        for (jj = 0; jj < jjmax; jj++) {
+            const phloat *r = rcache + 2 * jj * bs;
+            phloat sum_re = p[2 * jj];
+            phloat sum_im = p[2 * jj + 1];
+            for (kk = 0; kk < kkmax; kk++) {
+                phloat l_re = l[2 * kk];
+                phloat l_im = l[2 * kk + 1];
+                phloat r_re = r[2 * kk];
+                phloat r_im = r[2 * kk + 1];
+                sum_re += l_re * r_re - l_im * r_im;
+                sum_im += l_im * r_re + l_re * r_im;
+            }
+            if (last && (!mul_check_overflow(&sum_re)
+                        || !mul_check_overflow(&sum_im)))
+                return false;
+            p[2 * jj] = sum_re;
+            p[2 * jj + 1] = sum_im;
+        }
+    }
+    return true;
+}
+
+/* With multiple threads, each call does one band of bs rows. The band is
+ * split into slices of columns, at most bs wide, and the threads take care of
+ * some of those slices each.
+ */
+
+struct mul_band_struct {
+    mul_blocked_data_struct *dat;
+    int4 iimax;
+    int4 width;
+    bool overflow[LINALG_MAX_THREADS];
+};
+
+static void mul_band_worker(void *ctx, int thread, int4 from, int4 to) {
+    mul_band_struct *band = (mul_band_struct *) ctx;
+    const mul_blocked_data_struct *dat = band->dat;
+    phloat *cache = dat->cache + thread * dat->cache_size;
+    for (int4 s = from; s < to; s++) {
+        int4 j = s * band->width;
+        int4 jjmax = dat->n - j;
+        if (jjmax > band->width)
+            jjmax = band->width;
+        for (int4 k = 0; k < dat->q; k += dat->bs) {
+            int4 kkmax = dat->q - k;
+            if (kkmax > dat->bs)
+                kkmax = dat->bs;
+            mul_blocked_pack(dat, cache, dat->i, j, k, band->iimax, jjmax, kkmax);
+            bool last = k + kkmax == dat->q;
+            for (int4 ii = 0; ii < band->iimax; ii++)
+                if (!mul_blocked_row(dat, cache, dat->i, j, ii, jjmax, kkmax, last)) {
+                    band->overflow[thread] = true;
+                    return;
+                }
+        }
+    }
+}
+
+static int mul_blocked_step(mul_blocked_data_struct *dat, int count) {
+    /* Performs roughly 'count' multiply-adds, one row of a block at a time,
+     * or, with multiple threads, one band of rows. Returns ERR_INTERRUPTIBLE
+     * if there is more work to do, ERR_NONE when done, or ERR_OUT_OF_RANGE
+     * if the result overflowed.
+     */
+    int4 bs = dat->bs;
+    int4 n = dat->n;
+
+    if (dat->threads > 1) {
+        mul_band_struct band;
+        band.dat = dat;
+        band.iimax = dat->m - dat->i;
+        if (band.iimax > bs)
+            band.iimax = bs;
+        band.width = (n + dat->threads - 1) / dat->threads;
+        if (band.width > bs)
+            band.width = bs;
+        for (int t = 0; t < dat->threads; t++)
+            band.overflow[t] = false;
+        linalg_parallel_for((n + band.width - 1) / band.width, mul_band_worker, &band);
+        for (int t = 0; t < dat->threads; t++)
+            if (band.overflow[t])
+                return ERR_OUT_OF_RANGE;
+        if ((dat->i += bs) < dat->m)
+            return ERR_INTERRUPTIBLE;
+        return ERR_NONE;
+    }
+
+    while (count > 0) {
+        int4 iimax = dat->m - dat->i;
+        if (iimax > bs)
+            iimax = bs;
+        int4 jjmax = n - dat->j;
+        if (jjmax > bs)
+            jjmax = bs;
+        int4 kkmax = dat->q - dat->k;
+        if (kkmax > bs)
+            kkmax = bs;
+        if (dat->ii == 0)
+            mul_blocked_pack(dat, dat->cache, dat->i, dat->j, dat->k, iimax, jjmax, kkmax);
+        bool last = dat->k + kkmax == dat->q;
+        if (!mul_blocked_row(dat, dat->cache, dat->i, dat->j, dat->ii, jjmax, kkmax, last))
+            return ERR_OUT_OF_RANGE;
+        count -= jjmax * kkmax;
+        if (++dat->ii < iimax)
+            continue;
+        dat->ii = 0;
+        if ((dat->k += bs) < dat->q)
+            continue;
+        dat->k = 0;
+        if ((dat->j += bs) < n)
+            continue;
+        dat->j = 0;
+        if ((dat->i += bs) < dat->m)
+            continue;
+        return ERR_NONE;
+    }
+    return ERR_INTERRUPTIBLE;
+}
+
+static int matrix_mul_blocked_worker(bool interrupted) {
+    mul_blocked_data_struct *dat = mul_blocked_data;
+    int err = interrupted ? ERR_INTERRUPTED : mul_blocked_step(dat, 1000);
+    if (err == ERR_INTERRUPTIBLE)
+        return err;
+    if (err == ERR_NONE) {
+        err = dat->completion(ERR_NONE, dat->result);
+    } else {
+        err = dat->completion(err, NULL);
+        free_vartype(dat->result);
+    }
+    free(dat->cache);
+    free(dat);
+    return err;
+}
+
+static int matrix_mul_blocked(const phloat *l, bool lc, const phloat *r, bool rc,
+                              int4 m, int4 n, int4 q,
+                              int (*completion)(int, vartype *)) {
+    /* Starts a blocked multiplication, if the matrices are large enough for
+     * that to make sense. Returns ERR_INTERRUPTIBLE if it did; anything else
+     * means the caller should use the unblocked algorithm instead.
+     * Large multiplications are spread over multiple threads, if available;
+     * that is done using the blocked algorithm even when blocking is turned
+     * off, since that is the easiest way to partition the work.
+     */
+    int4 bs = core_settings.matrix_block_size;
+    int threads = linalg_threads();
+    if (threads > 1 && ((double) m) * n * q < 262144.0)
+        threads = 1;
+    if (bs <= 0) {
+        if (threads == 1)
+            return ERR_NONE;
+        bs = 64;
+    }
+    if (threads == 1 && m <= bs && n <= bs && q <= bs)
+        return ERR_NONE;
+    mul_blocked_data_struct *dat = (mul_blocked_data_struct *)
+                                    malloc(sizeof(mul_blocked_data_struct));
+    if (dat == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    if (!mul_blocked_init(dat, l, lc, r, rc, m, n, q, bs, threads)) {
+        free(dat);
+        return ERR_INSUFFICIENT_MEMORY;
+    }
+    if (lc || rc) {
+        dat->result = new_complexmatrix(m, n);
+        if (dat->result != NULL)
+            dat->p = ((vartype_complexmatrix *) dat->result)->array->data;
+    } else {
+        dat->result = new_realmatrix(m, n);
+        if (dat->result != NULL)
+            dat->p = ((vartype_realmatrix *) dat->result)->array->data;
+    }
+    if (dat->result == NULL) {
+        free(dat->cache);
+        free(dat);
+        return ERR_INSUFFICIENT_MEMORY;
+    }
+    dat->completion = completion;
+
+    mul_blocked_data = dat;
+    mode_interruptible = matrix_mul_blocked_worker;
+    mode_stoppable = false;
+    return ERR_INTERRUPTIBLE;
+}
+
+int linalg_calibrate_block_size() {
+    /* Times the multiplication of two square matrices, too large to fit in
+     * the cache, without blocking and with a range of block sizes, and
+     * returns the block size that was fastest, or 0 if blocking didn't help.
+     * This takes a few seconds.
+     */
+#ifdef BCD_MATH
+    const int4 n = 96;
+#else
+    const int4 n = 320;
+#endif
+    static const int4 sizes[] = { 0, 16, 24, 32, 48, 64, 96, 128 };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+
+    phloat *a = (phloat *) malloc(3 * n * n * sizeof(phloat));
+    if (a == NULL)
+        return core_settings.matrix_block_size;
+    phloat *b = a + n * n;
+    phloat *c = b + n * n;
+    uint4 seed = 1;
+    for (int4 i = 0; i < 2 * n * n; i++) {
+        seed = seed * 1103515245 + 12345;
+        a[i] = (phloat) (int4) ((seed >> 16) % 1999 - 999) / 1000;
+    }
+
+    int best = 0;
+    uint4 best_time = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int s = 0; s < nsizes; s++) {
+            int4 bs = sizes[s];
+            for (int4 i = 0; i < n * n; i++)
+                c[i] = 0;
+            uint4 start = shell_milliseconds();
+            if (bs == 0) {
+                for (int4 i = 0; i < n; i++)
+                    for (int4 j = 0; j < n; j++) {
+                        phloat sum = 0;
+                        for (int4 k = 0; k < n; k++)
+                            sum += a[i * n + k] * b[k * n + j];
+                        c[i * n + j] = sum;
+                    }
+            } else {
+                mul_blocked_data_struct dat;
+                if (!mul_blocked_init(&dat, a, false, b, false, n, n, n, bs, 1))
+                    continue;
+                dat.p = c;
+                while (mul_blocked_step(&dat, 1000000) == ERR_INTERRUPTIBLE);
+                free(dat.cache);
+            }
+            uint4 elapsed = shell_milliseconds() - start;
+            if ((pass == 0 && s == 0) || elapsed < best_time) {
+                best = bs;
+                best_time = elapsed;
+            }
+        }
+    }
+    free(a);
+    return best;
+}
+
 struct mul_rr_data_struct {
     vartype_realmatrix *left;
     vartype_realmatrix *right;
@@ -359,6 +778,11 @@ static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
         goto finished;
     }
 
+    if (matrix_mul_blocked(left->array->data, false, right->array->data, false,
+                           left->rows, right->columns, left->columns,
+                           completion) == ERR_INTERRUPTIBLE)
+        return ERR_INTERRUPTIBLE;
+
     dat = (mul_rr_data_struct *) malloc(sizeof(mul_rr_data_struct));
     if (dat == NULL) {
         error = ERR_INSUFFICIENT_MEMORY;
@@ -446,143 +870,6 @@ static int matrix_mul_rr_worker(bool interrupted) {
     return ERR_INTERRUPTIBLE;
 }
 
-#if 0
-/* TODO: Blocked matrix multiplication
- * This commented-out function implements a working blocked matrix
- * multiplication algorithm. It works by breaking up the multiplication into
- * multiplications of submatrices of the multiplicands. If the submatrices are
- * sufficiently small, they can be made to fit entirely in the CPU's L1 cache.
- * With block sizes of around 45, I have observed a speed-up factor of circa
- * 1.7 on a Pentium MMX, and with block sizes of about 90, I have observed a
- * speed-up factor of circa 3 on a Duron. (Those were the optimum block sizes
- * observed for each processor.) These numbers suggest the Pentium MMX has a 32
- * kilobyte L1 cache, and the Duron has a 128 kilobyte L1 cache.
- * For production use, the block size should be a user-configurable parameter,
- * with a built-in tool to automatically determine the optimum value. Since the
- * UI for this kind of advanced configuration does not exist yet, and sice the
- * determination of optimum block size is a very slow process, and since I
- * expect most HP-42S users will not be very interested in using a calculator
- * to work with order-100+ matrices, and since even in the optimum case the
- * speed-up is not staggering, I'm putting full implementation of this feature
- * off until some later date.
- */
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         vartype **result) {
-    phloat *cache = NULL;
-    phloat *leftcache, *rightcache;
-
-    phloat *l = left->array->data;
-    phloat *r = right->array->data;
-    phloat *p;
-    int inf;
-    int4 m, n, q;
-    int4 i, j, k;
-
-    q = left->columns;
-    if (q != right->rows)
-        return ERR_DIMENSION_ERROR;
-    m = left->rows;
-    n = right->columns;
-
-    if (contains_strings(left) || contains_strings(right))
-        return ERR_ALPHA_DATA_IS_INVALID;
-
-    *result = new_realmatrix(m, n);
-    if (*result == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    p = ((vartype_realmatrix *) *result)->array->data;
-
-    if (BLOCK_SIZE > 0) {
-        int4 cachesize = 2 * BLOCK_SIZE * BLOCK_SIZE;
-        int4 alignment = CACHE_ALIGNMENT;
-        int4 misalgn;
-        if (alignment == 0)
-            alignment = 1;
-        misalgn = alignment % sizeof(phloat);
-        if (misalgn != 0)
-            alignment += sizeof(phloat) - misalgn;
-
-        cache = (phloat *) malloc(cachesize * sizeof(phloat) + alignment);
-        if (cache != NULL) {
-            misalgn = ((unsigned long) cache) % alignment;
-            if (misalgn == 0)
-                leftcache = cache;
-            else
-                leftcache = cache + (alignment - misalgn) / sizeof(phloat);
-            rightcache = leftcache + BLOCK_SIZE * BLOCK_SIZE;
-        }
-    }
-
-    if (cache == NULL) {
-
-        /* Falling back on basic i,j,k algorithm */
-        for (i = 0; i < m; i++)
-            for (j = 0; j < n; j++) {
-                phloat sum = 0;
-                for (k = 0; k < q; k++)
-                    sum += l[i * q + k] * r[k * n + j];
-                if ((inf = p_isinf(sum)) != 0) {
-                    if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore)
-                        return ERR_OUT_OF_RANGE;
-                    else
-                        sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-                }
-                p[i * n + j] = sum;
-            }
-        return ERR_NONE;
-
-    } else {
-
-        /* Blocked i,j,k algorithm for optimal cache utilization */
-        int4 i, j, k, ii, jj, kk;
-        for (i = 0; i < m; i += BLOCK_SIZE) {
-            int4 iimax = m - i;
-            if (iimax > BLOCK_SIZE)
-                iimax = BLOCK_SIZE;
-            for (j = 0; j < n; j += BLOCK_SIZE) {
-                int4 jjmax = n - j;
-                if (jjmax > BLOCK_SIZE)
-                    jjmax = BLOCK_SIZE;
-                for (k = 0; k < q; k += BLOCK_SIZE) {
-                    int4 kkmax = q - k;
-                    if (kkmax > BLOCK_SIZE)
-                        kkmax = BLOCK_SIZE;
-                    for (ii = 0; ii < iimax; ii++)
-                        for (kk = 0; kk < kkmax; kk++)
-                            leftcache[ii * BLOCK_SIZE + kk]
-                                = l[(ii + i) * q + (kk + k)];
-                    for (kk = 0; kk < kkmax; kk++)
-                        for (jj = 0; jj < jjmax; jj++)
-                            rightcache[kk * BLOCK_SIZE + jj]
-                                = r[(kk + k) * n + (jj + j)];
-                    for (ii = 0; ii < iimax; ii++)
-                        for (jj = 0; jj < jjmax; jj++) {
-                            phloat sum = p[(ii + i) * n + (jj + j)];
-                            for (kk = 0; kk < kkmax; kk++)
-                                sum += leftcache[ii * BLOCK_SIZE + kk]
-                                        * rightcache[kk * BLOCK_SIZE + jj];
-                            if ((inf = p_isinf(sum)) != 0) {
-                                if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore) {
-                                    free(cache);
-                                    return ERR_OUT_OF_RANGE;
-                                } else
-                                    sum = inf < 0 ? NEG_HUGE_PHLOAT
-                                                  : POS_HUGE_PHLOAT;
-                            }
-                            p[(ii + i) * n + (jj + j)] = sum;
-                        }
-                }
-            }
-        }
-        free(cache);
-        return ERR_NONE;
-
-    }
-}
-#endif
-
 struct mul_rc_data_struct {
     vartype_realmatrix *left;
     vartype_complexmatrix *right;
@@ -612,6 +899,11 @@ static int matrix_mul_rc(vartype_realmatrix *left, vartype_complexmatrix *right,
         goto finished;
     }
 
+    if (matrix_mul_blocked(left->array->data, false, right->array->data, true,
+                           left->rows, right->columns, left->columns,
+                           completion) == ERR_INTERRUPTIBLE)
+        return ERR_INTERRUPTIBLE;
+
     dat = (mul_rc_data_struct *) malloc(sizeof(mul_rc_data_struct));
     if (dat == NULL) {
         error = ERR_INSUFFICIENT_MEMORY;
@@ -744,6 +1036,11 @@ static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
         goto finished;
     }
 
+    if (matrix_mul_blocked(left->array->data, true, right->array->data, false,
+                           left->rows, right->columns, left->columns,
+                           completion) == ERR_INTERRUPTIBLE)
+        return ERR_INTERRUPTIBLE;
+
     dat = (mul_cr_data_struct *) malloc(sizeof(mul_cr_data_struct));
     if (dat == NULL) {
         error = ERR_INSUFFICIENT_MEMORY;
@@ -871,6 +1168,11 @@ static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *rig
         goto finished;
     }
 
+    if (matrix_mul_blocked(left->array->data, true, right->array->data, true,
+                           left->rows, right->columns, left->columns,
+                           completion) == ERR_INTERRUPTIBLE)
+        return ERR_INTERRUPTIBLE;
+
     dat = (mul_cc_data_struct *) malloc(sizeof(mul_cc_data_struct));
     if (dat == NULL) {
         error = ERR_INSUFFICIENT_MEMORY;
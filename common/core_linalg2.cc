@@ -16,12 +16,156 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+
+/* The decimal library keeps its rounding mode and exception flags in globals
+ * (DECIMAL_GLOBAL_EXCEPTION_FLAGS), which worker threads would race on, so
+ * only the binary build does its linear algebra in parallel.
+ */
+#if defined(LINALG_THREADS) && defined(BCD_MATH)
+#undef LINALG_THREADS
+#endif
+
+#ifdef LINALG_THREADS
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
 
 #include "core_linalg2.h"
 #include "core_globals.h"
 #include "core_main.h"
 
 
+/**************************/
+/***** Worker threads *****/
+/**************************/
+
+#ifdef LINALG_THREADS
+
+/* The pool is created on first use, and lives until the process exits; the
+ * threads are detached, and the pool itself is never deleted, so there is
+ * nothing to tear down at exit. The calling thread always takes the first
+ * slice of the work itself.
+ */
+struct linalg_pool_struct {
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    int threads;
+    unsigned int generation;
+    int busy;
+    void (*fn)(void *, int, int4, int4);
+    void *ctx;
+    int4 n;
+};
+
+static linalg_pool_struct *linalg_pool = NULL;
+static bool linalg_pool_failed = false;
+
+static void linalg_slice(int4 n, int threads, int t, int4 *from, int4 *to) {
+    *from = (int4) ((int8) n * t / threads);
+    *to = (int4) ((int8) n * (t + 1) / threads);
+}
+
+static void linalg_pool_thread(int t) {
+    linalg_pool_struct *pool = linalg_pool;
+    unsigned int gen = 0;
+    while (true) {
+        void (*fn)(void *, int, int4, int4);
+        void *ctx;
+        int4 n;
+        int threads;
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            while (pool->generation == gen)
+                pool->start.wait(lock);
+            gen = pool->generation;
+            fn = pool->fn;
+            ctx = pool->ctx;
+            n = pool->n;
+            threads = pool->threads;
+        }
+        int4 from, to;
+        linalg_slice(n, threads, t, &from, &to);
+        fn(ctx, t, from, to);
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if (--pool->busy == 0)
+                pool->done.notify_one();
+        }
+    }
+}
+
+int linalg_threads() {
+    if (linalg_pool != NULL)
+        return linalg_pool->threads;
+    if (linalg_pool_failed)
+        return 1;
+    int threads = (int) std::thread::hardware_concurrency();
+    if (threads > LINALG_MAX_THREADS)
+        threads = LINALG_MAX_THREADS;
+    if (threads < 2) {
+        linalg_pool_failed = true;
+        return 1;
+    }
+    linalg_pool = new (std::nothrow) linalg_pool_struct;
+    if (linalg_pool == NULL) {
+        linalg_pool_failed = true;
+        return 1;
+    }
+    linalg_pool->generation = 0;
+    linalg_pool->busy = 0;
+    int t;
+    for (t = 1; t < threads; t++) {
+        try {
+            std::thread(linalg_pool_thread, t).detach();
+        } catch (...) {
+            break;
+        }
+    }
+    linalg_pool->threads = t;
+    return t;
+}
+
+void linalg_parallel_for(int4 n, void (*fn)(void *ctx, int thread, int4 from, int4 to), void *ctx) {
+    int threads = linalg_threads();
+    if (threads < 2) {
+        fn(ctx, 0, 0, n);
+        return;
+    }
+    linalg_pool_struct *pool = linalg_pool;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->fn = fn;
+        pool->ctx = ctx;
+        pool->n = n;
+        pool->busy = threads - 1;
+        pool->generation++;
+    }
+    pool->start.notify_all();
+    int4 from, to;
+    linalg_slice(n, threads, 0, &from, &to);
+    fn(ctx, 0, from, to);
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    while (pool->busy != 0)
+        pool->done.wait(lock);
+}
+
+#else
+
+int linalg_threads() {
+    return 1;
+}
+
+void linalg_parallel_for(int4 n, void (*fn)(void *ctx, int thread, int4 from, int4 to), void *ctx) {
+    fn(ctx, 0, 0, n);
+}
+
+#endif
+
+
 #define STATE(s)             \
         if (--count <= 0) {  \
             dat->state = s;  \
@@ -35,29 +179,147 @@
 /***** LU decomposition *****/
 /****************************/
 
+/* LU factorization cache
+ * Programs often solve, invert, or take the determinant of the same matrix
+ * repeatedly, e.g. when solving A.X=B for many B, or when calling DET and
+ * then INVRT on the same matrix. The most recent factorizations are kept
+ * here, along with a copy of the matrix they were computed from. Matrices
+ * are modified in place in too many places to track reliably, so instead
+ * of a modification counter, a cached factorization is only reused if the
+ * matrix is still bit-for-bit identical to the saved copy; that comparison
+ * is O(n^2), which is negligible next to the O(n^3) decomposition.
+ * Factorizations where a zero pivot was replaced with a tiny number are
+ * only reused while the "singular matrix error" flag is off; with the flag
+ * on, those matrices must produce an error instead.
+ */
+
+#define LU_CACHE_SIZE 2
+#define LU_CACHE_MAX_ELEMENTS 250000
+
+struct lu_cache_entry {
+    bool complex;
+    bool fudged;
+    int4 n;
+    phloat *orig;
+    phloat *lu;
+    int4 *perm;
+    phloat det_re, det_im;
+};
+
+static lu_cache_entry lu_cache[LU_CACHE_SIZE];
+static int lu_cache_next = 0;
+
+static bool lu_cache_find(bool complex, phloat *a, int4 n, int4 *perm,
+                          phloat *det_re, phloat *det_im) {
+    int4 size = complex ? 2 * n * n : n * n;
+    for (int i = 0; i < LU_CACHE_SIZE; i++) {
+        lu_cache_entry *e = lu_cache + i;
+        if (e->orig == NULL || e->complex != complex || e->n != n)
+            continue;
+        if (e->fudged && core_settings.matrix_singularmatrix)
+            continue;
+        if (memcmp(e->orig, a, size * sizeof(phloat)) != 0)
+            continue;
+        for (int4 j = 0; j < size; j++)
+            a[j] = e->lu[j];
+        memcpy(perm, e->perm, n * sizeof(int4));
+        *det_re = e->det_re;
+        if (det_im != NULL)
+            *det_im = e->det_im;
+        return true;
+    }
+    return false;
+}
+
+/* Returns a copy of the matrix about to be decomposed, to be handed to
+ * lu_cache_store() once the decomposition finishes, or NULL if the matrix
+ * is too large to cache or memory is low. In that case, the decomposition
+ * simply proceeds without caching.
+ */
+static phloat *lu_cache_save(bool complex, phloat *a, int4 n) {
+    if (n * n > LU_CACHE_MAX_ELEMENTS)
+        return NULL;
+    int4 size = complex ? 2 * n * n : n * n;
+    phloat *orig = (phloat *) malloc(size * sizeof(phloat));
+    if (orig != NULL)
+        for (int4 i = 0; i < size; i++)
+            orig[i] = a[i];
+    return orig;
+}
+
+/* Takes ownership of 'orig' */
+static void lu_cache_store(bool complex, bool fudged, int4 n, phloat *orig,
+                           phloat *a, int4 *perm,
+                           phloat det_re, phloat det_im) {
+    if (orig == NULL)
+        return;
+    int4 size = complex ? 2 * n * n : n * n;
+    phloat *lu = (phloat *) malloc(size * sizeof(phloat));
+    int4 *p = (int4 *) malloc(n * sizeof(int4));
+    if (lu == NULL || p == NULL) {
+        free(orig);
+        free(lu);
+        free(p);
+        return;
+    }
+    for (int4 i = 0; i < size; i++)
+        lu[i] = a[i];
+    memcpy(p, perm, n * sizeof(int4));
+    lu_cache_entry *e = lu_cache + lu_cache_next;
+    lu_cache_next = (lu_cache_next + 1) % LU_CACHE_SIZE;
+    free(e->orig);
+    free(e->lu);
+    free(e->perm);
+    e->complex = complex;
+    e->fudged = fudged;
+    e->n = n;
+    e->orig = orig;
+    e->lu = lu;
+    e->perm = p;
+    e->det_re = det_re;
+    e->det_im = det_im;
+}
+
 struct lu_r_data_struct {
     vartype_realmatrix *a;
     int4 *perm;
     phloat det;
     int4 i, imax, j, k;
     phloat max, tmp, sum, *scale;
+    phloat *orig;
+    bool fudged;
     int state;
     int (*completion)(int, vartype_realmatrix *, int4 *, phloat);
 };
 
 lu_r_data_struct *lu_r_data;
 
+/* Matrices smaller than this are always decomposed and back-substituted by
+ * a single thread; below this size, the synchronization costs more than the
+ * threads can save.
+ */
+#define LU_PARALLEL_MIN 64
+
 static int lu_decomp_r_worker(bool interrupted);
+static int lu_decomp_r_parallel_worker(bool interrupted);
 
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
+    phloat det;
+    if (lu_cache_find(false, a->array->data, a->rows, perm, &det, NULL))
+        return completion(ERR_NONE, a, perm, det);
+
     lu_r_data_struct *dat =
                 (lu_r_data_struct *) malloc(sizeof(lu_r_data_struct));
 
     if (dat == NULL)
         return completion(ERR_INSUFFICIENT_MEMORY, a, perm, 0);
 
-    dat->scale = (phloat *) malloc(a->rows * sizeof(phloat));
+    /* The parallel version needs room to save one column, in addition to
+     * the row scale factors.
+     */
+    bool parallel = a->rows >= LU_PARALLEL_MIN && linalg_threads() > 1;
+    dat->scale = (phloat *) malloc((parallel ? 2 : 1) * a->rows * sizeof(phloat));
     if (dat->scale == NULL) {
         free(dat);
         return completion(ERR_INSUFFICIENT_MEMORY, a, perm, 0);
@@ -65,12 +327,15 @@ int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
 
     dat->a = a;
     dat->perm = perm;
+    dat->orig = lu_cache_save(false, a->array->data, a->rows);
+    dat->fudged = false;
     dat->completion = completion;
 
     dat->state = 0;
 
     lu_r_data = dat;
-    mode_interruptible = lu_decomp_r_worker;
+    mode_interruptible = parallel ? lu_decomp_r_parallel_worker
+                                  : lu_decomp_r_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
@@ -96,6 +361,7 @@ static int lu_decomp_r_worker(bool interrupted) {
 
     if (interrupted) {
         free(scale);
+        free(dat->orig);
         err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0);
         free(dat);
         return err;
@@ -170,6 +436,7 @@ static int lu_decomp_r_worker(bool interrupted) {
         if (a[j * n + j] == 0) {
             if (core_settings.matrix_singularmatrix) {
                 free(scale);
+                free(dat->orig);
                 err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0);
                 free(dat);
                 return err;
@@ -189,6 +456,7 @@ static int lu_decomp_r_worker(bool interrupted) {
                         tiny = tiniest;
                 }
                 a[j * n + j] = tiny;
+                dat->fudged = true;
             }
         }
         dat->det *= a[j * n + j];
@@ -202,6 +470,7 @@ static int lu_decomp_r_worker(bool interrupted) {
     }
 
     free(scale);
+    lu_cache_store(false, dat->fudged, n, dat->orig, a, perm, dat->det, 0);
     err = dat->completion(ERR_NONE, dat->a, perm, dat->det);
     free(dat);
     return err;
@@ -218,12 +487,187 @@ static int lu_decomp_r_worker(bool interrupted) {
 }
 
 
+/* Multithreaded LU decomposition
+ * This performs the same Crout decomposition as lu_decomp_r_worker(), one
+ * column per call, but the inner products for column j are accumulated one
+ * block of k at a time: first, the rows within the block, which depend on
+ * each other, are finished in order; then, the terms for that block are
+ * subtracted from all the rows below it, in parallel. Every element still
+ * has its terms subtracted in order of increasing k, so the results are the
+ * same as with the serial version.
+ */
+
+#define LU_PARALLEL_BLOCK 32
+
+struct lu_r_column_struct {
+    phloat *a;
+    phloat *scale;
+    int4 n, j, k0, k1;
+};
+
+static void lu_r_scale_worker(void *ctx, int thread, int4 from, int4 to) {
+    lu_r_column_struct *c = (lu_r_column_struct *) ctx;
+    phloat *a = c->a;
+    int4 n = c->n;
+    for (int4 i = from; i < to; i++) {
+        phloat max = 0;
+        for (int4 j = 0; j < n; j++) {
+            phloat tmp = a[i * n + j];
+            if (tmp < 0)
+                tmp = -tmp;
+            if (tmp > max)
+                max = tmp;
+        }
+        c->scale[i] = max;
+    }
+}
+
+static void lu_r_column_worker(void *ctx, int thread, int4 from, int4 to) {
+    lu_r_column_struct *c = (lu_r_column_struct *) ctx;
+    phloat *a = c->a;
+    int4 n = c->n;
+    int4 j = c->j;
+    for (int4 i = c->k1 + from; i < c->k1 + to; i++) {
+        phloat sum = a[i * n + j];
+        for (int4 k = c->k0; k < c->k1; k++)
+            sum -= a[i * n + k] * a[k * n + j];
+        a[i * n + j] = sum;
+    }
+}
+
+static int lu_decomp_r_parallel_worker(bool interrupted) {
+
+    lu_r_data_struct *dat = lu_r_data;
+
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    phloat *saved = scale + n;
+    int4 *perm = dat->perm;
+    int err;
+
+    int4 i, imax, j, k;
+    phloat max, tmp, sum;
+
+    if (interrupted) {
+        free(scale);
+        free(dat->orig);
+        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0);
+        free(dat);
+        return err;
+    }
+
+    lu_r_column_struct c;
+    c.a = a;
+    c.scale = scale;
+    c.n = n;
+
+    if (dat->state == 0) {
+        dat->det = 1;
+        linalg_parallel_for(n, lu_r_scale_worker, &c);
+        dat->j = 0;
+        dat->state = 1;
+        return ERR_INTERRUPTIBLE;
+    }
+
+    j = dat->j;
+    for (i = j; i < n; i++)
+        saved[i] = a[i * n + j];
+
+    c.j = j;
+    for (c.k0 = 0; c.k0 < j; c.k0 = c.k1) {
+        c.k1 = c.k0 + LU_PARALLEL_BLOCK;
+        if (c.k1 > j)
+            c.k1 = j;
+        for (i = c.k0 + 1; i < c.k1; i++) {
+            sum = a[i * n + j];
+            for (k = c.k0; k < i; k++)
+                sum -= a[i * n + k] * a[k * n + j];
+            a[i * n + j] = sum;
+        }
+        if (n - c.k1 < LU_PARALLEL_MIN)
+            lu_r_column_worker(&c, 0, 0, n - c.k1);
+        else
+            linalg_parallel_for(n - c.k1, lu_r_column_worker, &c);
+    }
+
+    max = 0;
+    imax = j;
+    for (i = j; i < n; i++) {
+        sum = a[i * n + j];
+        if (scale[i] == 0) {
+            imax = i;
+            // The serial version stops accumulating at this row, and
+            // leaves the rest of the column alone
+            for (k = i + 1; k < n; k++)
+                a[k * n + j] = saved[k];
+            break;
+        }
+        tmp = (sum < 0 ? -sum : sum) / scale[i];
+        if (tmp > max) {
+            imax = i;
+            max = tmp;
+        }
+    }
+
+    if (j != imax) {
+        for (k = 0; k < n; k++) {
+            tmp = a[imax * n + k];
+            a[imax * n + k] = a[j * n + k];
+            a[j * n + k] = tmp;
+        }
+        dat->det = -dat->det;
+        scale[imax] = scale[j];
+    }
+
+    perm[j] = imax;
+    if (a[j * n + j] == 0) {
+        if (core_settings.matrix_singularmatrix) {
+            free(scale);
+            free(dat->orig);
+            err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0);
+            free(dat);
+            return err;
+        } else {
+            /* Same substitute for a zero pivot as in the serial version */
+            phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+            phloat tiny;
+            if (scale[j] == 0)
+                tiny = tiniest;
+            else {
+                tiny = pow(10, floor(log10(scale[j])) - 20);
+                if (tiny < tiniest)
+                    tiny = tiniest;
+            }
+            a[j * n + j] = tiny;
+            dat->fudged = true;
+        }
+    }
+    dat->det *= a[j * n + j];
+    if (j != n - 1) {
+        tmp = 1 / a[j * n + j];
+        for (i = j + 1; i < n; i++)
+            a[i * n + j] *= tmp;
+    }
+
+    if (++dat->j < n)
+        return ERR_INTERRUPTIBLE;
+
+    free(scale);
+    lu_cache_store(false, dat->fudged, n, dat->orig, a, perm, dat->det, 0);
+    err = dat->completion(ERR_NONE, dat->a, perm, dat->det);
+    free(dat);
+    return err;
+}
+
 struct lu_c_data_struct {
     vartype_complexmatrix *a;
     int4 *perm;
     phloat det_re, det_im;
     int4 i, imax, j, k;
     phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, s_re, s_im, *scale;
+    phloat *orig;
+    bool fudged;
     int state;
     int (*completion)(int, vartype_complexmatrix *, int4 *, phloat, phloat);
 };
@@ -235,6 +679,10 @@ static int lu_decomp_c_worker(bool interrupted);
 int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_complexmatrix *,
                                           int4 *, phloat, phloat)) {
+    phloat det_re, det_im;
+    if (lu_cache_find(true, a->array->data, a->rows, perm, &det_re, &det_im))
+        return completion(ERR_NONE, a, perm, det_re, det_im);
+
     lu_c_data_struct *dat =
                 (lu_c_data_struct *) malloc(sizeof(lu_c_data_struct));
 
@@ -249,6 +697,8 @@ int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
 
     dat->a = a;
     dat->perm = perm;
+    dat->orig = lu_cache_save(true, a->array->data, a->rows);
+    dat->fudged = false;
     dat->completion = completion;
 
     dat->state = 0;
@@ -289,6 +739,7 @@ static int lu_decomp_c_worker(bool interrupted) {
 
     if (interrupted) {
         free(scale);
+        free(dat->orig);
         err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0, 0);
         free(dat);
         return err;
@@ -382,6 +833,7 @@ static int lu_decomp_c_worker(bool interrupted) {
         if (tmp_re == 0 && tmp_im == 0) {
             if (core_settings.matrix_singularmatrix) {
                 free(scale);
+                free(dat->orig);
                 err = dat->completion(ERR_NONE, dat->a, perm, 0, 0);
                 free(dat);
                 return err;
@@ -400,6 +852,7 @@ static int lu_decomp_c_worker(bool interrupted) {
                 }
                 a[2 * (j * n + j)] = tmp_re = tiny;
                 a[2 * (j * n + j) + 1] = tmp_im = 0;
+                dat->fudged = true;
             }
         }
         tmp = dat->det_re * tmp_re - dat->det_im * tmp_im;
@@ -420,6 +873,8 @@ static int lu_decomp_c_worker(bool interrupted) {
     }
 
     free(scale);
+    lu_cache_store(true, dat->fudged, n, dat->orig, a, perm,
+                   dat->det_re, dat->det_im);
     err = dat->completion(ERR_NONE, dat->a, perm, dat->det_re, dat->det_im);
     free(dat);
     return err;
@@ -458,6 +913,7 @@ struct backsub_rr_data_struct {
 static backsub_rr_data_struct *backsub_rr_data;
 
 static int lu_backsubst_rr_worker(bool interrupted);
+static int lu_backsubst_rr_parallel_worker(bool interrupted);
 
 int lu_backsubst_rr(vartype_realmatrix *a, int4 *perm, vartype_realmatrix *b,
                     int (*completion)(int, vartype_realmatrix *,
@@ -476,7 +932,11 @@ int lu_backsubst_rr(vartype_realmatrix *a, int4 *perm, vartype_realmatrix *b,
     dat->state = 0;
 
     backsub_rr_data = dat;
-    mode_interruptible = lu_backsubst_rr_worker;
+    if (a->rows >= LU_PARALLEL_MIN && b->columns > 1 && linalg_threads() > 1) {
+        dat->k = 0;
+        mode_interruptible = lu_backsubst_rr_parallel_worker;
+    } else
+        mode_interruptible = lu_backsubst_rr_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
@@ -559,6 +1019,96 @@ static int lu_backsubst_rr_worker(bool interrupted) {
     return ERR_INTERRUPTIBLE;
 }
 
+/* Multithreaded back-substitution
+ * The columns of b are independent, so each thread simply takes care of some
+ * of them, performing exactly the same steps as lu_backsubst_rr_worker().
+ * Each call does one column per thread.
+ */
+
+struct backsub_rr_columns_struct {
+    phloat *a;
+    phloat *b;
+    int4 *perm;
+    int4 n, q, k0;
+    bool overflow[LINALG_MAX_THREADS];
+};
+
+static void lu_backsubst_rr_column_worker(void *ctx, int thread, int4 from, int4 to) {
+    backsub_rr_columns_struct *c = (backsub_rr_columns_struct *) ctx;
+    phloat *a = c->a;
+    phloat *b = c->b;
+    int4 n = c->n;
+    int4 q = c->q;
+    int4 i, ii, j, ll, k;
+    phloat sum, t;
+
+    for (k = c->k0 + from; k < c->k0 + to; k++) {
+        ii = -1;
+        for (i = 0; i < n; i++) {
+            ll = c->perm[i];
+            sum = b[ll * q + k];
+            b[ll * q + k] = b[i * q + k];
+            if (ii != -1) {
+                for (j = ii; j < i; j++)
+                    sum -= a[i * n + j] * b[j * q + k];
+            } else if (sum != 0)
+                ii = i;
+            b[i * q + k] = sum;
+        }
+        for (i = n - 1; i >= 0; i--) {
+            sum = b[i * q + k];
+            for (j = i + 1; j < n; j++)
+                sum -= a[i * n + j] * b[j * q + k];
+            t = sum / a[i * n + i];
+            if (p_isinf(t) || p_isnan(t)) {
+                if (core_settings.matrix_outofrange
+                                        && !flags.f.range_error_ignore) {
+                    c->overflow[thread] = true;
+                    return;
+                } else
+                    t = p_isinf(t) < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+            }
+            b[i * q + k] = t;
+        }
+    }
+}
+
+static int lu_backsubst_rr_parallel_worker(bool interrupted) {
+    backsub_rr_data_struct *dat = backsub_rr_data;
+
+    if (interrupted) {
+        int err = dat->completion(ERR_INTERRUPTED, dat->a, dat->perm, dat->b);
+        free(dat);
+        return err;
+    }
+
+    int threads = linalg_threads();
+    backsub_rr_columns_struct c;
+    c.a = dat->a->array->data;
+    c.b = dat->b->array->data;
+    c.perm = dat->perm;
+    c.n = dat->a->rows;
+    c.q = dat->b->columns;
+    c.k0 = dat->k;
+    for (int t = 0; t < threads; t++)
+        c.overflow[t] = false;
+    int4 cols = c.q - c.k0;
+    if (cols > threads)
+        cols = threads;
+    linalg_parallel_for(cols, lu_backsubst_rr_column_worker, &c);
+    for (int t = 0; t < threads; t++)
+        if (c.overflow[t])
+            return ERR_OUT_OF_RANGE;
+
+    dat->k += cols;
+    if (dat->k < c.q)
+        return ERR_INTERRUPTIBLE;
+
+    int err = dat->completion(ERR_NONE, dat->a, dat->perm, dat->b);
+    free(dat);
+    return err;
+}
+
 struct backsub_rc_data_struct {
     vartype_realmatrix *a;
     int4 *perm;
@@ -46,4 +46,22 @@ int lu_backsubst_cc(vartype_complexmatrix *a,
                             int (*completion)(int, vartype_complexmatrix *,
                                 int4 *, vartype_complexmatrix *));
 
+/* Worker threads
+ * When built with LINALG_THREADS, large LU decompositions, back-substitutions
+ * and multiplications spread their work over multiple threads, one per core
+ * up to LINALG_MAX_THREADS. This is limited to the binary build, since the
+ * decimal library's exception flags are globals that the threads would share.
+ * The work is partitioned so that every element is still computed by exactly
+ * the same sequence of operations, so the results are identical to those of
+ * the single-threaded code.
+ * linalg_parallel_for() calls fn once for each thread, with thread indexes
+ * from 0 to linalg_threads() - 1, each one with a contiguous slice of the
+ * range [0, n), and returns when they have all finished. Without
+ * LINALG_THREADS, or with BCD_MATH, linalg_threads() returns 1, and
+ * linalg_parallel_for() just calls fn(ctx, 0, 0, n).
+ */
+#define LINALG_MAX_THREADS 16
+int linalg_threads();
+void linalg_parallel_for(int4 n, void (*fn)(void *ctx, int thread, int4 from, int4 to), void *ctx);
+
 #endif
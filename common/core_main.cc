@@ -32,6 +32,7 @@
 #include "core_equations.h"
 #include "core_helpers.h"
 #include "core_keydown.h"
+#include "core_linalg1.h"
 #include "core_math1.h"
 #include "core_sto_rcl.h"
 #include "core_tables.h"
@@ -45,6 +46,10 @@
 #include "bid_functions.h"
 #endif
 
+#ifndef WINDOWS
+#include <unistd.h>
+#endif
+
 #ifdef WINDOWS
 FILE *my_fopen(const char *name, const char *mode);
 int my_rename(const char *oldname, const char *newname);
@@ -131,6 +136,45 @@ static void handle_pending_equations() {
     }
 }
 
+/* The journal lives next to the state file; see journal_changes() */
+static char *journal_file_name(const char *state_file_name) {
+    char *name = (char *) malloc(strlen(state_file_name) + 5);
+    if (name != NULL) {
+        strcpy(name, state_file_name);
+        strcat(name, ".jrn");
+    }
+    return name;
+}
+
+static void remove_journal(const char *state_file_name) {
+    char *name = journal_file_name(state_file_name);
+    if (name != NULL) {
+        my_remove(name);
+        free(name);
+    }
+}
+
+static void load_journal(const char *state_file_name) {
+    char *buf = NULL;
+    size_t size = 0;
+    char *name = journal_file_name(state_file_name);
+    FILE *f = name == NULL ? NULL : my_fopen(name, "rb");
+    if (f != NULL) {
+        if (fseek(f, 0, SEEK_END) == 0) {
+            long len = ftell(f);
+            if (len > 0 && fseek(f, 0, SEEK_SET) == 0) {
+                buf = (char *) malloc(len);
+                if (buf != NULL && fread(buf, 1, len, f) == (size_t) len)
+                    size = len;
+            }
+        }
+        fclose(f);
+    }
+    free(name);
+    replay_journal(size == 0 ? NULL : buf, size);
+    free(buf);
+}
+
 void core_init(int *rows, int *cols, int read_saved_state, const char *state_file_name) {
 
     /* Possible values for read_saved_state:
@@ -173,7 +217,8 @@ void core_init(int *rows, int *cols, int read_saved_state, const char *state_fil
             display_alloc(requested_disp_r, requested_disp_c);
         hard_reset(reason);
         force_redisplay = true;
-    }
+    } else
+        load_journal(state_file_name);
     if (gfile != NULL)
         fclose(gfile);
     if (state_file_name_crash != NULL) {
@@ -215,14 +260,96 @@ void core_save_state(const char *state_file_name) {
     gfile = my_fopen(state_file_name_crash, "wb");
     if (gfile != NULL) {
         bool success = save_state();
+#ifndef WINDOWS
+        // Make sure the new state is on disk before it replaces the old one
+        if (success && fsync(fileno(gfile)) != 0)
+            success = false;
+#endif
         fclose(gfile);
         if (success) {
             my_remove(state_file_name);
             my_rename(state_file_name_crash, state_file_name);
+            remove_journal(state_file_name);
         }
     }
 }
 
+bool core_snapshot_state(char **buf, size_t *size) {
+    if (mode_interruptible != NULL)
+        stop_interruptible();
+    set_running(false);
+    return save_state_snapshot(buf, size);
+}
+
+bool core_write_state(const char *state_file_name, const char *buf, size_t size) {
+    size_t bufsize = strlen(state_file_name) + 24;
+    char *state_file_name_crash = (char *) malloc(bufsize);
+    if (state_file_name_crash == NULL)
+        return false;
+    uint4 date, time;
+    int weekday;
+    shell_get_time_date(&time, &date, &weekday);
+    snprintf(state_file_name_crash, bufsize, "%s.%08u%08u.crash", state_file_name, date, time);
+
+    bool success = false;
+    FILE *f = my_fopen(state_file_name_crash, "wb");
+    if (f != NULL) {
+        success = fwrite(buf, 1, size, f) == size && fflush(f) == 0;
+#ifndef WINDOWS
+        if (success && fsync(fileno(f)) != 0)
+            success = false;
+#endif
+        fclose(f);
+        if (success) {
+            my_remove(state_file_name);
+            my_rename(state_file_name_crash, state_file_name);
+            remove_journal(state_file_name);
+        } else
+            my_remove(state_file_name_crash);
+    }
+    free(state_file_name_crash);
+    return success;
+}
+
+bool core_journal_state(const char *state_file_name) {
+    if (mode_interruptible != NULL || mode_running)
+        // Nothing to do until the program stops
+        return true;
+
+    char header[12];
+    bool have_header = false;
+    FILE *f = my_fopen(state_file_name, "rb");
+    if (f != NULL) {
+        have_header = fread(header, 1, 12, f) == 12;
+        fclose(f);
+    }
+
+    char *buf;
+    size_t size, offset;
+    if (!journal_changes(have_header ? header : NULL, &buf, &size, &offset))
+        return false;
+    if (buf == NULL)
+        return true;
+
+    bool success = false;
+    char *name = journal_file_name(state_file_name);
+    f = name == NULL ? NULL : my_fopen(name, offset == 0 ? "wb" : "r+b");
+    if (f != NULL) {
+        success = fseek(f, offset, SEEK_SET) == 0
+                && fwrite(buf, 1, size, f) == size
+                && fflush(f) == 0;
+#ifndef WINDOWS
+        if (success && fsync(fileno(f)) != 0)
+            success = false;
+#endif
+        fclose(f);
+    }
+    free(name);
+    free(buf);
+    journal_written(success);
+    return success;
+}
+
 void core_cleanup() {
     reset_math();
     free_vartype(varmenu_eqn);
@@ -240,6 +367,7 @@ void core_cleanup() {
     lastx = NULL;
     clear_rtns_vars_and_prgms();
     clean_vartype_pools();
+    release_state_mapping();
 }
 
 void set_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
@@ -279,6 +407,10 @@ void core_repaint_display(int rows, int cols, int sflags) {
     force_redisplay = false;
 }
 
+void core_display_dropped() {
+    display_dropped();
+}
+
 bool core_menu() {
     return mode_clall || get_front_menu() != MENU_NONE || eqn_active();
 }
@@ -360,6 +492,9 @@ bool core_keydown_command(const char *name, bool is_text, bool *enqueued, int *r
 
 static bool core_keydown_2(int key, bool *enqueued, int *repeat) {
 
+    // Any keystroke may change the stack, flags, ALPHA, or the current
+    // program; see journal_changes()
+    journal_mark_globals();
     *enqueued = 0;
     *repeat = 0;
 
@@ -572,6 +707,7 @@ int dequeue_key() {
 }
 
 int core_repeat() {
+    journal_mark_globals();
     int r = eqn_repeat();
     if (r != -1)
         return r;
@@ -626,6 +762,7 @@ void core_keytimeout2() {
 }
 
 bool core_timeout3(bool repaint) {
+    journal_mark_globals();
     if (eqn_timeout())
         return false;
     if (mode_pause) {
@@ -680,6 +817,7 @@ static void print_equation_segment(int4 pc) {
 }
 
 bool core_keyup() {
+    journal_mark_globals();
     if (mode_pause) {
         /* The only way this can happen is if they key in question was Shift */
         return false;
@@ -868,6 +1006,7 @@ bool core_keyup() {
 
 bool core_powercycle() {
     bool need_redisplay = false;
+    journal_mark_globals();
 
     if (mode_interruptible != NULL)
         stop_interruptible();
@@ -1235,7 +1374,7 @@ static void export_hp42s(int index) {
                         const char *ptr = arg.val.xstr;
                         while (len > 0) {
                             if (buflen + 16 > 1000 - 50) {
-                                if (fwrite(buf, 1, buflen, gfile) != buflen)
+                                if (!write_bytes(buf, buflen))
                                     goto done;
                                 buflen = 0;
                             }
@@ -1349,7 +1488,7 @@ static void export_hp42s(int index) {
                 continue;
         }
         if (buflen + cmdlen > 1000 - 50) {
-            if (fwrite(buf, 1, buflen, gfile) != buflen)
+            if (!write_bytes(buf, buflen))
                 goto done;
             buflen = 0;
         }
@@ -1357,7 +1496,7 @@ static void export_hp42s(int index) {
             buf[buflen++] = cmdbuf[i];
     } while (cmd != CMD_END && pc < cwd->prgms[index].size);
     if (buflen > 0)
-        fwrite(buf, 1, buflen, gfile);
+        write_bytes(buf, buflen);
     done:
     current_prgm = saved_prgm;
 }
@@ -2514,6 +2653,7 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
     arg_struct arg;
     bool pending_end;
     int eq_mode = 0;
+    journal_mark_globals();
 
     if (raw_file_name != NULL) {
 #ifdef IPHONE
@@ -2567,7 +2707,7 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
 
     while (!done_flag) {
         skip:
-        byte1 = fgetc(gfile);
+        byte1 = read_byte();
         if (byte1 == EOF)
             goto done;
         cmd = hp42tofree42[byte1];
@@ -2581,7 +2721,7 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
             if (cmd == CMD_LBL)
                 arg.val.num--;
         } else if (flag == 2) {
-            suffix = fgetc(gfile);
+            suffix = read_byte();
             if (suffix == EOF)
                 goto done;
             decode_suffix(cmd, suffix, &arg);
@@ -2602,30 +2742,30 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                     else
                         byte1 += '0' - 0x10;
                     numbuf[numlen++] = byte1;
-                    byte1 = fgetc(gfile);
+                    byte1 = read_byte();
                 } while (byte1 >= 0x10 && byte1 <= 0x1c);
                 if (byte1 == EOF)
                     done_flag = 1;
                 else if (byte1 != 0x00)
-                    ungetc(byte1, gfile);
+                    unread_byte(byte1);
                 numbuf[numlen++] = 0;
                 parse_number_line(numbuf, &arg.val_d);
                 cmd = CMD_NUMBER;
                 arg.type = ARGTYPE_DOUBLE;
             } else if (byte1 == 0x1d || byte1 == 0x1e) {
                 cmd = byte1 == 0x1d ? CMD_GTO : CMD_XEQ;
-                str_len = fgetc(gfile);
+                str_len = read_byte();
                 if (str_len == EOF)
                     goto done;
                 else if (str_len < 0xf1) {
-                    ungetc(str_len, gfile);
+                    unread_byte(str_len);
                     goto skip;
                 } else
                     str_len -= 0xf0;
                 arg.type = ARGTYPE_STR;
                 do_string:
                 for (int i = 0; i < str_len; i++) {
-                    suffix = fgetc(gfile);
+                    suffix = read_byte();
                     if (suffix == EOF)
                         goto done;
                     arg.val.text[i] = suffix;
@@ -2638,13 +2778,13 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                 goto skip;
             } else if (byte1 >= 0xa0 && byte1 <= 0xa7) {
                 /* XROM mm,nn */
-                byte2 = fgetc(gfile);
+                byte2 = read_byte();
                 if (byte2 == EOF)
                     goto done;
                 decode_xrom(byte1, byte2, &cmd, &arg);
             } else if (byte1 == 0xae) {
                 /* GTO/XEQ IND */
-                suffix = fgetc(gfile);
+                suffix = read_byte();
                 if (suffix == EOF)
                     goto done;
                 if ((suffix & 0x80) != 0)
@@ -2659,7 +2799,7 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                 goto skip;
             } else if (byte1 >= 0xb1 && byte1 <= 0xbf) {
                 /* 2-byte GTO */
-                byte2 = fgetc(gfile);
+                byte2 = read_byte();
                 if (byte2 == EOF)
                     goto done;
                 cmd = CMD_GTO;
@@ -2667,10 +2807,10 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                 arg.val.num = (byte1 & 15) - 1;
             } else if (byte1 >= 0xc0 && byte1 <= 0xcd) {
                 /* GLOBAL */
-                byte2 = fgetc(gfile);
+                byte2 = read_byte();
                 if (byte2 == EOF)
                     goto done;
-                str_len = fgetc(gfile);
+                str_len = read_byte();
                 if (str_len == EOF)
                     goto done;
                 if (str_len < 0xf1) {
@@ -2680,7 +2820,7 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                 } else {
                     /* LBL "" */
                     str_len -= 0xf1;
-                    byte2 = fgetc(gfile);
+                    byte2 = read_byte();
                     if (byte2 == EOF)
                         goto done;
                     cmd = CMD_LBL;
@@ -2689,10 +2829,10 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                 }
             } else if (byte1 >= 0xd0 && byte1 <= 0xef) {
                 /* 3-byte GTO & XEQ */
-                byte2 = fgetc(gfile);
+                byte2 = read_byte();
                 if (byte2 == EOF)
                     goto done;
-                suffix = fgetc(gfile);
+                suffix = read_byte();
                 if (suffix == EOF)
                     goto done;
                 cmd = byte1 <= 0xdf ? CMD_GTO : CMD_XEQ;
@@ -2704,7 +2844,7 @@ void core_import_programs(int num_progs, const char *raw_file_name) {
                 buf[0] = byte1;
                 str_len = byte1 - 0xf0;
                 for (int i = 0; i < str_len; i++) {
-                    int c = fgetc(gfile);
+                    int c = read_byte();
                     if (c == EOF)
                         goto done;
                     buf[i + 1] = c;
@@ -4963,6 +5103,7 @@ static vartype *deserialize_list(const char *buf, int *pos) {
 }
 
 void core_paste(const char *buf) {
+    journal_mark_globals();
     if (eqn_active()) {
         eqn_paste(buf);
         return;
@@ -5313,6 +5454,14 @@ void core_paste(const char *buf) {
     redisplay();
 }
 
+int core_calibrate_matrix_block_size() {
+    return linalg_calibrate_block_size();
+}
+
+void core_set_slice_duration(int ms) {
+    slice_duration = ms < 1 ? 1 : ms;
+}
+
 #if defined(ANDROID) || defined(IPHONE)
 
 void core_get_char_pixels(const char *ch, char *pixels) {
@@ -5331,12 +5480,19 @@ void set_alpha_entry(bool state) {
     mode_alpha_entry = state;
 }
 
+/* When the running program was last checkpointed, or started; see checkpoint() */
+static uint4 last_checkpoint;
+
 void set_running(bool state) {
     if (mode_running != state) {
         mode_running = state;
         set_annunciators(-1, -1, -1, state, -1, -1);
+        if (state)
+            last_checkpoint = shell_milliseconds();
     }
     if (state) {
+        /* Until the program returns from its top level or fails */
+        mode_stop_reason = ERR_STOP;
         /* Cancel any pending INPUT command */
         input_length = 0;
         mode_goose = -2;
@@ -5449,8 +5605,71 @@ void do_interactive(int command) {
     }
 }
 
+#define MIN_SLICE_BUDGET 1
+#define MAX_SLICE_BUDGET 65536
+#define MAX_SLICE_GROWTH 2
+
+static uint4 slice_start;
+static int4 slice_left;
+
+/* Captures the state of a running program and hands it to the shell, which
+ * writes it in the background. This happens between instructions, so the
+ * state is consistent; when it is loaded, core_powercycle() stops the
+ * program, and R/S resumes it where the checkpoint was taken.
+ */
+static void checkpoint() {
+    uint4 start = shell_milliseconds();
+    char *buf;
+    size_t size;
+    if (save_state_snapshot(&buf, &size))
+        shell_checkpoint(buf, size, shell_milliseconds() - start);
+    last_checkpoint = shell_milliseconds();
+}
+
+static void start_slice(uint4 now) {
+    slice_start = now;
+    slice_left = slice_budget;
+}
+
+/* Called when a slice has used up its instruction budget; this is the only
+ * place where the run loop reads the clock. The budget for the next slice
+ * is scaled by slice_duration / elapsed, so that it takes about
+ * slice_duration. It shrinks as fast as it needs to, but grows by no more
+ * than MAX_SLICE_GROWTH per slice, and never beyond MAX_SLICE_BUDGET, so a
+ * program that switches from a fast loop to slow instructions still gets
+ * interrupted reasonably soon. Then a checkpoint is taken if one is due, and
+ * the shell gets to decide whether to continue.
+ */
+static bool end_of_slice() {
+    uint4 now = shell_milliseconds();
+    uint4 elapsed = now - slice_start;
+    uint8 budget;
+    if (elapsed == 0)
+        budget = (uint8) slice_budget * MAX_SLICE_GROWTH;
+    else {
+        budget = (uint8) slice_budget * slice_duration / elapsed;
+        if (budget > (uint8) slice_budget * MAX_SLICE_GROWTH)
+            budget = (uint8) slice_budget * MAX_SLICE_GROWTH;
+    }
+    if (budget < MIN_SLICE_BUDGET)
+        budget = MIN_SLICE_BUDGET;
+    else if (budget > MAX_SLICE_BUDGET)
+        budget = MAX_SLICE_BUDGET;
+    slice_budget = (int4) budget;
+
+    if (core_settings.checkpoint_interval > 0
+            && now - last_checkpoint >= (uint4) core_settings.checkpoint_interval * 1000) {
+        checkpoint();
+        now = shell_milliseconds();
+    }
+    start_slice(now);
+    slice_polls++;
+    return shell_wants_cpu();
+}
+
 static void continue_running() {
     int error;
+    start_slice(shell_milliseconds());
     do {
         int cmd;
         arg_struct arg;
@@ -5462,7 +5681,8 @@ static void continue_running() {
             set_running(false);
             return;
         }
-        get_next_command(&pc, &cmd, &arg, 1, NULL);
+        fetch_next_command(&pc, &cmd, &arg);
+        instructions_executed++;
         if (flags.f.trace_print && flags.f.printer_exists) {
             if (cmd == CMD_LBL)
                 print_text(NULL, 0, true);
@@ -5470,7 +5690,13 @@ static void continue_running() {
             print_program_line(current_prgm, oldpc);
         }
         mode_disable_stack_lift = false;
-        error = handle(cmd, &arg);
+        if (profiling) {
+            pgm_index prgm = current_prgm;
+            uint8 start = profile_clock();
+            error = handle(cmd, &arg);
+            profile_record(prgm, oldpc == -1 ? 0 : oldpc, cmd, start);
+        } else
+            error = handle(cmd, &arg);
         if (mode_pause) {
             shell_request_timeout3(1000);
             return;
@@ -5481,7 +5707,7 @@ static void continue_running() {
             return;
         if (mode_getkey)
             return;
-    } while (!shell_wants_cpu());
+    } while (--slice_left > 0 || !end_of_slice());
 }
 
 struct synonym_spec {
@@ -5988,6 +6214,7 @@ static bool handle_error(int error) {
             }
             handle_it:
             pc = oldpc;
+            mode_stop_reason = error;
             display_error(error);
             if (current_prgm.dir == eq_dir->id) {
                 equation_data *eqd = eq_dir->prgms[current_prgm.idx].eq_data;
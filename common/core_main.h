@@ -50,6 +50,40 @@ void core_init(int *rows, int *cols, int read_state, const char *state_file_name
  */
 void core_save_state(const char *state_file_name);
 
+/* core_snapshot_state()
+ * core_write_state()
+ *
+ * These split core_save_state() into two parts, so that desktop apps can
+ * write state files without blocking the UI. core_snapshot_state() does the
+ * part that needs the core: it stops any running program, just like
+ * core_save_state(), and then serializes the state into a buffer in memory.
+ * It returns false if there isn't enough memory for that; otherwise, *buf
+ * is a malloc()ed buffer, which the caller must free().
+ * core_write_state() writes such a buffer to the given file, replacing it
+ * only after the new contents have been written completely. It doesn't use
+ * any core state, so it can be called from any thread, including while the
+ * core is running, or has been cleaned up and initialized with a different
+ * state. Shells that do this must make sure the write has finished before
+ * they exit, and before they read the same file using core_init().
+ */
+bool core_snapshot_state(char **buf, size_t *size);
+bool core_write_state(const char *state_file_name, const char *buf, size_t size);
+
+/* core_journal_state()
+ *
+ * A cheap alternative to a full save, meant to be called periodically. It
+ * appends whatever has changed since the last full save, or since the last
+ * call, to a journal next to the state file, and core_init() replays that
+ * journal after reading the state file. core_save_state() and
+ * core_write_state() remove the journal, since it is no longer needed once
+ * the state file itself is up to date.
+ * If a program is running, this does nothing, and returns true. It returns
+ * false when the changes can't be journaled, for example because the journal
+ * has grown too large, or because no full save has been done yet; the shell
+ * should do a full save then.
+ */
+bool core_journal_state(const char *state_file_name);
+
 /* core_cleanup()
  *
  * This function deletes the emulator core state from memory. It may be called
@@ -74,6 +108,16 @@ void core_cleanup();
  */
 void core_repaint_display(int rows, int cols, int flags);
 
+/* core_display_dropped()
+ *
+ * The shell calls this from within shell_blitter() when it has to discard
+ * the update it was just given, for example because it couldn't allocate
+ * memory to hold it. The core will then repaint the entire display the next
+ * time it updates it, instead of sending only the rows that have changed
+ * since the update that was lost.
+ */
+void core_display_dropped();
+
 /* core_menu()
  *
  * The shell uses this function to check if a menu is active. This affects
@@ -323,6 +367,25 @@ char *core_copy();
  */
 void core_paste(const char *s);
 
+/* core_calibrate_matrix_block_size()
+ *
+ * Times matrix multiplications using a range of block sizes, and returns the
+ * one that was fastest on this machine, or 0 if blocking didn't help. The
+ * shell can offer this in its "Preferences" dialog box, to help the user pick
+ * a value for core_settings.matrix_block_size. This takes a few seconds.
+ */
+int core_calibrate_matrix_block_size();
+
+/* core_set_slice_duration()
+ *
+ * Sets how long, in milliseconds, the core should keep running a program
+ * before checking shell_wants_cpu(). The core counts instructions, reads the
+ * clock only at the end of each slice, and adapts the number of instructions
+ * per slice to the speed of the program, so this is an approximation. The
+ * default is 10 ms.
+ */
+void core_set_slice_duration(int ms);
+
 #if defined(ANDROID) || defined(IPHONE)
 
 /* core_get_char_pixels()
@@ -339,12 +402,16 @@ void core_get_char_pixels(const char *ch, char *pixels);
  * This is a struct that stores user-configurable core settings. The shell
  * should provide the appropriate controls in a "Preferences" dialog box to
  * allow the user to view and change these settings.
+ * checkpoint_interval is in seconds, with 0 meaning no checkpoints; see
+ * shell_checkpoint().
  */
 struct core_settings_struct {
     bool matrix_singularmatrix;
     bool matrix_outofrange;
     bool auto_repeat;
     bool localized_copy_paste;
+    int matrix_block_size;
+    int checkpoint_interval;
 };
 
 extern core_settings_struct core_settings;
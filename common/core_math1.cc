@@ -150,17 +150,19 @@ static integ_state integ;
 static void reset_solve();
 static void reset_integ();
 
+static native_eqn solve_native, integ_native;
+
 
 bool persist_math() {
     if (!write_int(solve.version)) return false;
     if (!persist_vartype(solve.eq)) return false;
-    if (fwrite(solve.prgm_name, 1, 7, gfile) != 7) return false;
+    if (!write_bytes(solve.prgm_name, 7)) return false;
     if (!write_int(solve.prgm_length)) return false;
     if (!persist_vartype(solve.active_eq)) return false;
-    if (fwrite(solve.active_prgm_name, 1, 7, gfile) != 7) return false;
+    if (!write_bytes(solve.active_prgm_name, 7)) return false;
     if (!write_int(solve.active_prgm_length)) return false;
     if (!persist_vartype(solve.saved_t)) return false;
-    if (fwrite(solve.var_name, 1, 7, gfile) != 7) return false;
+    if (!write_bytes(solve.var_name, 7)) return false;
     if (!write_int(solve.var_length)) return false;
     if (!write_int(solve.caller.keep_running)) return false;
     if (solve_active()) {
@@ -193,7 +195,7 @@ bool persist_math() {
     if (!write_phloat(solve.second_f)) return false;
     if (!write_phloat(solve.second_x)) return false;
     for (int i = 0; i < NUM_SHADOWS; i++) {
-        if (fwrite(solve.shadow_name[i], 1, 7, gfile) != 7) return false;
+        if (!write_bytes(solve.shadow_name[i], 7)) return false;
         if (!write_int(solve.shadow_length[i])) return false;
         if (!persist_vartype(solve.shadow_value[i])) return false;
     }
@@ -203,13 +205,13 @@ bool persist_math() {
 
     if (!write_int(integ.version)) return false;
     if (!persist_vartype(integ.eq)) return false;
-    if (fwrite(integ.prgm_name, 1, 7, gfile) != 7) return false;
+    if (!write_bytes(integ.prgm_name, 7)) return false;
     if (!write_int(integ.prgm_length)) return false;
     if (!persist_vartype(integ.active_eq)) return false;
-    if (fwrite(integ.active_prgm_name, 1, 7, gfile) != 7) return false;
+    if (!write_bytes(integ.active_prgm_name, 7)) return false;
     if (!write_int(integ.active_prgm_length)) return false;
     if (!persist_vartype(integ.saved_t)) return false;
-    if (fwrite(integ.var_name, 1, 7, gfile) != 7) return false;
+    if (!write_bytes(integ.var_name, 7)) return false;
     if (!write_int(integ.var_length)) return false;
     if (!write_int(integ.caller.keep_running)) return false;
     if (integ_active()) {
@@ -253,13 +255,13 @@ bool persist_math() {
 bool unpersist_math(int ver) {
     if (!read_int(&solve.version)) return false;
     if (!unpersist_vartype(&solve.eq)) return false;
-    if (fread(solve.prgm_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(solve.prgm_name, 7)) return false;
     if (!read_int(&solve.prgm_length)) return false;
     if (!unpersist_vartype(&solve.active_eq)) return false;
-    if (fread(solve.active_prgm_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(solve.active_prgm_name, 7)) return false;
     if (!read_int(&solve.active_prgm_length)) return false;
     if (!unpersist_vartype(&solve.saved_t)) return false;
-    if (fread(solve.var_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(solve.var_name, 7)) return false;
     if (!read_int(&solve.var_length)) return false;
     if (!read_int(&solve.caller.keep_running)) return false;
     int4 dir, idx;
@@ -298,7 +300,7 @@ bool unpersist_math(int ver) {
     if (!read_phloat(&solve.second_f)) return false;
     if (!read_phloat(&solve.second_x)) return false;
     for (int i = 0; i < NUM_SHADOWS; i++) {
-        if (fread(solve.shadow_name[i], 1, 7, gfile) != 7) return false;
+        if (!read_bytes(solve.shadow_name[i], 7)) return false;
         if (!read_int(&solve.shadow_length[i])) return false;
         if (ver < 8) {
             phloat x;
@@ -322,13 +324,13 @@ bool unpersist_math(int ver) {
 
     if (!read_int(&integ.version)) return false;
     if (!unpersist_vartype(&integ.eq)) return false;
-    if (fread(integ.prgm_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(integ.prgm_name, 7)) return false;
     if (!read_int(&integ.prgm_length)) return false;
     if (!unpersist_vartype(&integ.active_eq)) return false;
-    if (fread(integ.active_prgm_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(integ.active_prgm_name, 7)) return false;
     if (!read_int(&integ.active_prgm_length)) return false;
     if (!unpersist_vartype(&integ.saved_t)) return false;
-    if (fread(integ.var_name, 1, 7, gfile) != 7) return false;
+    if (!read_bytes(integ.var_name, 7)) return false;
     if (!read_int(&integ.var_length)) return false;
     if (!read_int(&integ.caller.keep_running)) return false;
     if (ver < 9) {
@@ -417,6 +419,7 @@ static void reset_solve() {
     free_vartype(solve.active_eq);
     solve.active_eq = NULL;
     solve.active_prgm_length = 0;
+    solve_native.reset();
     free_vartype(solve.saved_t);
     solve.saved_t = NULL;
     solve.state = 0;
@@ -520,8 +523,10 @@ static int call_solve_fn(int which, int state) {
                 free_vartype(v);
                 return err;
             }
-        } else
+        } else {
             ((vartype_real *) v)->x = x;
+            journal_touch(v);
+        }
     } else {
         vartype_unit *u = (vartype_unit *) solve.param_unit;
         v = new_unit(x, u->text, u->length);
@@ -549,6 +554,8 @@ static int call_solve_fn(int which, int state) {
         vartype_equation *eq = (vartype_equation *) solve.active_eq;
         current_prgm.set(eq_dir->id, eq->data->eqn_index);
         pc = 0;
+        if (solve.var_length != 0 && solve.param_unit == NULL)
+            solve_native.call(solve.active_eq, solve.var_name, solve.var_length, x);
     }
     if (solve.var_length == 0) {
         err = recall_result(v);
@@ -683,6 +690,7 @@ static int start_solve_2(vartype *v1, vartype *v2, bool after_direct) {
         free_vartype(solve.active_eq);
         solve.active_eq = NULL;
     }
+    solve_native.reset();
 
     if (x1 == x2) {
         if (x1 == 0) {
@@ -1406,6 +1414,7 @@ static void reset_integ() {
     free_vartype(integ.active_eq);
     integ.active_eq = NULL;
     integ.active_prgm_length = 0;
+    integ_native.reset();
     free_vartype(integ.saved_t);
     integ.saved_t = NULL;
     integ.state = 0;
@@ -1471,8 +1480,10 @@ static int call_integ_fn() {
                 free_vartype(v);
                 return err;
             }
-        } else
+        } else {
             ((vartype_real *) v)->x = x;
+            journal_touch(v);
+        }
     } else {
         vartype_unit *u = (vartype_unit *) integ.param_unit;
         v = new_unit(x, u->text, u->length);
@@ -1514,6 +1525,8 @@ static int call_integ_fn() {
         vartype_equation *eq = (vartype_equation *) integ.active_eq;
         current_prgm.set(eq_dir->id, eq->data->eqn_index);
         pc = 0;
+        if (integ.var_length != 0 && integ.param_unit == NULL)
+            integ_native.call(integ.active_eq, integ.var_name, integ.var_length, x);
     }
     if (integ.var_length == 0) {
         err = recall_result(v);
@@ -1601,6 +1614,7 @@ int start_integ(int prev, const char *name, int length, vartype *solve_info) {
         free_vartype(integ.active_eq);
         integ.active_eq = NULL;
     }
+    integ_native.reset();
     integ.caller.set(prev);
     integ.prev_sp = flags.f.big_stack ? sp : -2;
 
@@ -21,10 +21,13 @@
 #include <math.h>
 #include <float.h>
 #include <limits.h>
+#include <set>
 #include <sstream>
 
+#include "core_commands6.h"
 #include "core_helpers.h"
 #include "core_parser.h"
+#include "core_sto_rcl.h"
 #include "core_tables.h"
 #include "core_variables.h"
 
@@ -230,6 +233,173 @@ class GeneratorContext {
         addLine(pos, CMD_XEQL, assertTwoRealsLbl);
     }
 
+    private:
+
+    /* Peephole optimizer. This works on the complete line list, after the
+     * subroutines have been appended, but before labels are resolved. Since
+     * the CodeMap is only built when the lines are stored, it automatically
+     * matches the optimized code; a folded constant takes the position of
+     * the operator it replaces.
+     * Lines following a conditional get skipped, and so do lines following
+     * an XEQ of a subroutine that ends in RTNNO, so we only touch sequences
+     * whose preceding line is known to always fall through.
+     */
+
+    static bool fallsThrough(int cmd) {
+        switch (cmd) {
+            case CMD_FSTART:
+            case CMD_NUMBER:
+            case CMD_RCL:
+            case CMD_LSTO:
+            case CMD_STO:
+            case CMD_STO_ADD:
+            case CMD_DROP:
+            case CMD_DROPN:
+            case CMD_SWAP:
+            case CMD_RDNN:
+            case CMD_RUPN:
+            case CMD_ADD:
+            case CMD_SUB:
+            case CMD_MUL:
+            case CMD_DIV:
+            case CMD_CHS:
+            case CMD_Y_POW_X:
+            case CMD_SQUARE:
+            case CMD_SQRT:
+            case CMD_INV:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool canOptimizeAt(int i) {
+        return i > 0 && fallsThrough((*lines)[i - 1]->cmd);
+    }
+
+    static bool sameNum(Line *a, Line *b) {
+        return a->arg.type == ARGTYPE_NUM && b->arg.type == ARGTYPE_NUM
+                && a->arg.val.num == b->arg.val.num;
+    }
+
+    static bool sameName(Line *a, Line *b) {
+        return a->arg.type == ARGTYPE_STR && b->arg.type == ARGTYPE_STR
+                && string_equals(a->arg.val.text, a->arg.length, b->arg.val.text, b->arg.length);
+    }
+
+    void removeLines(int i, int n) {
+        for (int j = i; j < i + n; j++)
+            delete (*lines)[j];
+        lines->erase(lines->begin() + i, lines->begin() + i + n);
+    }
+
+    /* Folding replaces a binary operation with its result, so LASTX would
+     * be left holding a different value. That's only visible if the code
+     * reads LASTX, or if it can run other code, or stop.
+     */
+    bool lastxVisible() {
+        for (int i = 0; i < lines->size(); i++)
+            switch ((*lines)[i]->cmd) {
+                case CMD_LASTX:
+                case CMD_XEQ:
+                case CMD_EVALN:
+                case CMD_INTEG:
+                case CMD_EQNINT:
+                case CMD_STOP:
+                    return true;
+            }
+        return false;
+    }
+
+    static bool fold(int cmd, phloat x, phloat y, phloat *r) {
+        // Only fold if the run-time operation couldn't possibly fail
+        switch (cmd) {
+            case CMD_ADD: *r = y + x; break;
+            case CMD_SUB: *r = y - x; break;
+            case CMD_MUL: *r = y * x; break;
+            case CMD_DIV:
+                if (x == 0)
+                    return false;
+                *r = y / x;
+                break;
+            default:
+                return false;
+        }
+        return p_isinf(*r) == 0 && !p_isnan(*r);
+    }
+
+    void removeDeadLabels() {
+        std::set<int> used;
+        for (int i = 0; i < lines->size(); i++) {
+            Line *line = (*lines)[i];
+            if (line->cmd == CMD_GTOL || line->cmd == CMD_XEQL)
+                used.insert(line->arg.val.num);
+        }
+        for (int i = 0; i < lines->size(); i++) {
+            Line *line = (*lines)[i];
+            if (line->cmd == CMD_LBL && used.find(line->arg.val.num) == used.end())
+                removeLines(i--, 1);
+        }
+    }
+
+    void optimize() {
+        removeDeadLabels();
+        bool mayFold = !lastxVisible();
+        int i = 1;
+        while (i < lines->size()) {
+            if (!canOptimizeAt(i)) {
+                i++;
+                continue;
+            }
+            Line *a = (*lines)[i];
+            Line *b = i + 1 < lines->size() ? (*lines)[i + 1] : NULL;
+            Line *c = i + 2 < lines->size() ? (*lines)[i + 2] : NULL;
+            phloat r;
+            if (mayFold && c != NULL && a->cmd == CMD_NUMBER && b->cmd == CMD_NUMBER
+                    && fold(c->cmd, b->arg.val_d, a->arg.val_d, &r)) {
+                // a b op => (a op b)
+                int pos = c->pos;
+                removeLines(i, 3);
+                lines->insert(lines->begin() + i, new Line(pos, r));
+            } else if (b != NULL && (a->cmd == CMD_RDNN && b->cmd == CMD_RUPN
+                                  || a->cmd == CMD_RUPN && b->cmd == CMD_RDNN)
+                    && sameNum(a, b)) {
+                // Rotations that cancel out
+                removeLines(i, 2);
+            } else if (b != NULL && a->cmd == CMD_SWAP && b->cmd == CMD_SWAP) {
+                removeLines(i, 2);
+            } else if (b != NULL && a->cmd == CMD_NUMBER && b->cmd == CMD_DROP) {
+                removeLines(i, 2);
+            } else if (c != NULL && a->cmd == CMD_LSTO && b->cmd == CMD_DROP
+                    && c->cmd == CMD_RCL && sameName(a, c)) {
+                // LSTO leaves the value in X; no need to drop and recall it
+                removeLines(i + 1, 2);
+            } else if (b != NULL && a->cmd == CMD_GTOL && b->cmd == CMD_LBL
+                    && a->arg.val.num == b->arg.val.num) {
+                // Jump to the next line
+                removeLines(i, 1);
+                removeDeadLabels();
+            } else if (b != NULL && (a->cmd == CMD_GTOL || a->cmd == CMD_RTN)
+                    && b->cmd != CMD_LBL) {
+                // Unreachable until the next label
+                int n = 1;
+                while (i + 1 + n < lines->size() && (*lines)[i + 1 + n]->cmd != CMD_LBL)
+                    n++;
+                removeLines(i + 1, n);
+                removeDeadLabels();
+            } else {
+                i++;
+                continue;
+            }
+            // Back up, in case the change created a new match
+            i -= 2;
+            if (i < 1)
+                i = 1;
+        }
+    }
+
+    public:
+
     void store(prgm_struct *prgm, CodeMap *map) {
         prgm->lclbl_invalid = false;
         // Tack all the subroutines onto the main code
@@ -240,6 +410,7 @@ class GeneratorContext {
             delete l;
         }
         queue.clear();
+        optimize();
         // First, resolve labels
         std::map<int, int> label2line;
         int lineno = 1;
@@ -309,6 +480,222 @@ class GeneratorContext {
     }
 };
 
+////////////////////////
+/////  NativeCode  /////
+////////////////////////
+
+#define NATIVE_NUMBER 0
+#define NATIVE_VAR 1
+#define NATIVE_X 2
+#define NATIVE_CHS 3
+#define NATIVE_POW 4
+#define NATIVE_UNARY 5
+#define NATIVE_BINARY 6
+
+#define NATIVE_MAX_DEPTH 32
+
+struct NativeOp {
+    int code;
+    int slot;
+    bool swap;
+    phloat value;
+    mappable_r unary;
+    mappable_rr binary;
+    NativeOp(int code) : code(code), slot(-1), swap(false), value(0), unary(NULL), binary(NULL) {}
+};
+
+class NativeCode {
+
+    private:
+
+    std::vector<NativeOp> ops;
+    std::vector<std::string> names;
+    std::vector<phloat> values;
+    int depth;
+    int maxDepth;
+
+    void push() {
+        if (++depth > maxDepth)
+            maxDepth = depth;
+    }
+
+    public:
+
+    NativeCode() : depth(0), maxDepth(0) {}
+
+    bool complete() {
+        return depth == 1 && maxDepth <= NATIVE_MAX_DEPTH;
+    }
+
+    void addNumber(phloat d) {
+        NativeOp op(NATIVE_NUMBER);
+        op.value = d;
+        ops.push_back(op);
+        push();
+    }
+
+    void addVariable(const std::string &name) {
+        // Same truncation as RCL in the generated code
+        std::string n = name.length() > 7 ? name.substr(0, 7) : name;
+        NativeOp op(NATIVE_VAR);
+        for (op.slot = 0; op.slot < names.size(); op.slot++)
+            if (names[op.slot] == n)
+                break;
+        if (op.slot == names.size())
+            names.push_back(n);
+        ops.push_back(op);
+        push();
+    }
+
+    void addChs() {
+        ops.push_back(NativeOp(NATIVE_CHS));
+    }
+
+    bool addUnary(int cmd) {
+        NativeOp op(NATIVE_UNARY);
+        op.unary = real_unary_function(cmd);
+        if (op.unary == NULL)
+            return false;
+        ops.push_back(op);
+        return true;
+    }
+
+    bool addBinary(int cmd, bool swap) {
+        NativeOp op(NATIVE_BINARY);
+        op.binary = real_binary_function(cmd);
+        if (op.binary == NULL)
+            return false;
+        op.swap = swap;
+        ops.push_back(op);
+        depth--;
+        return true;
+    }
+
+    void addPower(bool swap) {
+        NativeOp op(NATIVE_POW);
+        op.swap = swap;
+        ops.push_back(op);
+        depth--;
+    }
+
+    /* Looks up all the variables, except the one named by 'name', which
+     * will be taken from the 'x' parameter to eval(). Fails if any of them
+     * don't exist, or aren't real numbers.
+     */
+    bool bind(const char *name, int length) {
+        values.resize(names.size());
+        int xslot = -1;
+        for (int i = 0; i < names.size(); i++) {
+            const std::string &n = names[i];
+            if (string_equals(n.c_str(), (int) n.length(), name, length)) {
+                xslot = i;
+                continue;
+            }
+            vartype *v = recall_var(n.c_str(), (int) n.length());
+            if (v == NULL || v->type != TYPE_REAL)
+                return false;
+            values[i] = ((vartype_real *) v)->x;
+        }
+        for (int i = 0; i < ops.size(); i++)
+            if (ops[i].code == NATIVE_VAR && ops[i].slot == xslot)
+                ops[i].code = NATIVE_X;
+        return true;
+    }
+
+    int eval(phloat x, phloat *res) {
+        phloat stk[NATIVE_MAX_DEPTH];
+        int sp = -1;
+        int err;
+        for (int i = 0; i < ops.size(); i++) {
+            NativeOp *op = &ops[i];
+            switch (op->code) {
+                case NATIVE_NUMBER:
+                    stk[++sp] = op->value;
+                    break;
+                case NATIVE_VAR:
+                    stk[++sp] = values[op->slot];
+                    break;
+                case NATIVE_X:
+                    stk[++sp] = x;
+                    break;
+                case NATIVE_CHS:
+                    stk[sp] = -stk[sp];
+                    break;
+                case NATIVE_UNARY:
+                    err = op->unary(stk[sp], &stk[sp]);
+                    if (err != ERR_NONE)
+                        return err;
+                    break;
+                case NATIVE_BINARY:
+                case NATIVE_POW: {
+                    phloat xx = stk[sp--];
+                    phloat yy = stk[sp];
+                    if (op->swap) {
+                        phloat t = xx;
+                        xx = yy;
+                        yy = t;
+                    }
+                    if (op->code == NATIVE_BINARY) {
+                        err = op->binary(xx, yy, &stk[sp]);
+                        if (err != ERR_NONE)
+                            return err;
+                        break;
+                    }
+                    // Same as the real cases in docmd_y_pow_x()
+                    if (xx == to_int4(xx) ? yy == 0 && xx <= 0 : yy < 0)
+                        return ERR_INVALID_DATA;
+                    phloat r = pow(yy, xx);
+                    if (p_isinf(r) != 0)
+                        return ERR_OUT_OF_RANGE;
+                    stk[sp] = r;
+                    break;
+                }
+            }
+        }
+        *res = stk[0];
+        return ERR_NONE;
+    }
+};
+
+void native_eqn::reset() {
+    delete code;
+    code = NULL;
+    tried = false;
+}
+
+bool native_eqn::call(vartype *eq, const char *name, int length, phloat x) {
+    if (!tried) {
+        tried = true;
+        if (eq->type != TYPE_EQUATION || length == 0)
+            return false;
+        equation_data *eqd = ((vartype_equation *) eq)->data;
+        if (eqd->get_ev() == NULL)
+            return false;
+        try {
+            code = new NativeCode;
+            if (!eqd->ev->generateNativeCode(code) || !code->complete()
+                    || !code->bind(name, length)) {
+                delete code;
+                code = NULL;
+            }
+        } catch (std::bad_alloc &) {
+            delete code;
+            code = NULL;
+        }
+    }
+    if (code == NULL)
+        return false;
+    phloat f;
+    if (code->eval(x, &f) != ERR_NONE)
+        return false;
+    vartype *v = new_real(f);
+    if (v == NULL || recall_result_silently(v) != ERR_NONE)
+        return false;
+    flags.f.stack_lift_disable = 0;
+    pc = dir_list[current_prgm.dir]->prgms[current_prgm.idx].size - 2;
+    return true;
+}
+
 //////////////////////////////////////////////
 /////  Boilerplate Evaluator subclasses  /////
 //////////////////////////////////////////////
@@ -356,6 +743,10 @@ class UnaryFunction : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, cmd);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return ev->generateNativeCode(nc) && nc->addUnary(cmd);
+    }
 };
 
 class InvertibleUnaryFunction : public UnaryEvaluator {
@@ -380,6 +771,10 @@ class InvertibleUnaryFunction : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, cmd);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return ev->generateNativeCode(nc) && nc->addUnary(cmd);
+    }
 };
 
 class BinaryEvaluator : public Evaluator {
@@ -1372,6 +1767,11 @@ class Difference : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_SUB);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return left->generateNativeCode(nc) && right->generateNativeCode(nc)
+                && nc->addBinary(CMD_SUB, swapArgs);
+    }
 };
 
 /////////////////
@@ -1479,6 +1879,11 @@ class Equation : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_SUB);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return left->generateNativeCode(nc) && right->generateNativeCode(nc)
+                && nc->addBinary(CMD_SUB, false);
+    }
 };
 
 /////////////////
@@ -2117,6 +2522,11 @@ class Literal : public Evaluator {
         ctx->addLine(tpos, value);
     }
 
+    bool generateNativeCode(NativeCode *nc) {
+        nc->addNumber(value);
+        return true;
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         // nope
     }
@@ -2364,6 +2774,10 @@ class NameTag : public UnaryEvaluator {
         ev->generateCode(ctx);
     }
 
+    bool generateNativeCode(NativeCode *nc) {
+        return ev->generateNativeCode(nc);
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         /* Force parameters to be at the head of the list */
         if (params != NULL)
@@ -2396,6 +2810,13 @@ class Negative : public UnaryEvaluator {
         ev->generateCode(ctx);
         ctx->addLine(tpos, CMD_CHS);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        if (!ev->generateNativeCode(nc))
+            return false;
+        nc->addChs();
+        return true;
+    }
 };
 
 ////////////////////
@@ -2584,6 +3005,13 @@ class Power : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_Y_POW_X);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        if (!left->generateNativeCode(nc) || !right->generateNativeCode(nc))
+            return false;
+        nc->addPower(swapArgs);
+        return true;
+    }
 };
 
 /////////////////////
@@ -2607,6 +3035,11 @@ class Product : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_MUL);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return left->generateNativeCode(nc) && right->generateNativeCode(nc)
+                && nc->addBinary(CMD_MUL, false);
+    }
 };
 
 //////////////////////
@@ -2633,6 +3066,11 @@ class Quotient : public BinaryEvaluator {
             ctx->addLine(tpos, CMD_SWAP);
         ctx->addLine(tpos, CMD_DIV);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return left->generateNativeCode(nc) && right->generateNativeCode(nc)
+                && nc->addBinary(CMD_DIV, swapArgs);
+    }
 };
 
 ////////////////////
@@ -3125,6 +3563,11 @@ class Sum : public BinaryEvaluator {
         right->generateCode(ctx);
         ctx->addLine(tpos, CMD_ADD);
     }
+
+    bool generateNativeCode(NativeCode *nc) {
+        return left->generateNativeCode(nc) && right->generateNativeCode(nc)
+                && nc->addBinary(CMD_ADD, false);
+    }
 };
 
 /////////////////
@@ -3303,6 +3746,11 @@ class Variable : public Evaluator {
         ctx->addLine(tpos, CMD_RCL, nam);
     }
 
+    bool generateNativeCode(NativeCode *nc) {
+        nc->addVariable(nam);
+        return true;
+    }
+
     void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) {
         addIfNew(nam, vars, locals);
     }
@@ -4066,6 +4514,7 @@ class Lexer {
         ev->generateCode(&ctx);
         ctx.store(prgm, map);
     } catch (std::bad_alloc &) {
+        invalidate_decoded_prgms();
         free(prgm->text);
         prgm->text = NULL;
     }
@@ -5288,7 +5737,7 @@ void Parser::pushback(std::string o, int p) {
 }
 
 void get_varmenu_row_for_eqn(vartype *eqn, int need_eval, int *rows, int *row, char ktext[6][7], int klen[6]) {
-    Evaluator *ev = ((vartype_equation *) eqn)->data->ev;
+    Evaluator *ev = ((vartype_equation *) eqn)->data->get_ev();
     std::vector<std::string> vars;
     std::vector<std::string> locals;
     ev->collectVariables(&vars, &locals);
@@ -5324,7 +5773,7 @@ static vartype *isolate2(vartype *eqn, const char *name, int length) {
         return NULL;
     vartype_equation *eq = (vartype_equation *) eqn;
     equation_data *eqd = eq->data;
-    Evaluator *ev = eqd->ev;
+    Evaluator *ev = eqd->get_ev();
     std::string n(name, length);
     if (ev->howMany(n) != 1)
         return NULL;
@@ -5402,13 +5851,13 @@ vartype *isolate(vartype *eqn, const char *name, int length) {
 
 bool has_parameters(equation_data *eqdata) {
     std::vector<std::string> names, locals;
-    eqdata->ev->collectVariables(&names, &locals);
+    eqdata->get_ev()->collectVariables(&names, &locals);
     return names.size() > 0;
 }
 
 std::vector<std::string> get_parameters(equation_data *eqdata) {
     std::vector<std::string> names, locals;
-    eqdata->ev->collectVariables(&names, &locals);
+    eqdata->get_ev()->collectVariables(&names, &locals);
     return names;
 }
 
@@ -5441,15 +5890,15 @@ bool is_equation(vartype *v) {
         return false;
     equation_data *eqd = ((vartype_equation *) v)->data;
     Evaluator *lhs, *rhs;
-    eqd->ev->getSides("foo", &lhs, &rhs);
+    eqd->get_ev()->getSides("foo", &lhs, &rhs);
     return rhs != NULL;
 }
 
 void num_parameters(vartype *v, int *black, int *total) {
-    equation_data *eqd = ((vartype_equation *) v)->data;
+    Evaluator *ev = ((vartype_equation *) v)->data->get_ev();
     std::vector<std::string> names, locals;
-    eqd->ev->collectVariables(&names, &locals);
+    ev->collectVariables(&names, &locals);
     *total = (int) names.size();
-    std::vector<std::string> *paramNames = eqd->ev->eqnParamNames();
+    std::vector<std::string> *paramNames = ev->eqnParamNames();
     *black = paramNames == NULL || paramNames->size() == 0 ? *total : (int) paramNames->size();
 }
@@ -26,11 +26,22 @@
 #include "core_globals.h"
 #include "core_variables.h"
 
+/* Version of the parser and code generator. The state file contains the
+ * generated code and code maps for all equations; they are only trusted
+ * when the state file was written with the same PARSER_VERSION, and if it
+ * differs, all equations are re-parsed when the state is loaded.
+ * Increment this whenever a change to the parser or code generator affects
+ * existing equations.
+ * Version 1: Peephole optimizer
+ */
+#define PARSER_VERSION 1
+
 ////////////////////////////////
 /////  class declarations  /////
 ////////////////////////////////
 
 class GeneratorContext;
+class NativeCode;
 class For;
 
 class Evaluator {
@@ -60,6 +71,7 @@ class Evaluator {
     virtual Evaluator *invert(const std::string &name, Evaluator *rhs);
     virtual void generateCode(GeneratorContext *ctx) = 0;
     virtual void generateAssignmentCode(GeneratorContext *ctx) {} /* For lvalues */
+    virtual bool generateNativeCode(NativeCode *nc) { return false; }
     virtual void collectVariables(std::vector<std::string> *vars, std::vector<std::string> *locals) = 0;
     virtual int howMany(const std::string &name) = 0;
 
@@ -88,6 +100,32 @@ class CodeMap {
     int getSize() { return size; }
 };
 
+/* Native evaluation of equations for SOLVE, INTEG, and PLOT.
+ * Equations that only use real numbers, named variables, arithmetic, and
+ * elementary functions are compiled into a flat list of operations that
+ * work on phloats directly, bypassing the interpreter. The variables other
+ * than the one being solved for, integrated over, or plotted against are
+ * bound to their current values on the first call after reset(), so reset()
+ * must be called whenever a new SOLVE, INTEG, or plot starts.
+ * call() is meant to be used by call_solve_fn() and friends, after they
+ * have pointed current_prgm at the equation's code: if it returns true, it
+ * has pushed the function value, and has moved pc to the END, so executing
+ * the program just returns to the caller. If it returns false, the
+ * equation must be evaluated the normal way; this happens for equations
+ * that can't be compiled, and also whenever an operation doesn't produce a
+ * real result, so that errors and complex results are handled exactly as
+ * they would be otherwise.
+ */
+struct native_eqn {
+    NativeCode *code;
+    bool tried;
+
+    native_eqn() : code(NULL), tried(false) {}
+    ~native_eqn() { reset(); }
+    void reset();
+    bool call(vartype *eq, const char *name, int length, phloat x);
+};
+
 class Lexer;
 struct prgm_struct;
 
@@ -1303,6 +1303,19 @@ static int add_cc(phloat xre, phloat xim, phloat yre, phloat yim,
     return ERR_NONE;
 }
 
+/* Returns the function implementing +, -, *, or / for two real arguments,
+ * or NULL for any other command.
+ */
+mappable_rr real_binary_function(int cmd) {
+    switch (cmd) {
+        case CMD_ADD: return add_rr;
+        case CMD_SUB: return sub_rr;
+        case CMD_MUL: return mul_rr;
+        case CMD_DIV: return div_rr;
+        default: return NULL;
+    }
+}
+
 int generic_div(const vartype *px, const vartype *py, int (*completion)(int, vartype *)) {
     if (px->type == TYPE_UNIT) {
         if (py->type == TYPE_UNIT || py->type == TYPE_REAL) {
@@ -71,4 +71,6 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc,
 int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
             mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc);
 
+mappable_rr real_binary_function(int cmd);
+
 #endif
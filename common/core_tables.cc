@@ -53,7 +53,7 @@
  */
 #define UNIM 0x00
 
-// Available XROMs: a776-a77f
+// Available XROMs: a779-a77f
 // When these run out, look for other ones in
 // https://www.hpmuseum.org/software/xroms.htm
 // Make sure to check any new ranges against the codes already in use
@@ -718,6 +718,9 @@ const command_spec cmd_array[] =
     { /* PLOT */        docmd_plot,        "PLOT",                0x00, 0x00, 0xa7, 0x1a,  4, ARG_NONE,   0, NA_T },
     { /* LINE */        docmd_line,        "LINE",                0x00, 0x00, 0xa7, 0x23,  4, ARG_NONE,   2, FUNC },
     { /* LIFE */        docmd_life,        "LIFE",                0x00, 0x00, 0xa7, 0x24,  4, ARG_NONE,   0, NA_T },
+    { /* PFON */        docmd_pfon,        "PFON",                0x00, 0x00, 0xa7, 0x76,  4, ARG_NONE,   0, NA_T },
+    { /* PFOFF */       docmd_pfoff,       "PFOFF",               0x00, 0x00, 0xa7, 0x77,  5, ARG_NONE,   0, NA_T },
+    { /* PFRPT */       docmd_pfrpt,       "PFRPT",               0x00, 0x00, 0xa7, 0x78,  5, ARG_NONE,   0, NA_T },
 };
 
 /*
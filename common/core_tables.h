@@ -671,8 +671,11 @@
 #define CMD_PLOT        615
 #define CMD_LINE        616
 #define CMD_LIFE        617
+#define CMD_PFON        618
+#define CMD_PFOFF       619
+#define CMD_PFRPT       620
 
-#define CMD_SENTINEL    618
+#define CMD_SENTINEL    621
 
 
 /* command_spec.argtype */
@@ -31,6 +31,15 @@ equation_data::~equation_data() {
     delete map;
 }
 
+Evaluator *equation_data::get_ev() {
+    if (ev_deferred) {
+        ev_deferred = false;
+        int errpos;
+        ev = Parser::parse(std::string(text, length), &compatMode, &compatModeEmbedded, &errpos);
+    }
+    return ev;
+}
+
 bool pgm_index::is_editable() {
     return dir == cwd->id;
 }
@@ -588,6 +597,8 @@ vartype *dup_vartype(const vartype *v) {
 }
 
 bool disentangle(vartype *v) {
+    // Callers are about to modify v in place
+    journal_touch(v);
     switch (v->type) {
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
@@ -714,64 +725,246 @@ vartype *vloc::value() {
 void vloc::set_value(vartype *v) {
     if (dir <= 0)
         local_vars[idx].value = v;
-    else
-        dir_list[dir]->vars[idx].value = v;
+    else {
+        var_struct *vs = dir_list[dir]->vars + idx;
+        vs->value = v;
+        journal_mark_var(dir, vs->name, vs->length);
+    }
 }
 
 bool vloc::writable() {
     return idx != -1 && (dir <= 0 || dir == cwd->id);
 }
 
+/* Index of local variables
+ * Maps names to the topmost non-private local with that name. Each local
+ * also remembers the instance it shadows, so that when locals are popped off
+ * the top of the stack, on return from a subroutine, the previous instances
+ * become visible again without any searching. Slots are never emptied, only
+ * their 'top' set to -1, so probe sequences stay intact; the table is rebuilt
+ * from scratch when it fills up, or when locals are removed from anywhere
+ * but the top of the stack.
+ */
+
+struct local_hash_slot {
+    int top;
+    unsigned char length;
+    char name[7];
+};
+
+static local_hash_slot *local_hash = NULL;
+static int local_hash_size = 0;
+static int local_hash_used = 0;
+static bool local_hash_valid = false;
+static int *local_shadow = NULL;
+static int local_shadow_capacity = 0;
+
+static local_hash_slot *local_hash_slot_for(const char *name, int namelength) {
+    int h = name_hash_code(name, namelength) & (local_hash_size - 1);
+    while (true) {
+        local_hash_slot *slot = local_hash + h;
+        if (slot->top == -2 || string_equals(slot->name, slot->length, name, namelength))
+            return slot;
+        h = (h + 1) & (local_hash_size - 1);
+    }
+}
+
+static bool rebuild_local_hash();
+
+static void local_hash_insert(int idx) {
+    var_struct *lv = local_vars + idx;
+    if ((lv->flags & VAR_PRIVATE) != 0) {
+        local_shadow[idx] = -1;
+        return;
+    }
+    local_hash_slot *slot = local_hash_slot_for(lv->name, lv->length);
+    if (slot->top == -2) {
+        if ((local_hash_used + 1) * 2 > local_hash_size) {
+            local_hash_valid = false;
+            rebuild_local_hash();
+            return;
+        }
+        string_copy(slot->name, &slot->length, lv->name, lv->length);
+        slot->top = -1;
+        local_hash_used++;
+    }
+    local_shadow[idx] = slot->top;
+    slot->top = idx;
+}
+
+static bool rebuild_local_hash() {
+    if (local_vars_count > local_shadow_capacity) {
+        int nc = local_vars_count + 25;
+        int *ns = (int *) realloc(local_shadow, nc * sizeof(int));
+        if (ns == NULL)
+            return false;
+        local_shadow = ns;
+        local_shadow_capacity = nc;
+    }
+    int size = 16;
+    while (size < (local_vars_count + 1) * 2)
+        size <<= 1;
+    if (size != local_hash_size) {
+        local_hash_slot *nh = (local_hash_slot *) realloc(local_hash, size * sizeof(local_hash_slot));
+        if (nh == NULL)
+            return false;
+        local_hash = nh;
+        local_hash_size = size;
+    }
+    for (int i = 0; i < size; i++)
+        local_hash[i].top = -2;
+    local_hash_used = 0;
+    local_hash_valid = true;
+    for (int i = 0; i < local_vars_count; i++)
+        local_hash_insert(i);
+    return true;
+}
+
+static void local_var_pushed() {
+    invalidate_var_lookups();
+    if (!local_hash_valid)
+        return;
+    int idx = local_vars_count - 1;
+    if (idx >= local_shadow_capacity) {
+        int nc = local_shadow_capacity + 25;
+        int *ns = (int *) realloc(local_shadow, nc * sizeof(int));
+        if (ns == NULL) {
+            local_hash_valid = false;
+            return;
+        }
+        local_shadow = ns;
+        local_shadow_capacity = nc;
+    }
+    local_hash_insert(idx);
+}
+
+void local_vars_changed() {
+    local_hash_valid = false;
+    invalidate_var_lookups();
+}
+
+void local_vars_popped(int old_count) {
+    /* Called after the locals from local_vars_count up to old_count have been
+     * removed from the top of the stack. Their var_structs are still there,
+     * except for their values, so their names can be used to restore the
+     * instances they were shadowing.
+     */
+    invalidate_var_lookups();
+    if (!local_hash_valid)
+        return;
+    for (int i = old_count - 1; i >= local_vars_count; i--) {
+        var_struct *lv = local_vars + i;
+        if ((lv->flags & VAR_PRIVATE) != 0)
+            continue;
+        local_hash_slot_for(lv->name, lv->length)->top = local_shadow[i];
+    }
+}
+
+static int find_local_var(const char *name, int namelength) {
+    if (local_vars_count == 0)
+        return -1;
+    if (local_hash_valid || rebuild_local_hash()) {
+        local_hash_slot *slot = local_hash_slot_for(name, namelength);
+        return slot->top < 0 ? -1 : slot->top;
+    }
+    for (int i = local_vars_count - 1; i >= 0; i--) {
+        if ((local_vars[i].flags & VAR_PRIVATE) != 0)
+            continue;
+        if (string_equals(local_vars[i].name, local_vars[i].length, name, namelength))
+            return i;
+    }
+    return -1;
+}
+
+/* Cached variable lookups
+ * Programs tend to access the same few variables over and over, so the
+ * results of lookup_var() are remembered here, keyed by name, lookup flags,
+ * and the current directory. Entries are validated by var_gen, which changes
+ * whenever a variable is created or deleted anywhere, locals included, and
+ * when directories are moved or deleted. Only hits in the locals and in the
+ * current directory and its ancestors are cached; lookups that get as far as
+ * PATH depend on the contents of PATH as well, so those are done the long
+ * way every time.
+ */
+
+struct var_lookup_cache_entry {
+    uint4 gen;
+    int4 cwd;
+    unsigned char mode;
+    unsigned char length;
+    char name[7];
+    vloc loc;
+};
+
+#define VAR_LOOKUP_CACHE_SIZE 64
+static var_lookup_cache_entry var_lookup_cache[VAR_LOOKUP_CACHE_SIZE];
+static uint4 var_gen = 1;
+
+void invalidate_var_lookups() {
+    if (++var_gen == 0) {
+        // Wrapped around; make sure no stale entry can match
+        for (int i = 0; i < VAR_LOOKUP_CACHE_SIZE; i++)
+            var_lookup_cache[i].gen = 0;
+        var_gen = 1;
+    }
+}
+
 vloc lookup_var(const char *name, int namelength, bool no_locals, bool no_ancestors) {
+    unsigned char mode = (no_locals ? 1 : 0) | (no_ancestors ? 2 : 0);
+    var_lookup_cache_entry *e = NULL;
+    if (namelength <= 7) {
+        e = var_lookup_cache + ((name_hash_code(name, namelength) + mode) & (VAR_LOOKUP_CACHE_SIZE - 1));
+        if (e->gen == var_gen && e->cwd == cwd->id && e->mode == mode
+                && string_equals(e->name, e->length, name, namelength))
+            return e->loc;
+    }
+    vloc res;
     if (!no_locals) {
-        for (int i = local_vars_count - 1; i >= 0; i--) {
-            if ((local_vars[i].flags & VAR_PRIVATE) != 0)
-                continue;
-            if (local_vars[i].length == namelength) {
-                for (int j = 0; j < namelength; j++)
-                    if (local_vars[i].name[j] != name[j])
-                        goto nomatch;
-                return vloc(-local_vars[i].level, i);
-            }
-            nomatch:;
+        int i = find_local_var(name, namelength);
+        if (i != -1) {
+            res = vloc(-local_vars[i].level, i);
+            goto found;
         }
     }
-    directory *dir = cwd;
-    do {
-        for (int i = dir->vars_count - 1; i >= 0; i--) {
-            if (dir->vars[i].length == namelength) {
-                for (int j = 0; j < namelength; j++)
-                    if (dir->vars[i].name[j] != name[j])
-                        goto nomatch2;
-                return vloc(dir->id, i);
+    {
+        directory *dir = cwd;
+        do {
+            int i = dir->find_var(name, namelength);
+            if (i != -1) {
+                res = vloc(dir->id, i);
+                goto found;
             }
-            nomatch2:;
-        }
-        if (no_ancestors)
+            if (no_ancestors)
+                return vloc();
+            dir = dir->parent;
+        } while (dir != NULL);
+    }
+    {
+        vartype_list *path = get_path();
+        if (path == NULL)
             return vloc();
-        dir = dir->parent;
-    } while (dir != NULL);
-    vartype_list *path = get_path();
-    if (path == NULL)
-        return vloc();
-    for (int i = 0; i < path->size; i++) {
-        vartype *v = path->array->data[i];
-        if (v->type != TYPE_DIR_REF)
-            continue;
-        dir = get_dir(((vartype_dir_ref *) v)->dir);
-        if (dir == NULL)
-            continue;
-        for (int j = dir->vars_count - 1; j >= 0; j--) {
-            if (dir->vars[j].length == namelength) {
-                for (int k = 0; k < namelength; k++)
-                    if (dir->vars[j].name[k] != name[k])
-                        goto nomatch3;
+        for (int i = 0; i < path->size; i++) {
+            vartype *v = path->array->data[i];
+            if (v->type != TYPE_DIR_REF)
+                continue;
+            directory *dir = get_dir(((vartype_dir_ref *) v)->dir);
+            if (dir == NULL)
+                continue;
+            int j = dir->find_var(name, namelength);
+            if (j != -1)
                 return vloc(dir->id, j);
-            }
-            nomatch3:;
         }
+        return vloc();
     }
-    return vloc();
+    found:
+    if (e != NULL) {
+        e->gen = var_gen;
+        e->cwd = cwd->id;
+        e->mode = mode;
+        string_copy(e->name, &e->length, name, namelength);
+        e->loc = res;
+    }
+    return res;
 }
 
 vartype *recall_var(const char *name, int namelength, bool *writable) {
@@ -801,7 +994,7 @@ equation_data *find_equation_data(const char *name, int namelength) {
         if (v->type == TYPE_EQUATION) {
             vartype_equation *eq = (vartype_equation *) v;
             equation_data *eqd = eq->data;
-            if (eqd->ev != NULL && eqd->ev->eqnName() == s)
+            if (eqd->get_ev() != NULL && eqd->ev->eqnName() == s)
                 return eqd;
         }
     }
@@ -821,7 +1014,7 @@ std::vector<std::string> get_equation_names() {
         if (v->type == TYPE_EQUATION) {
             vartype_equation *eq = (vartype_equation *) v;
             equation_data *eqd = eq->data;
-            if (eqd->ev != NULL && eqd->ev->eqnName().length() > 0)
+            if (eqd->get_ev() != NULL && eqd->ev->eqnName().length() > 0)
                 res.push_back(eqd->ev->eqnName());
         }
     }
@@ -841,7 +1034,7 @@ std::vector<int> get_equation_indexes() {
         if (v->type == TYPE_EQUATION) {
             vartype_equation *eq = (vartype_equation *) v;
             equation_data *eqd = eq->data;
-            if (eqd->ev != NULL && eqd->ev->eqnName().length() > 0)
+            if (eqd->get_ev() != NULL && eqd->ev->eqnName().length() > 0)
                 res.push_back(i);
         }
     }
@@ -910,7 +1103,7 @@ int store_params() {
     } else if (stack[sp]->type == TYPE_EQUATION) {
         vartype_equation *eq = (vartype_equation *) stack[sp];
         equation_data *eqd = eq->data;
-        std::vector<std::string> *params = eqd->ev->eqnParamNames();
+        std::vector<std::string> *params = eqd->get_ev()->eqnParamNames();
         return store_params2(params, false);
     } else {
         return ERR_INVALID_TYPE;
@@ -947,6 +1140,8 @@ int store_var(const char *name, int namelength, vartype *value, bool local /* =
         var_struct *gv = cwd->vars + idx;
         string_copy(gv->name, &gv->length, name, namelength);
         gv->value = value;
+        cwd->var_added(idx);
+        journal_mark_var(cwd->id, gv->name, gv->length);
     } else if (local && varindex.level() < get_rtn_level()) {
         do_local:
         /* Create new local */
@@ -964,6 +1159,7 @@ int store_var(const char *name, int namelength, vartype *value, bool local /* =
         lv->level = get_rtn_level();
         lv->flags = 0;
         lv->value = value;
+        local_var_pushed();
     } else {
         /* Update existing vaiable */
         if ((matedit_mode == 1 || matedit_mode == 3)
@@ -1034,11 +1230,14 @@ bool purge_var(const char *name, int namelength, bool force, bool global, bool l
         for (int i = varindex.idx; i < local_vars_count - 1; i++)
             local_vars[i] = local_vars[i + 1];
         local_vars_count--;
+        local_vars_changed();
     } else {
         directory *dir = dir_list[varindex.dir];
+        journal_mark_var(dir->id, dir->vars[varindex.idx].name, dir->vars[varindex.idx].length);
         for (int i = varindex.idx; i < dir->vars_count - 1; i++)
             dir->vars[i] = dir->vars[i + 1];
         dir->vars_count--;
+        dir->vars_changed();
     }
     update_catalog();
     return true;
@@ -1117,7 +1316,7 @@ bool named_eqns_exist() {
         if (v->type == TYPE_EQUATION) {
             vartype_equation *eq = (vartype_equation *) v;
             equation_data *eqd = eq->data;
-            if (eqd->ev != NULL && eqd->ev->eqnName().length() > 0)
+            if (eqd->get_ev() != NULL && eqd->ev->eqnName().length() > 0)
                 return true;
         }
     }
@@ -1211,6 +1410,7 @@ vartype *recall_and_purge_private_var(const char *name, int namelength) {
     for (int i = varindex.idx; i < local_vars_count - 1; i++)
         local_vars[i] = local_vars[i + 1];
     local_vars_count--;
+    local_vars_changed();
     return ret;
 }
 
@@ -1233,6 +1433,7 @@ int store_private_var(const char *name, int namelength, vartype *value) {
         local_vars[idx].level = get_rtn_level();
         local_vars[idx].flags = VAR_PRIVATE;
         local_vars[idx].value = value;
+        local_var_pushed();
     } else {
         free_vartype(varindex.value());
         varindex.set_value(value);
@@ -1283,10 +1484,12 @@ void reparse_all_equations() {
             delete old_eqd->ev;
             delete old_eqd->map;
             old_eqd->ev = new_eqd->ev;
+            old_eqd->ev_deferred = false;
             old_eqd->map = new_eqd->map;
             new_eqd->ev = NULL;
             new_eqd->map = NULL;
             delete new_eqd;
+            invalidate_decoded_prgms();
             free(old_prgm.text);
             prgm->eq_data = old_prgm.eq_data;
         }
@@ -1297,8 +1500,10 @@ void remove_equation_reference(int4 id) {
     equation_data *eqd = eq_dir->prgms[id].eq_data;
     if (--(eqd->refcount) > 0)
         return;
+    journal_mark_structure();
     equation_deleted(id);
     count_embed_references(eq_dir, id, false);
+    invalidate_decoded_prgms();
     free(eq_dir->prgms[id].text);
     eq_dir->prgms[id].text = NULL;
     eq_dir->prgms[id].eq_data = NULL;
@@ -33,11 +33,19 @@ class CodeMap;
 class equation_data {
     public:
     int refcount;
-    equation_data() : refcount(0), length(0), text(NULL), ev(NULL), map(NULL) {}
+    equation_data() : refcount(0), length(0), text(NULL), ev(NULL), ev_deferred(false), map(NULL) {}
     ~equation_data();
     int4 length;
     char *text;
+    /* The parse tree. When an equation is loaded from a state file written
+     * by the same parser version, its code and code map are used as-is, and
+     * parsing the text is deferred until the parse tree is actually needed;
+     * get_ev() takes care of that, so use it instead of accessing ev
+     * directly.
+     */
     Evaluator *ev;
+    bool ev_deferred;
+    Evaluator *get_ev();
     CodeMap *map;
     bool compatMode;
     bool compatModeEmbedded;
@@ -223,6 +231,9 @@ void put_matrix_phloat(vartype_realmatrix *rm, int4 i, phloat value);
 vartype *dup_vartype(const vartype *v);
 bool disentangle(vartype *v);
 vloc lookup_var(const char *name, int namelength, bool no_locals = false, bool no_ancestors = false);
+void invalidate_var_lookups();
+void local_vars_changed();
+void local_vars_popped(int old_count);
 vartype *recall_var(const char *name, int namelength, bool *writable = NULL);
 vartype *recall_global_var(const char *name, int namelength, bool *writable = NULL);
 equation_data *find_equation_data(const char *name, int namelength);
@@ -86,9 +86,25 @@ void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad);
  * active invocation of core_keydown() or core_keyup() will then return
  * immediately (with a return value of 1, to indicate that it would like to get
  * the CPU back as soon as possible).
+ * While running a program, the core calls this once per time slice, which is
+ * about 10 ms by default; see core_set_slice_duration().
  */
 bool shell_wants_cpu();
 
+/* shell_checkpoint()
+ *
+ * Callback invoked by the emulator core while a program is running, once
+ * every core_settings.checkpoint_interval seconds, so that a long-running
+ * program doesn't lose all its work if the process is killed. The buffer
+ * holds a complete state file, captured with the program still running; the
+ * shell takes ownership of it, should write it to the current state file
+ * with core_write_state(), preferably without blocking the core, and must
+ * free() it afterwards. snapshot_ms is how long capturing the state took,
+ * for reporting. Shells that never set checkpoint_interval can simply free()
+ * the buffer.
+ */
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms);
+
 /* shell_delay()
  *
  * Callback to suspend execution for the given number of milliseconds. No event
@@ -69,6 +69,10 @@ bool shell_wants_cpu() {
     return false;
 }
 
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    free(buf);
+}
+
 void shell_delay(int duration) {
     //
 }
@@ -87,6 +87,23 @@ char free42dirname[FILENAMELEN];
 static unsigned char *print_bitmap;
 static int printout_top;
 static int printout_bottom;
+
+/* The print-out window paints print_bitmap through 1-bit mask surfaces, each
+ * covering PRINT_TILE_LINES lines of the ring buffer, which are only
+ * regenerated after new lines have been printed into them; see
+ * repaint_printout(). The growth of the print-out, and the scrolling that
+ * goes with it, is handled once per batch of printed lines, in
+ * print_update_cb(), rather than once per line.
+ */
+#define PRINT_TILE_LINES 256
+#define PRINT_TILES ((PRINT_LINES + PRINT_TILE_LINES - 1) / PRINT_TILE_LINES)
+static cairo_surface_t *print_tile[PRINT_TILES];
+static bool print_tile_valid[PRINT_TILES];
+static guint print_update_id = 0;
+static int print_update_oldlength;
+static bool print_update_wrapped;
+static unsigned short print_double[256];
+static bool print_double_ready = false;
 static unsigned char *print_text;
 static int print_text_top;
 static int print_text_bottom;
@@ -129,6 +146,30 @@ static keymap_entry *keymap = NULL;
 
 static guint reminder_id = 0;
 static FILE *statefile = NULL;
+
+/* Core state saves in progress; see save_core_state() */
+static GThread *save_thread = NULL;
+
+/* Interval between autosaves; see autosaver() */
+#define AUTOSAVE_INTERVAL 30000
+static bool autosave_blocked = false;
+
+static GThread *core_thread = NULL;
+static GMutex core_thread_mutex;
+static GCond core_thread_cond;
+static bool core_thread_busy = false;
+static bool core_thread_keep_running;
+static gint core_thread_stop = 0;
+static GQueue core_messages = G_QUEUE_INIT;
+static void (*main_call)(void *) = NULL;
+static void *main_call_data;
+static bool in_main_call = false;
+static guint frame_id = 0;
+static char *frame_bits = NULL;
+static int frame_size = 0;
+static int frame_bpl;
+static int frame_left, frame_top, frame_right, frame_bottom;
+
 static char statefilename[FILENAMELEN];
 static char printfilename[FILENAMELEN];
 static char keymapfilename[FILENAMELEN];
@@ -161,6 +202,8 @@ static void int_term_handler(int sig);
 static gboolean gt_signal_handler(GIOChannel *source, GIOCondition condition,
                                                             gpointer data);
 static void quit();
+static void save_core_state(const char *path);
+static void finish_core_save();
 static char *strclone(const char *s);
 static bool file_exists(const char *name);
 static void show_message(const char *title, const char *message, GtkWidget *parent = mainwindow);
@@ -202,8 +245,11 @@ static gboolean timeout1(gpointer cd);
 static gboolean timeout2(gpointer cd);
 static gboolean timeout3(gpointer cd);
 static gboolean battery_checker(gpointer cd);
+static gboolean autosaver(gpointer cd);
 static void repaint_printout(cairo_t *cr, bool dark);
+static void invalidate_print_tiles();
 static gboolean reminder(gpointer cd);
+static void resume_core_thread();
 static void txt_writer(const char *text, int length);
 static void txt_newliner();
 static void gif_seeker(int4 pos);
@@ -840,6 +886,8 @@ static void activate(GtkApplication *theApp, gpointer userData) {
         }
     }
 
+    g_timeout_add(AUTOSAVE_INTERVAL, autosaver, NULL);
+
     if (pipe(pype) != 0)
         fprintf(stderr, "Could not create pipe for signal handler; not catching signals.\n");
     else {
@@ -1070,7 +1118,16 @@ static void init_shell_state(int4 version) {
             state.mainWindowHeight = 0;
             /* fall through */
         case 10:
-            /* current version (SHELL_VERSION = 10),
+            core_settings.matrix_block_size = 64;
+            /* fall through */
+        case 11:
+            state.core_thread = false;
+            /* fall through */
+        case 12:
+            core_settings.checkpoint_interval = 0;
+            /* fall through */
+        case 13:
+            /* current version (SHELL_VERSION = 13),
              * so nothing to do here since everything
              * was initialized from the state file.
              */
@@ -1108,6 +1165,10 @@ static int read_shell_state() {
     }
     if (state_version >= 9)
         core_settings.localized_copy_paste = state.localized_copy_paste;
+    if (state_version >= 11)
+        core_settings.matrix_block_size = state.matrix_block_size;
+    if (state_version >= 13)
+        core_settings.checkpoint_interval = state.checkpoint_interval;
 
     init_shell_state(state_version);
     return 1;
@@ -1131,6 +1192,8 @@ static int write_shell_state() {
     state.matrix_outofrange = core_settings.matrix_outofrange;
     state.auto_repeat = core_settings.auto_repeat;
     state.localized_copy_paste = core_settings.localized_copy_paste;
+    state.matrix_block_size = core_settings.matrix_block_size;
+    state.checkpoint_interval = core_settings.checkpoint_interval;
     if (fwrite(&state, 1, sizeof(state_type), statefile) != sizeof(int4))
         return 0;
 
@@ -1151,6 +1214,8 @@ static void quit() {
     FILE *printfile;
     int n, length;
 
+    pause_core_thread();
+
     printfile = fopen(printfilename, "w");
     if (printfile != NULL) {
         // Write bitmap
@@ -1245,14 +1310,93 @@ static void quit() {
     }
     char corefilename[FILENAMELEN];
     snprintf(corefilename, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
-    core_save_state(corefilename);
+    save_core_state(corefilename);
     core_cleanup();
 
     shell_spool_exit();
+    finish_core_save();
 
     exit(0);
 }
 
+struct save_job {
+    char *buf;
+    size_t size;
+    char path[FILENAMELEN];
+    bool checkpoint;
+    uint4 snapshot_ms;
+};
+
+static gpointer save_thread_main(gpointer p) {
+    save_job *job = (save_job *) p;
+    #ifdef STATE_TIMING
+        gint64 start = g_get_monotonic_time();
+    #endif
+    bool success = core_write_state(job->path, job->buf, job->size);
+    #ifdef STATE_TIMING
+        if (job->checkpoint) {
+            char msg[100];
+            snprintf(msg, 100, "Checkpoint%s: %lu bytes, snapshot %u ms, write %d ms",
+                    success ? "" : " failed", (unsigned long) job->size,
+                    job->snapshot_ms, (int) ((g_get_monotonic_time() - start) / 1000));
+            shell_log(msg);
+        }
+    #else
+        (void) success;
+    #endif
+    free(job->buf);
+    free(job);
+    return NULL;
+}
+
+/* Saves the core state without waiting for the state file to be written.
+ * The state is captured in memory right away, so the core can be cleaned
+ * up, or switched to a different state, while the file is still being
+ * written. Only one save is in progress at any time, and finish_core_save()
+ * must be called before exiting, and before anything that reads, copies,
+ * or renames state files.
+ */
+static void save_core_state(const char *path) {
+    finish_core_save();
+    save_job *job = (save_job *) malloc(sizeof(save_job));
+    if (job == NULL || !core_snapshot_state(&job->buf, &job->size)) {
+        // Not enough memory for a snapshot; do it the old-fashioned way
+        free(job);
+        core_save_state(path);
+        return;
+    }
+    strncpy(job->path, path, FILENAMELEN);
+    job->path[FILENAMELEN - 1] = 0;
+    job->checkpoint = false;
+    save_thread = g_thread_new("Plus42 save", save_thread_main, job);
+}
+
+/* Writes a checkpoint taken by the core, like save_core_state(), except
+ * that the state has already been captured, and the write is reported on
+ * standard error, so the checkpoint overhead can be monitored.
+ */
+static void write_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    finish_core_save();
+    save_job *job = (save_job *) malloc(sizeof(save_job));
+    if (job == NULL) {
+        free(buf);
+        return;
+    }
+    job->buf = buf;
+    job->size = size;
+    snprintf(job->path, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
+    job->checkpoint = true;
+    job->snapshot_ms = snapshot_ms;
+    save_thread = g_thread_new("Plus42 save", save_thread_main, job);
+}
+
+static void finish_core_save() {
+    if (save_thread != NULL) {
+        g_thread_join(save_thread);
+        save_thread = NULL;
+    }
+}
+
 static char *strclone(const char *s) {
     char *s2 = (char *) malloc(strlen(s) + 1);
     if (s2 != NULL)
@@ -1427,6 +1571,7 @@ static char *get_state_name(const char *prompt, const char *initialName) {
 }
 
 static bool switchTo(const char *selectedStateName) {
+    pause_core_thread();
     char path[FILENAMELEN];
     if (strcmp(selectedStateName, state.coreName) == 0) {
         GtkWidget *msg = gtk_message_dialog_new(GTK_WINDOW(dlg),
@@ -1443,7 +1588,7 @@ static bool switchTo(const char *selectedStateName) {
             return false;
     } else {
         snprintf(path, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
-        core_save_state(path);
+        save_core_state(path);
     }
     core_cleanup();
     strncpy(state.coreName, selectedStateName, FILENAMELEN);
@@ -1555,9 +1700,10 @@ static void states_menu_duplicate() {
     // one. If it is, we'll call core_save_state(), to make sure the duplicate
     // actually matches the most up-to-date state; otherwise, we can simply copy
     // the existing state file.
-    if (strcmp(state_names[selectedStateIndex], state.coreName) == 0)
+    if (strcmp(state_names[selectedStateIndex], state.coreName) == 0) {
+        pause_core_thread();
         core_save_state(finalName);
-    else {
+    } else {
         char origName[FILENAMELEN];
         snprintf(origName, FILENAMELEN, "%s/%s.p42", free42dirname, state_names[selectedStateIndex]);
         if (!copy_state(origName, finalName)) {
@@ -1700,9 +1846,10 @@ static void states_menu_export() {
             return;
     }
 
-    if (selectedStateIndex == currentStateIndex)
+    if (selectedStateIndex == currentStateIndex) {
+        pause_core_thread();
         core_save_state(export_file_name);
-    else {
+    } else {
         char orig_path[FILENAMELEN];
         snprintf(orig_path, FILENAMELEN, "%s/%s.p42", free42dirname, state_names[selectedStateIndex]);
         if (!copy_state(orig_path, export_file_name))
@@ -1711,6 +1858,8 @@ static void states_menu_export() {
 }
 
 static void states_menu_cb(GtkWidget *w, gpointer p) {
+    // These all work on state files, so any pending save must be complete
+    finish_core_save();
     switch ((size_t) p) {
         case 0:
             states_menu_new();
@@ -1874,6 +2023,7 @@ static void statesCB() {
     // GObject reference-counting stuff?
 
     gtk_window_set_role(GTK_WINDOW(states_dialog), "Plus42 Dialog");
+    autosave_blocked = true;
     while (true) {
         int response = gtk_dialog_run(GTK_DIALOG(states_dialog));
         if (response == 3 || response == GTK_RESPONSE_DELETE_EVENT)
@@ -1904,6 +2054,7 @@ static void statesCB() {
     }
 
     gtk_widget_hide(states_dialog);
+    autosave_blocked = false;
 
     for (int i = 0; i < state_size; i++)
         free(state_names[i]);
@@ -1959,6 +2110,7 @@ static void exportProgramCB() {
         gtk_widget_show_all(GTK_WIDGET(sel_dialog));
     }
 
+    pause_core_thread();
     char *buf = core_list_programs();
 
     GtkListStore *model = gtk_list_store_new(1, G_TYPE_STRING);
@@ -2070,6 +2222,9 @@ static void exportProgramCB() {
         }
     }
 
+    // The dialogs above run nested main loops, which may have resumed the
+    // core thread; stop it again before touching the program list.
+    pause_core_thread();
     core_export_programs(count, p2, export_file_name);
     free(p2);
 }
@@ -2137,6 +2292,7 @@ static void importProgramCB() {
                         GTK_FILE_CHOOSER(dialog))), "All", 3) != 0)
         appendSuffix(filenamebuf, ".raw");
 
+    pause_core_thread();
     core_import_programs(0, filenamebuf);
     redisplay();
 }
@@ -2283,6 +2439,7 @@ static void copyPrintAsImageCB() {
 static void clearPrintOutCB() {
     printout_top = 0;
     printout_bottom = 0;
+    invalidate_print_tiles();
     print_text_top = 0;
     print_text_bottom = 0;
     print_text_pixel_height = 0;
@@ -2334,6 +2491,21 @@ static void browse_file(GtkButton *button, gpointer cd) {
     gtk_widget_destroy(GTK_WIDGET(save_dialog));
 }
 
+static void calibrate_block_size(GtkButton *button, gpointer entry) {
+    GtkWidget *dialog = gtk_widget_get_toplevel(GTK_WIDGET(button));
+    GdkWindow *win = gtk_widget_get_window(dialog);
+    GdkCursor *cursor = gdk_cursor_new_for_display(gdk_window_get_display(win), GDK_WATCH);
+    gdk_window_set_cursor(win, cursor);
+    while (gtk_events_pending())
+        gtk_main_iteration();
+    char buf[12];
+    pause_core_thread();
+    snprintf(buf, 12, "%d", core_calibrate_matrix_block_size());
+    gtk_entry_set_text(GTK_ENTRY(entry), buf);
+    gdk_window_set_cursor(win, NULL);
+    g_object_unref(cursor);
+}
+
 static void preferencesCB() {
     static GtkWidget *dialog = NULL;
     static GtkWidget *singularmatrix;
@@ -2341,11 +2513,14 @@ static void preferencesCB() {
     static GtkWidget *autorepeat;
     static GtkWidget *localizedcopypaste;
     static GtkWidget *repaintwholedisplay;
+    static GtkWidget *corethread;
     static GtkWidget *printtotext;
     static GtkWidget *textpath;
     static GtkWidget *printtogif;
     static GtkWidget *gifpath;
     static GtkWidget *gifheight;
+    static GtkWidget *blocksize;
+    static GtkWidget *checkpoint;
 
     if (dialog == NULL) {
         dialog = gtk_dialog_new_with_buttons(
@@ -2371,23 +2546,38 @@ static void preferencesCB() {
         gtk_grid_attach(GTK_GRID(grid), localizedcopypaste, 0, 3, 4, 1);
         repaintwholedisplay = gtk_check_button_new_with_label("Always repaint entire display");
         gtk_grid_attach(GTK_GRID(grid), repaintwholedisplay, 0, 4, 4, 1);
+        corethread = gtk_check_button_new_with_label("Run programs on a separate thread");
+        gtk_grid_attach(GTK_GRID(grid), corethread, 0, 5, 4, 1);
         printtotext = gtk_check_button_new_with_label("Print to text file:");
-        gtk_grid_attach(GTK_GRID(grid), printtotext, 0, 5, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), printtotext, 0, 6, 1, 1);
         textpath = gtk_entry_new();
-        gtk_grid_attach(GTK_GRID(grid), textpath, 1, 5, 2, 1);
+        gtk_grid_attach(GTK_GRID(grid), textpath, 1, 6, 2, 1);
         GtkWidget *browse1 = gtk_button_new_with_label("Browse...");
-        gtk_grid_attach(GTK_GRID(grid), browse1, 3, 5, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), browse1, 3, 6, 1, 1);
         printtogif = gtk_check_button_new_with_label("Print to GIF file:");
-        gtk_grid_attach(GTK_GRID(grid), printtogif, 0, 6, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), printtogif, 0, 7, 1, 1);
         gifpath = gtk_entry_new();
-        gtk_grid_attach(GTK_GRID(grid), gifpath, 1, 6, 2, 1);
+        gtk_grid_attach(GTK_GRID(grid), gifpath, 1, 7, 2, 1);
         GtkWidget *browse2 = gtk_button_new_with_label("Browse...");
-        gtk_grid_attach(GTK_GRID(grid), browse2, 3, 6, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), browse2, 3, 7, 1, 1);
         GtkWidget *label = gtk_label_new("Maximum GIF height (pixels):");
-        gtk_grid_attach(GTK_GRID(grid), label, 1, 7, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), label, 1, 8, 1, 1);
         gifheight = gtk_entry_new();
         gtk_entry_set_max_length(GTK_ENTRY(gifheight), 5);
-        gtk_grid_attach(GTK_GRID(grid), gifheight, 2, 7, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), gifheight, 2, 8, 1, 1);
+        label = gtk_label_new("Matrix multiplication block size:");
+        gtk_grid_attach(GTK_GRID(grid), label, 0, 9, 2, 1);
+        blocksize = gtk_entry_new();
+        gtk_entry_set_max_length(GTK_ENTRY(blocksize), 4);
+        gtk_grid_attach(GTK_GRID(grid), blocksize, 2, 9, 1, 1);
+        GtkWidget *calibrate = gtk_button_new_with_label("Calibrate");
+        gtk_grid_attach(GTK_GRID(grid), calibrate, 3, 9, 1, 1);
+        g_signal_connect(G_OBJECT(calibrate), "clicked", G_CALLBACK(calibrate_block_size), (gpointer) blocksize);
+        label = gtk_label_new("Checkpoint interval for running programs (seconds, 0 = off):");
+        gtk_grid_attach(GTK_GRID(grid), label, 0, 10, 2, 1);
+        checkpoint = gtk_entry_new();
+        gtk_entry_set_max_length(GTK_ENTRY(checkpoint), 5);
+        gtk_grid_attach(GTK_GRID(grid), checkpoint, 2, 10, 1, 1);
 
         g_signal_connect(G_OBJECT(browse1), "clicked", G_CALLBACK(browse_file),
                 (gpointer) new browse_file_info("Select Text File Name",
@@ -2412,10 +2602,22 @@ static void preferencesCB() {
     char maxlen[6];
     snprintf(maxlen, 6, "%d", state.printerGifMaxLength);
         gtk_entry_set_text(GTK_ENTRY(gifheight), maxlen);
+    char bsize[12];
+    snprintf(bsize, 12, "%d", core_settings.matrix_block_size);
+    gtk_entry_set_text(GTK_ENTRY(blocksize), bsize);
+    char interval[12];
+    snprintf(interval, 12, "%d", core_settings.checkpoint_interval);
+    gtk_entry_set_text(GTK_ENTRY(checkpoint), interval);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(repaintwholedisplay), !state.old_repaint);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(corethread), state.core_thread);
 
     gtk_window_set_role(GTK_WINDOW(dialog), "Plus42 Dialog");
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        /* The core settings must not change under a running program; if one
+         * is running, it continues in the selected mode when the reminder
+         * fires.
+         */
+        pause_core_thread();
         core_settings.matrix_singularmatrix = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(singularmatrix));
         core_settings.matrix_outofrange = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(matrixoutofrange));
         core_settings.auto_repeat = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(autorepeat));
@@ -2455,7 +2657,26 @@ static void preferencesCB() {
         } else
             state.printerGifMaxLength = 256;
 
+        s = gtk_entry_get_text(GTK_ENTRY(blocksize));
+        if (sscanf(s, "%d", &core_settings.matrix_block_size) == 1) {
+            if (core_settings.matrix_block_size < 0)
+                core_settings.matrix_block_size = 0;
+            else if (core_settings.matrix_block_size > 1024)
+                core_settings.matrix_block_size = 1024;
+        } else
+            core_settings.matrix_block_size = 0;
+
+        s = gtk_entry_get_text(GTK_ENTRY(checkpoint));
+        if (sscanf(s, "%d", &core_settings.checkpoint_interval) == 1) {
+            if (core_settings.checkpoint_interval < 0)
+                core_settings.checkpoint_interval = 0;
+            else if (core_settings.checkpoint_interval > 86400)
+                core_settings.checkpoint_interval = 86400;
+        } else
+            core_settings.checkpoint_interval = 0;
+
         state.old_repaint = !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(repaintwholedisplay));
+        state.core_thread = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(corethread));
     }
 
     gtk_widget_hide(GTK_WIDGET(dialog));
@@ -2471,6 +2692,7 @@ static void appendSuffix(char *path, const char *suffix) {
 }
 
 static void copyCB() {
+    pause_core_thread();
     char *buf = core_copy();
     GtkClipboard *clip = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     gtk_clipboard_set_text(clip, buf, -1);
@@ -2481,6 +2703,7 @@ static void copyCB() {
 
 static void paste2(GtkClipboard *clip, const gchar *text, gpointer cd) {
     if (text != NULL) {
+        pause_core_thread();
         core_paste(text);
         redisplay();
         // GTK will free the text once the callback returns.
@@ -2710,6 +2933,7 @@ static gboolean print_key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
 }
 
 static void shell_keydown(bool cshift) {
+    pause_core_thread();
     GdkWindow *win = gtk_widget_get_window(calc_widget);
 
     int repeat;
@@ -2769,6 +2993,7 @@ static void shell_keydown(bool cshift) {
 }
 
 static void shell_keyup() {
+    pause_core_thread();
     GdkWindow *win = gtk_widget_get_window(calc_widget);
     skin_invalidate_key(win, skey);
 
@@ -2790,6 +3015,7 @@ static void shell_keyup() {
 }
 
 static gboolean button_cb(GtkWidget *w, GdkEventButton *event, gpointer cd) {
+    pause_core_thread();
     if (event->type == GDK_BUTTON_PRESS) {
         if (ckey == 0) {
             int win_width, win_height, skin_width, skin_height;
@@ -2812,6 +3038,7 @@ static gboolean button_cb(GtkWidget *w, GdkEventButton *event, gpointer cd) {
 }
 
 static gboolean key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
+    pause_core_thread();
     if (event->type == GDK_KEY_PRESS) {
         if (event->hardware_keycode == active_keycode)
             // Auto-repeat
@@ -3002,6 +3229,7 @@ static void disable_reminder() {
 }
 
 static gboolean repeater(gpointer cd) {
+    pause_core_thread();
     int repeat = core_repeat();
     if (repeat != 0)
         timeout_id = g_timeout_add(repeat == 1 ? 200 : repeat == 2 ? 100 : 500, repeater, NULL);
@@ -3012,6 +3240,7 @@ static gboolean repeater(gpointer cd) {
 
 static gboolean timeout1(gpointer cd) {
     if (ckey != 0) {
+        pause_core_thread();
         core_keytimeout1();
         timeout_id = g_timeout_add(1750, timeout2, NULL);
     } else
@@ -3020,13 +3249,16 @@ static gboolean timeout1(gpointer cd) {
 }
 
 static gboolean timeout2(gpointer cd) {
-    if (ckey != 0)
+    if (ckey != 0) {
+        pause_core_thread();
         core_keytimeout2();
+    }
     timeout_id = 0;
     return FALSE;
 }
 
 static gboolean timeout3(gpointer cd) {
+    pause_core_thread();
     bool keep_running = core_timeout3(true);
     timeout3_id = 0;
     if (keep_running)
@@ -3039,48 +3271,114 @@ static gboolean battery_checker(gpointer cd) {
     return TRUE;
 }
 
+/* Appends the changes since the last save to the core's journal, so a crash
+ * loses at most AUTOSAVE_INTERVAL worth of work. When the core can't journal
+ * the changes, it gets a full save instead, which starts a new journal.
+ */
+static gboolean autosaver(gpointer cd) {
+    // Not while the States dialog may be renaming or deleting state files
+    if (autosave_blocked)
+        return TRUE;
+    pause_core_thread();
+    finish_core_save();
+    char corefilename[FILENAMELEN];
+    snprintf(corefilename, FILENAMELEN, "%s/%s.p42", free42dirname, state.coreName);
+    if (!core_journal_state(corefilename))
+        save_core_state(corefilename);
+    return TRUE;
+}
+
+static void invalidate_print_tiles() {
+    for (int i = 0; i < PRINT_TILES; i++)
+        print_tile_valid[i] = false;
+}
+
+/* Makes sure the mask for the given tile reflects print_bitmap. Cairo's A1
+ * format uses the same bit order as print_bitmap on little-endian hosts, so
+ * rows can be copied as they are; big-endian hosts need each byte reversed.
+ */
+static cairo_surface_t *get_print_tile(int t) {
+    int lines = PRINT_LINES - t * PRINT_TILE_LINES;
+    if (lines > PRINT_TILE_LINES)
+        lines = PRINT_TILE_LINES;
+    if (print_tile[t] == NULL)
+        print_tile[t] = cairo_image_surface_create(CAIRO_FORMAT_A1, 286, lines);
+    if (!print_tile_valid[t]) {
+        cairo_surface_flush(print_tile[t]);
+        unsigned char *dst = cairo_image_surface_get_data(print_tile[t]);
+        int stride = cairo_image_surface_get_stride(print_tile[t]);
+        const unsigned char *src = print_bitmap + t * PRINT_TILE_LINES * PRINT_BYTESPERLINE;
+        for (int v = 0; v < lines; v++) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+            memcpy(dst, src, PRINT_BYTESPERLINE);
+#else
+            for (int i = 0; i < PRINT_BYTESPERLINE; i++)
+                dst[i] = (unsigned char) ((src[i] * 0x0202020202ULL & 0x010884422010ULL) % 1023);
+#endif
+            dst += stride;
+            src += PRINT_BYTESPERLINE;
+        }
+        cairo_surface_mark_dirty(print_tile[t]);
+        print_tile_valid[t] = true;
+    }
+    return print_tile[t];
+}
+
 static void repaint_printout(cairo_t *cr, bool dark) {
     GdkRectangle clip;
     if (!gdk_cairo_get_clip_rectangle(cr, &clip))
         gtk_widget_get_allocation(print_widget, &clip);
 
-    GdkPixbuf *buf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE,
-                                    8, clip.width, clip.height);
-    int d_bpl = gdk_pixbuf_get_rowstride(buf);
-    guchar *d1 = gdk_pixbuf_get_pixels(buf);
     int length = printout_bottom - printout_top;
     if (length < 0)
         length += PRINT_LINES;
 
-    for (int v = clip.y; v < clip.y + clip.height; v++) {
-        int v2 = printout_top + v;
-        if (v2 >= PRINT_LINES)
-            v2 -= PRINT_LINES;
-        int v3 = v2 * 36;
-        guchar *dst = d1;
-        for (int h = clip.x; h < clip.x + clip.width; h++) {
-            unsigned char c;
-            if (v >= length)
-                c = dark ? 64 : 192;
-            else if (h < 36 || h >= 322)
-                c = dark ? 18 : 255;
-            else if ((print_bitmap[v3 + ((h - 36) >> 3)] & (1 << ((h - 36) & 7))) == 0)
-                c = dark ? 18 : 255;
-            else
-                c = dark ? 219 : 0;
-            *dst++ = c;
-            *dst++ = c;
-            *dst++ = c;
-        }
-        d1 += d_bpl;
+    cairo_save(cr);
+    double paper = dark ? 18 / 255.0 : 1;
+    double ink = dark ? 219 / 255.0 : 0;
+    double beyond = dark ? 64 / 255.0 : 192 / 255.0;
+    cairo_set_source_rgb(cr, paper, paper, paper);
+    cairo_rectangle(cr, clip.x, clip.y, clip.width, clip.height);
+    cairo_fill(cr);
+    if (clip.y + clip.height > length) {
+        cairo_set_source_rgb(cr, beyond, beyond, beyond);
+        cairo_rectangle(cr, clip.x, length, clip.width, clip.y + clip.height - length);
+        cairo_fill(cr);
     }
 
-    gdk_cairo_set_source_pixbuf(cr, buf, clip.x, clip.y);
-    cairo_paint(cr);
-    g_object_unref(G_OBJECT(buf));
+    /* Paint the visible lines a tile at a time; a tile can be split between
+     * the top and the bottom of the print-out, where the ring buffer wraps.
+     */
+    cairo_set_source_rgb(cr, ink, ink, ink);
+    int end = clip.y + clip.height;
+    if (end > length)
+        end = length;
+    int v = clip.y;
+    while (v < end) {
+        int r = (printout_top + v) % PRINT_LINES;
+        int t = r / PRINT_TILE_LINES;
+        int first = t * PRINT_TILE_LINES;
+        int n = first + PRINT_TILE_LINES - r;
+        if (n > PRINT_LINES - r)
+            n = PRINT_LINES - r;
+        if (n > end - v)
+            n = end - v;
+        cairo_save(cr);
+        cairo_rectangle(cr, 36, v, 286, n);
+        cairo_clip(cr);
+        cairo_mask_surface(cr, get_print_tile(t), 36, v - (r - first));
+        cairo_restore(cr);
+        v += n;
+    }
+    cairo_restore(cr);
 }
 
 static gboolean reminder(gpointer cd) {
+    if (state.core_thread) {
+        reminder_id = 0;
+        resume_core_thread();
+        return FALSE;
+    }
     bool dummy1;
     int dummy2;
     bool keep_running = core_keydown(0, &dummy1, &dummy2);
@@ -3094,6 +3392,268 @@ static gboolean reminder(gpointer cd) {
     }
 }
 
+/* Core thread
+ *
+ * With the "Run programs on a separate thread" preference set, a running
+ * program executes on a worker thread instead of in the reminder idle
+ * callback, so it gets a full CPU instead of 10 ms slices between UI events.
+ * The worker calls core_keydown(0) for as long as the program keeps running;
+ * shell_wants_cpu() only tells it to yield when the UI thread needs the core.
+ * Every UI-thread entry into the core calls pause_core_thread() first, which
+ * parks the worker and, if the program is still running, re-arms the reminder
+ * so the worker resumes once the main loop is idle again.
+ *
+ * The worker never touches GTK. Display blits are collected in a frame buffer
+ * that the UI thread paints at a fixed frame rate; annunciator changes,
+ * printer output, beeps, messages, and timeout requests go through the
+ * core_messages queue and are handled on the UI thread in the order in which
+ * they were posted. Requests that change the skin run synchronously on the UI
+ * thread, through run_on_main_thread(), while the worker waits.
+ */
+
+#define FRAME_INTERVAL 16
+
+#define MSG_ANNUNCIATORS 0
+#define MSG_PRINT 1
+#define MSG_BEEP 2
+#define MSG_TIMEOUT3 3
+#define MSG_MESSAGE 4
+#define MSG_BATTERY 5
+#define MSG_FINISHED 6
+#define MSG_CHECKPOINT 7
+
+struct core_message {
+    int type;
+    int args[6];
+    char *text;
+    int length;
+    char *bits;
+    int bytesperline, x, width, height;
+    size_t size;
+};
+
+bool on_core_thread() {
+    return core_thread != NULL && g_thread_self() == core_thread;
+}
+
+static void handle_core_message(core_message *msg) {
+    switch (msg->type) {
+        case MSG_ANNUNCIATORS:
+            shell_annunciators(msg->args[0], msg->args[1], msg->args[2],
+                               msg->args[3], msg->args[4], msg->args[5]);
+            break;
+        case MSG_PRINT:
+            shell_print(msg->text, msg->length, msg->bits, msg->bytesperline,
+                        msg->x, 0, msg->width, msg->height);
+            break;
+        case MSG_BEEP:
+            shell_beeper(msg->args[0]);
+            break;
+        case MSG_TIMEOUT3:
+            shell_request_timeout3(msg->args[0]);
+            break;
+        case MSG_MESSAGE:
+            shell_message(msg->text);
+            break;
+        case MSG_BATTERY:
+            shell_low_battery();
+            break;
+        case MSG_FINISHED:
+            if (quit_flag)
+                quit();
+            break;
+        case MSG_CHECKPOINT:
+            write_checkpoint(msg->bits, msg->size, msg->args[0]);
+            msg->bits = NULL;
+            break;
+    }
+    free(msg->text);
+    free(msg->bits);
+    free(msg);
+}
+
+static gboolean handle_core_messages(gpointer cd) {
+    while (true) {
+        g_mutex_lock(&core_thread_mutex);
+        core_message *msg = (core_message *) g_queue_pop_head(&core_messages);
+        g_mutex_unlock(&core_thread_mutex);
+        if (msg == NULL)
+            return FALSE;
+        handle_core_message(msg);
+    }
+}
+
+static core_message *new_core_message(int type) {
+    core_message *msg = (core_message *) calloc(1, sizeof(core_message));
+    if (msg != NULL)
+        msg->type = type;
+    return msg;
+}
+
+static void post_core_message(core_message *msg) {
+    /* Out of memory; the message is simply dropped */
+    if (msg == NULL)
+        return;
+    g_mutex_lock(&core_thread_mutex);
+    if (g_queue_is_empty(&core_messages))
+        g_idle_add(handle_core_messages, NULL);
+    g_queue_push_tail(&core_messages, msg);
+    g_mutex_unlock(&core_thread_mutex);
+}
+
+/* Called with core_thread_mutex held */
+static void flush_frame_locked() {
+    if (frame_right <= frame_left)
+        return;
+    shell_blitter(frame_bits, frame_bpl, frame_left, frame_top,
+                  frame_right - frame_left, frame_bottom - frame_top);
+    frame_left = frame_right = 0;
+}
+
+static gboolean frame_cb(gpointer cd) {
+    g_mutex_lock(&core_thread_mutex);
+    flush_frame_locked();
+    bool busy = core_thread_busy;
+    g_mutex_unlock(&core_thread_mutex);
+    if (busy)
+        return TRUE;
+    frame_id = 0;
+    return FALSE;
+}
+
+static void queue_frame(const char *bits, int bytesperline, int x, int y,
+                                            int width, int height) {
+    int size = bytesperline * (y + height);
+    g_mutex_lock(&core_thread_mutex);
+    if (size > frame_size) {
+        char *new_bits = (char *) realloc(frame_bits, size);
+        if (new_bits == NULL) {
+            /* Drop the frame, and have the core send the whole display
+             * next time, since it assumes that these rows got through */
+            g_mutex_unlock(&core_thread_mutex);
+            core_display_dropped();
+            return;
+        }
+        frame_bits = new_bits;
+        frame_size = size;
+    }
+    if (bytesperline != frame_bpl) {
+        frame_bpl = bytesperline;
+        frame_left = frame_right = 0;
+    }
+    memcpy(frame_bits + y * bytesperline, bits + y * bytesperline, height * bytesperline);
+    if (frame_right <= frame_left) {
+        frame_left = x;
+        frame_top = y;
+        frame_right = x + width;
+        frame_bottom = y + height;
+    } else {
+        if (x < frame_left)
+            frame_left = x;
+        if (y < frame_top)
+            frame_top = y;
+        if (x + width > frame_right)
+            frame_right = x + width;
+        if (y + height > frame_bottom)
+            frame_bottom = y + height;
+    }
+    g_mutex_unlock(&core_thread_mutex);
+}
+
+/* Called with core_thread_mutex held */
+static void do_main_call() {
+    void (*func)(void *) = main_call;
+    void *data = main_call_data;
+    flush_frame_locked();
+    g_mutex_unlock(&core_thread_mutex);
+    in_main_call = true;
+    func(data);
+    in_main_call = false;
+    g_mutex_lock(&core_thread_mutex);
+    main_call = NULL;
+    g_cond_broadcast(&core_thread_cond);
+}
+
+static gboolean main_call_cb(gpointer cd) {
+    g_mutex_lock(&core_thread_mutex);
+    if (main_call != NULL)
+        do_main_call();
+    g_mutex_unlock(&core_thread_mutex);
+    return FALSE;
+}
+
+void run_on_main_thread(void (*func)(void *), void *data) {
+    if (!on_core_thread()) {
+        func(data);
+        return;
+    }
+    g_mutex_lock(&core_thread_mutex);
+    main_call = func;
+    main_call_data = data;
+    g_idle_add(main_call_cb, NULL);
+    g_cond_broadcast(&core_thread_cond);
+    while (main_call != NULL)
+        g_cond_wait(&core_thread_cond, &core_thread_mutex);
+    g_mutex_unlock(&core_thread_mutex);
+}
+
+static gpointer core_thread_main(gpointer cd) {
+    g_mutex_lock(&core_thread_mutex);
+    while (true) {
+        while (!core_thread_busy)
+            g_cond_wait(&core_thread_cond, &core_thread_mutex);
+        g_mutex_unlock(&core_thread_mutex);
+        bool dummy1;
+        int dummy2;
+        bool keep_running;
+        do {
+            keep_running = core_keydown(0, &dummy1, &dummy2);
+        } while (keep_running && !g_atomic_int_get(&core_thread_stop));
+        if (!keep_running)
+            post_core_message(new_core_message(MSG_FINISHED));
+        g_mutex_lock(&core_thread_mutex);
+        core_thread_keep_running = keep_running;
+        core_thread_busy = false;
+        g_cond_broadcast(&core_thread_cond);
+    }
+    return NULL;
+}
+
+static void resume_core_thread() {
+    g_mutex_lock(&core_thread_mutex);
+    if (core_thread == NULL)
+        core_thread = g_thread_new("core", core_thread_main, NULL);
+    core_thread_busy = true;
+    g_cond_broadcast(&core_thread_cond);
+    g_mutex_unlock(&core_thread_mutex);
+    if (frame_id == 0)
+        frame_id = g_timeout_add(FRAME_INTERVAL, frame_cb, NULL);
+}
+
+void pause_core_thread() {
+    if (core_thread == NULL || in_main_call)
+        return;
+    g_mutex_lock(&core_thread_mutex);
+    if (core_thread_busy) {
+        g_atomic_int_set(&core_thread_stop, 1);
+        while (core_thread_busy) {
+            if (main_call != NULL)
+                do_main_call();
+            else
+                g_cond_wait(&core_thread_cond, &core_thread_mutex);
+        }
+        g_atomic_int_set(&core_thread_stop, 0);
+        if (core_thread_keep_running && reminder_id == 0)
+            reminder_id = g_idle_add(reminder, NULL);
+    }
+    flush_frame_locked();
+    g_mutex_unlock(&core_thread_mutex);
+    /* Anything the worker posted has to be handled before the UI thread
+     * makes the core produce any new output.
+     */
+    handle_core_messages(NULL);
+}
+
 /* Callbacks used by shell_print() and shell_spool_txt() / shell_spool_gif() */
 
 static void txt_writer(const char *text, int length) {
@@ -3149,6 +3709,10 @@ static void gif_writer(const char *text, int length) {
 
 void shell_blitter(const char *bits, int bytesperline, int x, int y,
                                      int width, int height) {
+    if (on_core_thread()) {
+        queue_frame(bits, bytesperline, x, y, width, height);
+        return;
+    }
     /* In case we happen to get called at a moment when shell and core
      * are out of sync as to what size the display is...
      */
@@ -3171,6 +3735,14 @@ void shell_blitter(const char *bits, int bytesperline, int x, int y,
 }
 
 void shell_beeper(int tone) {
+    if (on_core_thread()) {
+        core_message *msg = new_core_message(MSG_BEEP);
+        if (msg != NULL) {
+            msg->args[0] = tone;
+            post_core_message(msg);
+        }
+        return;
+    }
 #ifdef AUDIO_ALSA
     const char *display_name = gdk_display_get_name(gdk_display_get_default());
     if (display_name == NULL || display_name[0] == ':') {
@@ -3201,6 +3773,19 @@ const char *shell_platform() {
 }
 
 void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    if (on_core_thread()) {
+        core_message *msg = new_core_message(MSG_ANNUNCIATORS);
+        if (msg != NULL) {
+            msg->args[0] = updn;
+            msg->args[1] = shf;
+            msg->args[2] = prt;
+            msg->args[3] = run;
+            msg->args[4] = g;
+            msg->args[5] = rad;
+            post_core_message(msg);
+        }
+        return;
+    }
     GdkWindow *win = gtk_widget_get_window(calc_widget);
 
     if (updn != -1 && ann_updown != updn) {
@@ -3239,29 +3824,42 @@ void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
 }
 
 bool shell_wants_cpu() {
-    static uint4 lastCount = 0;
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    uint4 count = tv.tv_sec * 1000L + tv.tv_usec / 1000;
-    if (count - lastCount < 10)
-        return false;
-    lastCount = count;
+    if (on_core_thread())
+        return g_atomic_int_get(&core_thread_stop) != 0;
+    /* The core only asks once per time slice (about 10 ms), so there's no
+     * need to throttle this.
+     */
     return g_main_context_pending(NULL);
 }
 
 void shell_delay(int duration) {
-    gdk_display_flush(gdk_display_get_default());
+    if (!on_core_thread())
+        gdk_display_flush(gdk_display_get_default());
     g_usleep(duration * 1000);
 }
 
 void shell_request_timeout3(int delay) {
+    if (on_core_thread()) {
+        core_message *msg = new_core_message(MSG_TIMEOUT3);
+        if (msg != NULL) {
+            msg->args[0] = delay;
+            post_core_message(msg);
+        }
+        return;
+    }
     if (timeout3_id != 0)
         g_source_remove(timeout3_id);
     timeout3_id = g_timeout_add(delay, timeout3, NULL);
 }
 
+static void request_display_size(void *data) {
+    int *size = (int *) data;
+    update_skin(size[0], size[1]);
+}
+
 void shell_request_display_size(int rows, int cols) {
-    update_skin(rows, cols);
+    int size[2] = { rows, cols };
+    run_on_main_thread(request_display_size, size);
 }
 
 uint8 shell_get_mem() {
@@ -3283,6 +3881,10 @@ uint8 shell_get_mem() {
 }
 
 bool shell_low_battery() {
+    if (on_core_thread()) {
+        post_core_message(new_core_message(MSG_BATTERY));
+        return ann_battery != 0;
+    }
 
     int lowbat = 0;
     FILE *apm = fopen("/proc/apm", "r");
@@ -3362,7 +3964,35 @@ void shell_powerdown() {
     quit_flag = true;
 }
 
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    if (on_core_thread()) {
+        core_message *msg = new_core_message(MSG_CHECKPOINT);
+        if (msg == NULL) {
+            free(buf);
+            return;
+        }
+        msg->bits = buf;
+        msg->size = size;
+        msg->args[0] = snapshot_ms;
+        post_core_message(msg);
+        return;
+    }
+    write_checkpoint(buf, size, snapshot_ms);
+}
+
 void shell_message(const char *message) {
+    if (on_core_thread()) {
+        core_message *msg = new_core_message(MSG_MESSAGE);
+        if (msg == NULL)
+            return;
+        msg->text = strclone(message);
+        if (msg->text == NULL) {
+            free(msg);
+            return;
+        }
+        post_core_message(msg);
+        return;
+    }
     show_message("Core", message);
 }
 
@@ -3432,6 +4062,9 @@ struct print_growth_info {
     print_growth_info(int yy, int hheight) : y(yy), height(hheight) {}
 };
 
+/* The growth still waiting for print_widget_grew(), if any */
+static print_growth_info *print_growth = NULL;
+
 static gboolean print_widget_grew(GtkWidget *w, GdkEventConfigure *event,
                                                                 gpointer cd) {
     print_growth_info *info = (print_growth_info *) cd;
@@ -3445,33 +4078,113 @@ static gboolean print_widget_grew(GtkWidget *w, GdkEventConfigure *event,
     gdk_window_invalidate_rect(win, &clip, FALSE);
     g_signal_handlers_disconnect_by_func(G_OBJECT(w), (gpointer) print_widget_grew, cd);
     delete info;
+    print_growth = NULL;
+    return FALSE;
+}
+
+/* Handles the growth of the print-out caused by one or more calls to
+ * shell_print(). The resize request does not take effect immediately; if
+ * we called scroll_printout_to_bottom() now, the scrolling would take place
+ * *before* the resizing, leaving the scroll bar in the wrong position. So,
+ * print_widget_grew() finishes the job once the widget has been resized.
+ */
+static gboolean print_update_cb(gpointer cd) {
+    print_update_id = 0;
+    int length = printout_bottom - printout_top;
+    if (length < 0)
+        length += PRINT_LINES;
+    if (print_update_wrapped || length <= print_update_oldlength) {
+        print_update_wrapped = false;
+        gtk_widget_set_size_request(print_widget, 358, length);
+        scroll_printout_to_bottom();
+        gtk_widget_queue_draw(print_widget);
+        return FALSE;
+    }
+    gtk_widget_set_size_request(print_widget, 358, length);
+    if (print_growth != NULL) {
+        // Still waiting for the previous resize; just extend it
+        print_growth->height = length - print_growth->y;
+    } else {
+        print_growth = new print_growth_info(print_update_oldlength, length - print_update_oldlength);
+        g_signal_connect(G_OBJECT(print_widget), "configure-event",
+                         G_CALLBACK(print_widget_grew), (gpointer) print_growth);
+    }
     return FALSE;
 }
 
 void shell_print(const char *text, int length,
                  const char *bits, int bytesperline,
                  int x, int y, int width, int height) {
-    int xx, yy;
+    if (on_core_thread()) {
+        core_message *msg = new_core_message(MSG_PRINT);
+        if (msg == NULL)
+            return;
+        if (text != NULL)
+            msg->text = (char *) malloc(length + 1);
+        msg->bits = (char *) malloc(bytesperline * height);
+        if (text != NULL && msg->text == NULL || msg->bits == NULL) {
+            free(msg->text);
+            free(msg->bits);
+            free(msg);
+            return;
+        }
+        if (text != NULL) {
+            memcpy(msg->text, text, length);
+            msg->length = length;
+        }
+        memcpy(msg->bits, bits + y * bytesperline, bytesperline * height);
+        msg->bytesperline = bytesperline;
+        msg->x = x;
+        msg->width = width;
+        msg->height = height;
+        post_core_message(msg);
+        return;
+    }
+
     int oldlength, newlength;
 
-    for (yy = 0; yy < height; yy++) {
+    /* Each printed pixel becomes 2x2 pixels in print_bitmap; the horizontal
+     * doubling is done a byte at a time, using print_double.
+     */
+    if (!print_double_ready) {
+        for (int i = 0; i < 256; i++) {
+            unsigned short d = 0;
+            for (int b = 0; b < 8; b++)
+                if (i & (1 << b))
+                    d |= 3 << (2 * b);
+            print_double[i] = d;
+        }
+        print_double_ready = true;
+    }
+    for (int yy = 0; yy < height; yy++) {
         int4 Y = (printout_bottom + 2 * yy) % PRINT_LINES;
-        for (xx = 0; xx < 143; xx++) {
-            int bit, px, py;
+        const unsigned char *src = (const unsigned char *) bits + (y + yy) * bytesperline;
+        unsigned char *dst = print_bitmap + Y * PRINT_BYTESPERLINE;
+        for (int i = 0; i < 18; i++) {
+            int xx = i * 8;
+            unsigned int c = 0;
             if (xx < width) {
-                char c = bits[(y + yy) * bytesperline + ((x + xx) >> 3)];
-                bit = (c & (1 << ((x + xx) & 7))) != 0;
-            } else
-                bit = 0;
-            for (px = xx * 2; px < (xx + 1) * 2; px++)
-                for (py = Y; py < Y + 2; py++)
-                    if (bit)
-                        print_bitmap[py * PRINT_BYTESPERLINE + (px >> 3)]
-                            |= 1 << (px & 7);
-                    else
-                        print_bitmap[py * PRINT_BYTESPERLINE + (px >> 3)]
-                            &= ~(1 << (px & 7));
+                int X = x + xx;
+                c = src[X >> 3] >> (X & 7);
+                if ((X & 7) != 0 && ((X + 7) >> 3) < bytesperline)
+                    c |= src[(X >> 3) + 1] << (8 - (X & 7));
+                if (width - xx < 8)
+                    c &= (1 << (width - xx)) - 1;
+                c &= 255;
+            }
+            unsigned short d = print_double[c];
+            dst[2 * i] = (unsigned char) d;
+            if (i < 17)
+                dst[2 * i + 1] = (unsigned char) (d >> 8);
+            else
+                // Only 143 pixels per line; leave the last two bits alone
+                dst[35] = (dst[35] & 0xc0) | ((d >> 8) & 0x3f);
         }
+        unsigned char *dst2 = dst + PRINT_BYTESPERLINE;
+        memcpy(dst2, dst, 35);
+        dst2[35] = (dst2[35] & 0xc0) | (dst[35] & 0x3f);
+        print_tile_valid[Y / PRINT_TILE_LINES] = false;
+        print_tile_valid[(Y + 1) / PRINT_TILE_LINES] = false;
     }
 
     oldlength = printout_bottom - printout_top;
@@ -3480,23 +4193,13 @@ void shell_print(const char *text, int length,
     printout_bottom = (printout_bottom + 2 * height) % PRINT_LINES;
     newlength = oldlength + 2 * height;
 
+    if (print_update_id == 0) {
+        print_update_oldlength = oldlength;
+        print_update_id = g_idle_add(print_update_cb, NULL);
+    }
     if (newlength >= PRINT_LINES) {
         printout_top = (printout_bottom + 2) % PRINT_LINES;
-        newlength = PRINT_LINES - 2;
-        if (newlength != oldlength)
-            gtk_widget_set_size_request(print_widget, 358, newlength);
-        scroll_printout_to_bottom();
-        gtk_widget_queue_draw(print_widget);
-    } else {
-        gtk_widget_set_size_request(print_widget, 358, newlength);
-        // The resize request does not take effect immediately;
-        // if I call scroll_printout_to_bottom() now, the scrolling will take
-        // place *before* the resizing, leaving the scroll bar in the wrong
-        // position.
-        // I work around this by using a callback to finish the job.
-        g_signal_connect(G_OBJECT(print_widget), "configure-event",
-                         G_CALLBACK(print_widget_grew),
-                         (gpointer) new print_growth_info(oldlength, 2 * height));
+        print_update_wrapped = true;
     }
 
     if (state.printerToTxtFile) {
@@ -27,7 +27,7 @@ extern GtkWidget *mainwindow;
 extern bool allow_paint;
 extern int disp_rows, disp_cols;
 
-#define SHELL_VERSION 10
+#define SHELL_VERSION 13
 
 struct state_type {
     int extras;
@@ -48,6 +48,9 @@ struct state_type {
     bool old_repaint;
     bool localized_copy_paste;
     int mainWindowWidth, mainWindowHeight;
+    int matrix_block_size;
+    bool core_thread;
+    int checkpoint_interval;
 };
 
 extern state_type state;
@@ -82,5 +85,9 @@ extern int menu_bar_height;
 
 void get_keymap(keymap_entry **map, int *length);
 
+bool on_core_thread();
+void pause_core_thread();
+void run_on_main_thread(void (*func)(void *), void *data);
+
 
 #endif
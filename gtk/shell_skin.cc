@@ -116,8 +116,11 @@ static int skin_y;
 static int skin_type;
 static const SkinColor *skin_cmap;
 
-static char *disp_bits = NULL;
-static int disp_bpl;
+/* The display pixels, as a 1-bit alpha mask, so that repainting the display
+ * is a single scaled blit of the foreground color through this mask, rather
+ * than one fill per pixel. skin_display_invalidater() keeps it up to date.
+ */
+static cairo_surface_t *disp_surface = NULL;
 
 static keymap_entry *keymap = NULL;
 static int keymap_length;
@@ -202,6 +205,7 @@ static void selectSkinCB(GtkWidget *w, gpointer cd) {
 
 void update_skin(int rows, int cols) {
     int old_w, old_h, old_win_w, old_win_h;
+    pause_core_thread();
     bool dispResize = rows != -1;
     if (dispResize) {
         skin_get_size(&old_w, &old_h);
@@ -221,13 +225,17 @@ void update_skin(int rows, int cols) {
     gtk_widget_queue_draw(calc_widget);
 }
 
-void shell_set_skin_mode(int mode) {
+static void set_skin_mode(void *data) {
     int old_mode = skin_mode;
-    skin_mode = mode;
+    skin_mode = *(int *) data;
     if (skin_mode != old_mode && calc_widget != NULL)
         gtk_widget_queue_draw(calc_widget);
 }
 
+void shell_set_skin_mode(int mode) {
+    run_on_main_thread(set_skin_mode, &mode);
+}
+
 static bool skin_open(const char *name, bool open_layout, bool force_builtin) {
     if (!force_builtin) {
         const char *suffix = open_layout ? ".layout" : ".gif";
@@ -821,12 +829,9 @@ void skin_load(int *width, int *height, int *rows, int *cols, int *flags) {
     disp_w = disp_cols * 6 - 1;
     disp_h = disp_rows * 8;
 
-    if (disp_bits != NULL)
-        free(disp_bits);
-    disp_bpl = (disp_w + 7) >> 3;
-    int size = disp_bpl * disp_h;
-    disp_bits = (char *) malloc(size);
-    memset(disp_bits, 0, size);
+    if (disp_surface != NULL)
+        cairo_surface_destroy(disp_surface);
+    disp_surface = cairo_image_surface_create(CAIRO_FORMAT_A1, disp_w, disp_h);
 
     *rows = disp_rows;
     *cols = disp_cols;
@@ -1235,6 +1240,23 @@ unsigned char *skin_keymap_lookup(guint keyval, bool printable,
     return macro;
 }
 
+/* Paints the display, within the current clip, in display coordinates:
+ * the background color, and then the foreground color through the display
+ * mask, scaled without smoothing, so the pixels stay sharp. With inverse,
+ * the colors are swapped, for highlighted soft keys.
+ */
+static void paint_display_pixels(cairo_t *cr, bool inverse) {
+    const SkinColor &bg = inverse ? display_fg : display_bg;
+    const SkinColor &fg = inverse ? display_bg : display_fg;
+    cairo_set_source_rgb(cr, bg.r / 255.0, bg.g / 255.0, bg.b / 255.0);
+    cairo_paint(cr);
+    cairo_set_source_rgb(cr, fg.r / 255.0, fg.g / 255.0, fg.b / 255.0);
+    cairo_pattern_t *mask = cairo_pattern_create_for_surface(disp_surface);
+    cairo_pattern_set_filter(mask, CAIRO_FILTER_NEAREST);
+    cairo_mask(cr, mask);
+    cairo_pattern_destroy(mask);
+}
+
 void skin_repaint_key(cairo_t *cr, int key, bool state) {
     SkinKey *k;
 
@@ -1257,28 +1279,12 @@ void skin_repaint_key(cairo_t *cr, int key, bool state) {
         cairo_clip(cr);
         cairo_set_source_rgb(cr, display_bg.r / 255.0, display_bg.g / 255.0, display_bg.b / 255.0);
         cairo_paint(cr);
-        cairo_set_source_rgb(cr, display_fg.r / 255.0, display_fg.g / 255.0, display_fg.b / 255.0);
-
-        if (x < 0)
-            x = 0;
-        if (y < 0)
-            y = 0;
-        if (x + width > disp_w)
-            width = disp_w - x;
-        if (y + height > disp_h)
-            height = disp_h - y;
-
-        for (int v = y; v < y + height; v++) {
-            bool in_key_v = v >= ky && v < ky + kh;
-            for (int h = x; h < x + width; h++) {
-                bool ks = !(in_key_v && h >= kx && h < kx + kw) ^ state;
-                if (((disp_bits[v * disp_bpl + (h >> 3)] & (1 << (h & 7))) != 0) != ks) {
-                    cairo_rectangle(cr, h, v, 1, 1);
-                    cairo_fill(cr);
-                }
-            }
-        }
-
+        cairo_rectangle(cr, 0, 0, disp_w, disp_h);
+        cairo_clip(cr);
+        paint_display_pixels(cr, !state);
+        cairo_rectangle(cr, kx, ky, kw, kh);
+        cairo_clip(cr);
+        paint_display_pixels(cr, state);
         cairo_restore(cr);
         return;
     }
@@ -1349,14 +1355,50 @@ void skin_invalidate_key(GdkWindow *win, int key) {
     scaled_gdk_window_invalidate_rect(win, &clip, FALSE);
 }
 
+/* The core's display bitmap stores the leftmost pixel of each byte in the
+ * least significant bit; Cairo's A1 format does the same on little-endian
+ * hosts, so bytes can be copied as they are, but on big-endian hosts, the
+ * leftmost pixel is the most significant bit, so each byte must be reversed.
+ */
+static inline unsigned char a1_bits(unsigned char b) {
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    return b;
+#else
+    return (unsigned char) ((b * 0x0202020202ULL & 0x010884422010ULL) % 1023);
+#endif
+}
+
 void skin_display_invalidater(GdkWindow *win, const char *bits, int bytesperline,
                                         int x, int y, int width, int height) {
-    for (int v = y; v < y + height; v++)
-        for (int h = x; h < x + width; h++)
-            if ((bits[v * bytesperline + (h >> 3)] & (1 << (h & 7))) != 0)
-                disp_bits[v * disp_bpl + (h >> 3)] |= 1 << (h & 7);
-            else
-                disp_bits[v * disp_bpl + (h >> 3)] &= ~(1 << (h & 7));
+    if (width > 0 && height > 0) {
+        /* Copy the affected rows a byte at a time, masking only the bytes at
+         * the left and right edges of the updated area.
+         */
+        cairo_surface_flush(disp_surface);
+        unsigned char *dst = cairo_image_surface_get_data(disp_surface);
+        int stride = cairo_image_surface_get_stride(disp_surface);
+        int first = x >> 3;
+        int last = (x + width - 1) >> 3;
+        unsigned char lmask = 0xff << (x & 7);
+        unsigned char rmask = 0xff >> (7 - ((x + width - 1) & 7));
+        if (first == last)
+            lmask &= rmask;
+        for (int v = y; v < y + height; v++) {
+            const unsigned char *s = (const unsigned char *) bits + v * bytesperline;
+            unsigned char *d = dst + v * stride;
+            d[first] = a1_bits((a1_bits(d[first]) & ~lmask) | (s[first] & lmask));
+            if (last == first)
+                continue;
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+            memcpy(d + first + 1, s + first + 1, last - first - 1);
+#else
+            for (int i = first + 1; i < last; i++)
+                d[i] = a1_bits(s[i]);
+#endif
+            d[last] = a1_bits((a1_bits(d[last]) & ~rmask) | (s[last] & rmask));
+        }
+        cairo_surface_mark_dirty_rectangle(disp_surface, x, y, width, height);
+    }
 
     if (win != NULL) {
         if (allow_paint) {
@@ -1391,17 +1433,7 @@ void skin_repaint_display(cairo_t *cr) {
     cairo_scale(cr, display_scale_x, display_scale_y);
     cairo_rectangle(cr, -1, -1, disp_w + 2, disp_h + 2);
     cairo_clip(cr);
-    cairo_set_source_rgb(cr, display_bg.r / 255.0, display_bg.g / 255.0, display_bg.b / 255.0);
-    cairo_paint(cr);
-    cairo_set_source_rgb(cr, display_fg.r / 255.0, display_fg.g / 255.0, display_fg.b / 255.0);
-    for (int v = 0; v < disp_h; v++) {
-        for (int h = 0; h < disp_w; h++) {
-            if ((disp_bits[v * disp_bpl + (h >> 3)] & (1 << (h & 7))) != 0) {
-                cairo_rectangle(cr, h, v, 1, 1);
-                cairo_fill(cr);
-            }
-        }
-    }
+    paint_display_pixels(cr, false);
     cairo_restore(cr);
 }
 
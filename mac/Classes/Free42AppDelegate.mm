@@ -1857,6 +1857,11 @@ bool shell_wants_cpu() {
         || now.tv_sec == runner_end_time.tv_sec && now.tv_usec >= runner_end_time.tv_usec;
 }
 
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    // This shell doesn't offer checkpoints
+    free(buf);
+}
+
 static void read_key_map(const char *keymapfilename) {
     FILE *keymapfile = fopen(keymapfilename, "r");
     int kmcap = 0;
@@ -2325,6 +2325,11 @@ bool shell_wants_cpu() {
     return PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE) != 0;
 }
 
+void shell_checkpoint(char *buf, size_t size, uint4 snapshot_ms) {
+    // This shell doesn't offer checkpoints
+    free(buf);
+}
+
 void shell_delay(int duration) {
     Sleep(duration);
 }